@@ -7,8 +7,57 @@
 #include <limits>    // 數值限制
 #include <thread>    // 用於延遲顯示
 #include <chrono>    // 時間相關函式
+#include <unordered_map> // 雜湊表
+#include <functional> // 函式物件
+#include <cstdint>    // 固定寬度整數
+#include <map>        // 有序表
+#include <queue>      // 優先佇列
+#include <cstdlib>    // atoi / atoll
+#include <atomic>     // 原子計數器
+#include <iomanip>    // 輸出格式
+#include <deque>      // 雙端佇列
+#include <fstream>    // 檔案輸出入
+#include <cstring>    // memcpy
+#include <memory>     // shared_ptr
+#include <mutex>      // 互斥鎖
+#include <condition_variable> // 條件變數
+#include <csignal>    // 訊號處理
+#include <sstream>    // 字串串流
+#include <new>        // 全域 new/delete 取代
+#include <cerrno>     // errno
+#ifndef _WIN32
+#include <fcntl.h>    // open
+#include <poll.h>     // 等待輸入 (逾時)
+#include <termios.h>  // 終端機原始模式
+#include <sys/socket.h> // 本機連線
+#include <sys/un.h>     // Unix domain socket
+#include <sys/stat.h> // fstat
+#include <sys/mman.h> // 共享記憶體與記憶體映射檔
+#include <sys/wait.h> // 等待子行程
+#include <unistd.h>   // fork
+#endif
+#ifdef __linux__
+#include <elf.h>        // 讀取執行檔符號表
+#include <link.h>       // dl_iterate_phdr
+#include <execinfo.h>   // backtrace
+#include <ucontext.h>   // 被中斷的指令位址
+#include <sys/time.h>   // setitimer
+#include <cxxabi.h>     // 符號解碼
+#endif
 using namespace std;
 
+// 內聯控制：熱路徑上強制內聯或禁止內聯 (不支援的編譯器交給最佳化器決定)
+#if defined(__GNUC__)
+#define FORCE_INLINE __attribute__((always_inline)) inline
+#define NO_INLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#define NO_INLINE __declspec(noinline)
+#else
+#define FORCE_INLINE inline
+#define NO_INLINE
+#endif
+
 // ==========================================
 // 輔助函式區 (Helper Functions)
 // ==========================================
@@ -24,6 +73,26 @@ void setupConsole() {
     // Linux/macOS 通常預設就支援 UTF-8 和 ANSI 顏色，不需額外設定
 }
 #endif
+// 依分隔字元切割字串 (略過空欄位)
+vector<string> splitList(const string& text, char sep) {
+    vector<string> out;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(sep, start);
+        if (end == string::npos) end = text.size();
+        if (end > start) out.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return out;
+}
+
+// 解析以逗號分隔的整數列表
+vector<int> parseIntList(const string& text) {
+    vector<int> out;
+    for (const auto& item : splitList(text, ',')) out.push_back(atoi(item.c_str()));
+    return out;
+}
+
 //  ANSI顏色代碼
 #if (true) // 如果支援 ANSI 顏色
 namespace Color {
@@ -53,28 +122,466 @@ namespace Color {
 }
 #endif
 
-// 隨機數生成器
-inline int getRandom(int min, int max) {
+// ==========================================
+// 記憶體統計 (Memory Accounting)
+// ==========================================
+
+// 取代全域 new/delete：每塊前面多放 16 位元組標頭記下大小與所屬子系統，計入各子系統的存活位元組、
+// 峰值與配置次數。子系統取自執行緒目前的標記 (Memory::Scope)，角色、技能、道具物件本身則由類別的
+// operator new 直接標記；釋放時依標頭記帳，跨子系統釋放也不會算錯。
+// 計數記在各執行緒自己的帳本 (只有擁有者寫入，不需 lock 指令)，查詢時加總；執行緒結束時帳本併入共用帳。
+// 多執行緒時峰值為各執行緒峰值的和 (上界)，單執行緒時為精確值
+namespace Memory {
+    enum Tag : uint8_t { OTHER, CHARACTERS, SKILLS, ITEMS, INVENTORY, STRINGS, MONSTERS, BATTLE, TAG_COUNT };
+    const char* const TAG_NAMES[TAG_COUNT] = {"其他", "角色", "技能", "道具", "背包", "字串", "怪物", "戰鬥"};
+    const int TOTAL = TAG_COUNT; // 計數器最後一格為總計
+    const size_t HEADER = 16;    // 保持 malloc 的 16 位元組對齊
+    struct Header { uint64_t size; uint8_t tag; };
+    static_assert(sizeof(Header) <= HEADER, "標頭超過保留空間");
+
+    struct Counter { atomic<long long> live, peak, allocs, frees; };
+    // 執行緒帳本 (零初始化，存取不經過 thread_local 的初始化檢查)
+    struct Ledger {
+        Counter counters[TAG_COUNT + 1];
+        Ledger* next;
+        bool enrolled, retired;
+    };
+    thread_local Ledger ledger;
+    mutex registryLock;
+    Ledger* registry = nullptr;         // 執行中執行緒的帳本
+    Counter shared[TAG_COUNT + 1];      // 已結束執行緒的帳 (以原子加法併入)
+    thread_local Tag current = OTHER;
+
+    // 標記範圍：範圍內的配置記在指定子系統
+    class Scope {
+        Tag prev;
+    public:
+        explicit Scope(Tag t) : prev(current) { current = t; }
+        ~Scope() { current = prev; }
+    };
+
+    // 帳本只有擁有者寫入：讀出再寫回即可，查詢端以 relaxed 讀取
+    inline void add(atomic<long long>& a, long long d) { a.store(a.load(memory_order_relaxed) + d, memory_order_relaxed); }
+    inline void noteAlloc(Counter& c, long long n) {
+        long long now = c.live.load(memory_order_relaxed) + n;
+        c.live.store(now, memory_order_relaxed);
+        add(c.allocs, 1);
+        if (now > c.peak.load(memory_order_relaxed)) c.peak.store(now, memory_order_relaxed);
+    }
+    inline void noteFree(Counter& c, long long n) { add(c.live, -n); add(c.frees, 1); }
+    // 共用帳可能同時被多個執行緒寫入，使用原子加法
+    void noteShared(Counter& c, long long n, bool alloc) {
+        long long now = c.live.fetch_add(n, memory_order_relaxed) + n;
+        (alloc ? c.allocs : c.frees).fetch_add(1, memory_order_relaxed);
+        long long peak = c.peak.load(memory_order_relaxed);
+        while (now > peak && !c.peak.compare_exchange_weak(peak, now, memory_order_relaxed)) {}
+    }
+
+    // 執行緒結束時把帳本併入共用帳 (之後此執行緒的配置直接記在共用帳)
+    struct Retire {
+        ~Retire() {
+            lock_guard<mutex> guard(registryLock);
+            for (Ledger** p = &registry; *p; p = &(*p)->next) if (*p == &ledger) { *p = ledger.next; break; }
+            for (int t = 0; t <= TOTAL; ++t) {
+                Counter& from = ledger.counters[t];
+                Counter& to = shared[t];
+                to.live += from.live.load(); to.peak += from.peak.load();
+                to.allocs += from.allocs.load(); to.frees += from.frees.load();
+            }
+            ledger.retired = true;
+        }
+    };
+    // 第一次配置時登記帳本
+    NO_INLINE Ledger* enroll() {
+        if (ledger.retired) return nullptr;
+        {
+            lock_guard<mutex> guard(registryLock);
+            ledger.next = registry;
+            registry = &ledger;
+            ledger.enrolled = true;
+        }
+        static thread_local Retire retire; // 只在這裡觸及，一般配置不付 thread_local 解構的檢查成本
+        (void)retire;
+        return &ledger;
+    }
+    inline Ledger* mine() { return ledger.enrolled && !ledger.retired ? &ledger : enroll(); }
+    inline void record(int tag, long long n, bool alloc) {
+        Ledger* l = mine();
+        if (!l) { noteShared(shared[tag], alloc ? n : -n, alloc); noteShared(shared[TOTAL], alloc ? n : -n, alloc); return; }
+        if (alloc) { noteAlloc(l->counters[tag], n); noteAlloc(l->counters[TOTAL], n); }
+        else { noteFree(l->counters[tag], n); noteFree(l->counters[TOTAL], n); }
+    }
+
+    inline void* allocate(size_t n, Tag tag) {
+        char* p = (char*)malloc(n + HEADER);
+        if (!p) return nullptr;
+        Header* h = (Header*)p;
+        h->size = n; h->tag = tag;
+        record(tag, n, true);
+        return p + HEADER;
+    }
+    inline void* allocateOrThrow(size_t n, Tag tag) {
+        void* p = allocate(n, tag);
+        if (!p) throw bad_alloc();
+        return p;
+    }
+    inline void release(void* ptr) {
+        if (!ptr) return;
+        char* p = (char*)ptr - HEADER;
+        const Header* h = (const Header*)p;
+        record(h->tag < TAG_COUNT ? (Tag)h->tag : OTHER, h->size, false);
+        free(p);
+    }
+
+    // 某子系統 (或 TOTAL) 的目前數值 (加總所有帳本)
+    struct Usage { long long live, peak, allocs, frees; };
+    Usage sumLocked(int tag) {
+        Usage u = {shared[tag].live.load(), shared[tag].peak.load(), shared[tag].allocs.load(), shared[tag].frees.load()};
+        for (const Ledger* l = registry; l; l = l->next) {
+            const Counter& c = l->counters[tag];
+            u.live += c.live.load(memory_order_relaxed); u.peak += c.peak.load(memory_order_relaxed);
+            u.allocs += c.allocs.load(memory_order_relaxed); u.frees += c.frees.load(memory_order_relaxed);
+        }
+        return u;
+    }
+    Usage usage(int tag) {
+        lock_guard<mutex> guard(registryLock);
+        return sumLocked(tag);
+    }
+    // 目前執行緒的峰值歸零為目前用量 (量測某段工作的峰值前呼叫)
+    void resetPeaks() {
+        Ledger* l = mine();
+        for (int t = 0; t <= TOTAL && l; ++t) l->counters[t].peak.store(l->counters[t].live.load());
+    }
+
+    // 報表：只用呼叫端的緩衝區，不配置記憶體 (呼叫端須持有 registryLock)
+    size_t formatLocked(char* buf, size_t cap) {
+        size_t len = 0;
+        auto text = [&](const char* s) { while (*s && len < cap) buf[len++] = *s++; };
+        auto number = [&](long long v, int width) {
+            char digits[24];
+            int n = 0;
+            bool neg = v < 0;
+            unsigned long long u = neg ? -(unsigned long long)v : v;
+            do { digits[n++] = '0' + u % 10; u /= 10; } while (u);
+            if (neg) digits[n++] = '-';
+            for (int pad = width - n; pad > 0 && len < cap; --pad) buf[len++] = ' ';
+            while (n > 0 && len < cap) buf[len++] = digits[--n];
+        };
+        text("子系統      存活位元組      峰值位元組      配置次數    存活塊數\n");
+        for (int t = 0; t <= TOTAL; ++t) {
+            Usage u = sumLocked(t);
+            if (t < TOTAL && u.allocs == 0) continue;
+            text(t < TOTAL ? TAG_NAMES[t] : "總計");
+            text("\t");
+            number(u.live, 14); number(u.peak, 16); number(u.allocs, 14); number(u.allocs - u.frees, 12);
+            text("\n");
+        }
+        return len;
+    }
+    size_t format(char* buf, size_t cap) {
+        lock_guard<mutex> guard(registryLock);
+        return formatLocked(buf, cap);
+    }
+    void report(ostream& os) {
+        char buf[2048];
+        os.write(buf, format(buf, sizeof(buf)));
+        os.flush();
+    }
+    // 隨時查詢：kill -USR1 <pid> 只設旗標，由主要迴圈呼叫 poll 時寫出報表到標準錯誤
+    // (訊號處理函式不可取鎖或配置記憶體；等待輸入時要到下一次輸入後才會輸出)
+    volatile sig_atomic_t reportRequested = 0;
+#ifndef _WIN32
+    void onSignal(int) { reportRequested = 1; }
+#endif
+    void poll() {
+        if (!reportRequested) return;
+        char buf[2048];
+        size_t len;
+        {
+            lock_guard<mutex> guard(registryLock); // 多個執行緒同時看到旗標時只輸出一次
+            if (!reportRequested) return;
+            reportRequested = 0;
+            len = formatLocked(buf, sizeof(buf));
+        }
+        fwrite(buf, 1, len, stderr);
+    }
+    // 結束時報表 (atexit 呼叫)
+    void reportAtExit() {
+        char buf[2048];
+        size_t len = format(buf, sizeof(buf));
+        fwrite(buf, 1, len, stderr);
+    }
+}
+void* operator new(size_t n) { return Memory::allocateOrThrow(n, Memory::current); }
+void* operator new[](size_t n) { return Memory::allocateOrThrow(n, Memory::current); }
+void* operator new(size_t n, const nothrow_t&) noexcept { return Memory::allocate(n, Memory::current); }
+void* operator new[](size_t n, const nothrow_t&) noexcept { return Memory::allocate(n, Memory::current); }
+void operator delete(void* p) noexcept { Memory::release(p); }
+void operator delete[](void* p) noexcept { Memory::release(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { Memory::release(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { Memory::release(p); }
+// C++14 起編譯器會改呼叫帶大小的版本；大小由標頭記錄，直接轉給一般版本
+void operator delete(void* p, size_t) noexcept { Memory::release(p); }
+void operator delete[](void* p, size_t) noexcept { Memory::release(p); }
+
+// 可重現的亂數流 (splitmix64)：狀態只有種子與計數器，方便模擬時重播
+struct RngStream {
+    uint64_t seed = 0;    // 亂數流編號
+    uint64_t counter = 0; // 已取用的亂數個數
+    uint64_t flip = 0;    // 全 1 時為對偶亂數流 (每個均勻亂數 u 換成 1-u)
+    RngStream(uint64_t s = 0) : seed(s) {}
+    uint64_t next() {
+        uint64_t z = seed * 0xD1B54A32D192ED03ULL + (++counter) * 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return (z ^ (z >> 31)) ^ flip;
+    }
+    int range(int min, int max) { return min + (int)(((next() >> 32) * (uint64_t)(max - min + 1)) >> 32); }
+};
+// 無頭模式狀態 (每個執行緒獨立)：啟用時不輸出、不延遲，亂數改取自指定亂數流
+thread_local bool headless = false;
+thread_local RngStream* activeRng = nullptr;
+// 傷害運氣：實際傷害減去擲骰前的解析期望值 (暴擊、閃避) 的累計，期望值為 0，作為變異數縮減的控制變量；nullptr 時不記錄
+struct DamageLuck { double dealt = 0, taken = 0; };
+thread_local DamageLuck* damageLuck = nullptr;
+// 在範圍內改用指定亂數流，離開時還原
+class RngScope {
+    RngStream* prev;
+public:
+    explicit RngScope(RngStream& rng) : prev(activeRng) { activeRng = &rng; }
+    ~RngScope() { activeRng = prev; }
+};
+
+// 隨機數生成器 (互動模式的全域亂數另成函式，無頭模式的熱路徑只剩亂數流)
+NO_INLINE int globalRandom(int min, int max) {
     static random_device rd;                      // 隨機數種子
     static mt19937 gen(rd());                     // 梅森旋轉演算法
     uniform_int_distribution<> distrib(min, max); // 均勻分佈
     return distrib(gen);                          // 生成隨機數
 }
+inline int getRandom(int min, int max) { return activeRng ? activeRng->range(min, max) : globalRandom(min, max); }
+
+// 加權抽樣表 (Vose Alias Method)：建表 O(n)，每次抽樣 O(1)
+class AliasTable {
+    static const int SCALE = 1 << 16; // 機率定點數精度
+    vector<int> prob;                 // 保留本欄位的機率 (定點數)
+    vector<int> alias;                // 未保留時改取的欄位
+public:
+    void build(const vector<double>& weights);
+    bool empty() const { return prob.empty(); }
+    int size() const { return prob.size(); }
+    // 一次亂數同時決定欄位與擲硬幣結果
+    int sample() const {
+        int r = getRandom(0, (int)prob.size() * SCALE - 1);
+        int col = r / SCALE;
+        return (r % SCALE < prob[col]) ? col : alias[col];
+    }
+};
+const int AliasTable::SCALE;
+// 建表實作
+void AliasTable::build(const vector<double>& weights) {
+    prob.clear(); alias.clear();
+    double total = 0;
+    for (double w : weights) total += w;
+    if (weights.empty() || total <= 0) return;
+    int n = weights.size();
+    prob.assign(n, SCALE);
+    alias.resize(n);
+    vector<double> scaled(n);
+    vector<int> small, large;
+    for (int i = 0; i < n; ++i) {
+        alias[i] = i;
+        scaled[i] = weights[i] * n / total;
+        if (scaled[i] < 1.0) small.push_back(i); else large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(); small.pop_back();
+        int l = large.back(); large.pop_back();
+        prob[s] = (int)(scaled[s] * SCALE);
+        alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) small.push_back(l); else large.push_back(l);
+    }
+    // 剩下的欄位只差浮點誤差，機率視為 1 (prob 已預設為 SCALE)
+}
+
+// 遊戲邏輯的輸出串流 (無頭模式下導向空串流)
+inline ostream& out() {
+    thread_local ostream nullStream(nullptr);
+    return headless ? nullStream : cout;
+}
+
+// 原始模式鍵盤輸入：背景執行緒逐鍵讀取並解碼方向鍵，放入事件佇列；只在互動模式且標準輸入為終端機時啟用
+namespace Input {
+    enum Key { KEY_NONE = -1, KEY_ENTER = '\n', KEY_SPACE = ' ', KEY_ESC = 27, KEY_BACKSPACE = 127, KEY_UP = 256, KEY_DOWN, KEY_RIGHT, KEY_LEFT };
+    mutex lock;
+    condition_variable ready;
+    deque<int> keys;           // 尚未處理的按鍵 (預先輸入)
+    bool closed = false;       // 輸入已結束
+    atomic<bool> active(false);
+    // 放入一個按鍵並喚醒等待者
+    void push(int key) {
+        { lock_guard<mutex> g(lock); if (key == KEY_NONE) closed = true; else keys.push_back(key); }
+        ready.notify_all();
+    }
+#ifndef _WIN32
+    termios saved, raw; // 啟用前的終端機設定、原始模式設定
+    void stop() { if (active.exchange(false)) tcsetattr(STDIN_FILENO, TCSANOW, &saved); }
+    // 中斷或致命錯誤時先還原終端機再以預設行為結束
+    void onSignal(int sig) { tcsetattr(STDIN_FILENO, TCSANOW, &saved); signal(sig, SIG_DFL); raise(sig); }
+    // 回到前景：重新進入原始模式 (Ctrl+Z 之後的 fg，或被 SIGSTOP 暫停後繼續)
+    void onContinue(int) { if (active) tcsetattr(STDIN_FILENO, TCSANOW, &raw); }
+    // Ctrl+Z：還原終端機後以預設行為暫停，繼續執行時重新掛上處理函式並回到原始模式
+    void onStop(int sig) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        signal(sig, SIG_DFL);
+        sigset_t pending;
+        sigemptyset(&pending);
+        sigaddset(&pending, sig);
+        sigprocmask(SIG_UNBLOCK, &pending, nullptr); // 處理函式執行中本訊號被擋住，先解除才會真的暫停
+        raise(sig);
+        signal(sig, onStop);
+        onContinue(SIGCONT);
+    }
+    // 讀取一個位元組 (timeoutMs < 0 表示一直等；逾時或結束回傳 -1)
+    int readByte(int timeoutMs) {
+        if (timeoutMs >= 0) {
+            pollfd p = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&p, 1, timeoutMs) <= 0) return -1;
+        }
+        unsigned char c;
+        return read(STDIN_FILENO, &c, 1) == 1 ? c : -1;
+    }
+    // 讀取迴圈：方向鍵為 ESC [ A~D (或 ESC O A~D)，單獨的 ESC 後面不會立即接著其他位元組
+    void readerLoop() {
+        while (true) {
+            int c = readByte(-1);
+            if (c < 0) { push(KEY_NONE); return; }
+            if (c == '\r') c = KEY_ENTER;
+            else if (c == '\b') c = KEY_BACKSPACE;
+            else if (c == KEY_ESC) {
+                int b = readByte(10);
+                if (b == '[' || b == 'O') {
+                    int f = readByte(10);
+                    if (f < 'A' || f > 'D') continue; // 不支援的控制序列
+                    c = KEY_UP + (f - 'A');
+                } else if (b >= 0) {
+                    push(KEY_ESC);
+                    c = b;
+                }
+            }
+            push(c);
+        }
+    }
+#else
+    void stop() {}
+#endif
+    // 進入原始模式並啟動讀取執行緒 (非終端機或不支援時回傳 false，沿用逐行輸入)
+    bool start() {
+#ifndef _WIN32
+        if (active || !isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) return false;
+        raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO); // 逐鍵讀取、不回顯 (保留 Ctrl+C)
+        raw.c_cc[VMIN] = 1; raw.c_cc[VTIME] = 0;
+        if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) return false;
+        active = true;
+        atexit(stop);
+        for (int sig : {SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGPIPE, SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) signal(sig, onSignal);
+        signal(SIGTSTP, onStop);
+        signal(SIGCONT, onContinue);
+        thread(readerLoop).detach();
+        return true;
+#else
+        return false;
+#endif
+    }
+    // 等待下一個按鍵 (輸入結束回傳 KEY_NONE)
+    int waitKey() {
+        unique_lock<mutex> g(lock);
+        ready.wait(g, [] { return !keys.empty() || closed; });
+        if (keys.empty()) return KEY_NONE;
+        int k = keys.front();
+        keys.pop_front();
+        return k;
+    }
+    // 暫停最多 ms 毫秒，一有按鍵待處理就立即返回 (不取走按鍵)；回傳是否被打斷
+    bool pause(int ms) {
+        unique_lock<mutex> g(lock);
+        return ready.wait_for(g, chrono::milliseconds(ms), [] { return !keys.empty(); });
+    }
+    // 逐字顯示的跳過判定：Enter / 空白鍵只用來跳過而被取走，其他按鍵保留給下一個選單
+    bool skip(int ms) {
+        unique_lock<mutex> g(lock);
+        if (!ready.wait_for(g, chrono::milliseconds(ms), [] { return !keys.empty(); })) return false;
+        if (keys.front() == KEY_ENTER || keys.front() == KEY_SPACE) keys.pop_front();
+        return true;
+    }
+}
 
-// 延遲函式
+// 延遲函式 (原始模式下按鍵可提前結束)
 inline void wait(int ms) {
+    if (headless) return;
+    if (Input::active) { Input::pause(ms); return; }
     this_thread::sleep_for(chrono::milliseconds(ms)); // 延遲指定毫秒數
 }
 
 // 顯示提示，並清除輸入緩衝區，按下 Enter 繼續
 inline void clearInput(string prompt = "按下 Enter 繼續..." , string color = Color::GRAY) {
     if (prompt != "") cout << color << prompt << Color::RESET << endl; 
+    // 原始模式沒有行緩衝可清，只需等 Enter (其餘按鍵保留為預先輸入)
+    if (Input::active) {
+        if (prompt != "") for (int k = Input::waitKey(); k != Input::KEY_ENTER && k != Input::KEY_NONE; k = Input::waitKey()) {}
+        return;
+    }
     cin.clear();                                         // 清除錯誤標誌        
     cin.ignore(numeric_limits<streamsize>::max(), '\n'); // 忽略緩衝區內容
 }
 
+// 原始模式選單：數字鍵直接選定 (無法再接下一位數時免按 Enter)，上下鍵移動選項後按 Enter 確認；輸入結束回傳 KEY_NONE
+int chooseByKeys(int min, int max, const string& prompt, const string& color) {
+    int cursor = min; // 方向鍵目前指向的選項
+    string typed;     // 已輸入的數字
+    auto redraw = [&] {
+        cout << "\r\033[K" << color << prompt << Color::RESET;
+        if (typed.empty()) cout << Color::GRAY << cursor << Color::RESET;
+        else cout << typed;
+        cout << flush;
+    };
+    redraw();
+    while (true) {
+        int k = Input::waitKey();
+        if (k == Input::KEY_NONE) { cout << endl; return k; }
+        if (k >= '0' && k <= '9' && typed.size() < 9) {
+            int v = atoi((typed + (char)k).c_str());
+            if (v > max) { cout << '\a' << flush; continue; }
+            typed += (char)k;
+            redraw();
+            if (v >= min && (v == 0 || v * 10 > max)) { cout << endl; return v; }
+        } else if (k == Input::KEY_BACKSPACE) {
+            if (!typed.empty()) typed.erase(typed.size() - 1);
+            redraw();
+        } else if (k == Input::KEY_UP || k == Input::KEY_LEFT) {
+            typed.clear(); cursor = (cursor > min) ? cursor - 1 : max;
+            redraw();
+        } else if (k == Input::KEY_DOWN || k == Input::KEY_RIGHT) {
+            typed.clear(); cursor = (cursor < max) ? cursor + 1 : min;
+            redraw();
+        } else if (k == Input::KEY_ENTER) {
+            int v = typed.empty() ? cursor : atoi(typed.c_str());
+            if (v >= min && v <= max) { cout << endl; return v; }
+            cout << '\a' << flush;
+        }
+    }
+}
+
 // 獲取有效輸入
 int getValidInput(int min, int max, string prompt = ">> 請選擇: ", string color = Color::RESET) { 
+    if (Input::active) {
+        int choice = chooseByKeys(min, max, prompt, color);
+        if (choice != Input::KEY_NONE) return choice;
+        Input::stop(); // 輸入已結束，改回逐行讀取
+    }
     int choice;
     while (true) {
         // 顯示提示
@@ -92,8 +599,20 @@ int getValidInput(int min, int max, string prompt = ">> 請選擇: ", string col
     }
 }
 
+// 不複製的字串參照 (只指向靜態字串常值，生命週期為整個程式)
+struct StrRef {
+    const char* data;
+    size_t size;
+    StrRef() : data(""), size(0) {}
+    template <size_t N> StrRef(const char (&s)[N]) : data(s), size(N - 1) {}
+    bool empty() const { return size == 0; }
+    string str() const { return string(data, size); }
+};
+
 // 延遲顯示訊息函式
 void printMessage(const string& text, const string& name = "", int delayMs = 25, string color = "") {
+    if (headless) return;
+    Memory::Scope tag(Memory::STRINGS);
     // 預設顏色設定
     string finalColor = color;
     if (finalColor == "") {
@@ -104,18 +623,329 @@ void printMessage(const string& text, const string& name = "", int delayMs = 25,
     if (name != "") {
         cout << "【" << name << "】";
     }
-    // 逐字顯示訊息
+    // 逐字顯示訊息 (原始模式下按鍵可跳過，剩餘文字一次顯示)
+    bool skipped = false;
     if (delayMs > 0){
-        for (char c : text) {
-            cout << c << flush;
-            wait(delayMs);
+        for (size_t i = 0; i < text.size() && !skipped; ++i) {
+            cout << text[i] << flush;
+            if (Input::active) {
+                if (Input::skip(delayMs)) { skipped = true; cout << text.substr(i + 1); }
+            } else wait(delayMs);
         }
     }   else {
         cout << text;
     }
     // 換行並重置顏色
     cout << Color::RESET << endl;
-    wait(500); 
+    if (!skipped) wait(500); 
+}
+// 顯示角色台詞 (無頭模式下不建立字串)
+inline void printQuote(StrRef text, const string& name) {
+    if (headless) return;
+    Memory::Scope tag(Memory::STRINGS);
+    printMessage(text.str(), name);
+}
+
+// ==========================================
+// 戰鬥文字記錄 (Transcript Log)
+// ==========================================
+
+// 戰鬥訊息只記錄「格式編號 + 原始參數」到各執行緒自己的緩衝區，寫滿才整塊交給背景執行緒落盤；
+// 轉成文字延後到背景執行緒 (--transcript-text) 或離線解碼 (--transcript --in)。
+// 互動模式下同一份格式表也負責組出畫面上的訊息，無頭且未記錄時完全不組字串
+namespace Transcript {
+    enum Fmt : uint16_t {
+        F_BATTLE_START, F_SIM_BATTLE, F_SKILL, F_CRITICAL, F_ATTACK, F_PLAYER_ATTACK, F_DAMAGE, F_DAMAGE_ALL,
+        F_FOE_DOWN, F_STUNNED, F_FOE_ATTACK, F_DODGE, F_HIT, F_HEAL_ALL, F_FOE_DEFEATED, F_GAME_OVER,
+        F_SIM_WIN, F_SIM_LOSS, FMT_COUNT
+    };
+    // 格式：{} 依序代入參數，sig 為參數型別 (i: int32、u: uint64、s: 字串)；
+    // plain 的訊息直接輸出，其餘經 printMessage 逐字顯示
+    struct Format { const char* text; const char* sig; int delay; string color; bool plain; };
+    const Format FORMATS[FMT_COUNT] = {
+        {"=== 戰鬥開始 ===", "", 30, Color::RED, false},
+        {"--- 模擬戰鬥 (亂數流 {}) ---", "u", 0, "", true},
+        {"{} 使用了技能：{}！", "ss", 30, Color::MAGENTA, false},
+        {"CRITICAL HIT! 爆擊！", "", 0, Color::RED + Color::BOLD, true},
+        {"{} 攻擊！", "s", 25, "", false},
+        {"{} 進行攻擊！", "s", 25, "", false},
+        {"造成 {} 傷害！", "i", 25, "", false},
+        {"對全體敵人造成 {} 傷害！", "i", 25, "", false},
+        {"{} 倒下了！", "s", 20, Color::GREEN, false},
+        {"{} 暈眩中，無法行動！", "s", 20, Color::GRAY, false},
+        {"{} 反擊！", "s", 20, Color::MAGENTA, false},
+        {"{} 靈巧地閃過了攻擊！", "s", 20, Color::GREEN, false},
+        {"{} 受到 {} 傷害！", "si", 25, "", false},
+        {">>> 全體隊員恢復了 {} 點生命值！", "i", 0, Color::GREEN, true},
+        {"\n{} 被擊敗了！", "s", 50, Color::GREEN, false},
+        {"GAME OVER... 諾亞方舟被組織奪走了...", "", 50, Color::RED, false},
+        {"--- 勝利：{} 回合，存活 {} 人 ---", "ii", 0, "", true},
+        {"--- 落敗：{} 回合 ---", "i", 0, "", true}
+    };
+    const char MAGIC[] = "RPGLOG01";
+    const size_t MAGIC_LEN = 8;
+    const size_t BLOCK_SIZE = 64 * 1024;
+    const size_t MAX_QUEUED = 64; // 待寫區塊上限 (背景寫入跟不上時工作端等待，不丟記錄)
+
+    // 記錄區塊：一個執行緒連續寫入的記錄
+    struct Block {
+        uint32_t thread = 0;
+        uint32_t used = 0;
+        uint32_t records = 0;
+        char data[BLOCK_SIZE];
+    };
+
+    // 參數編碼 (字串最長 255 位元組)
+    inline size_t sizeOf(int) { return 4; }
+    inline size_t sizeOf(uint64_t) { return 8; }
+    inline size_t sizeOf(const string& s) { return 1 + min<size_t>(s.size(), 255); }
+    inline void put(char*& p, int v) { int32_t x = v; memcpy(p, &x, 4); p += 4; }
+    inline void put(char*& p, uint64_t v) { memcpy(p, &v, 8); p += 8; }
+    inline void put(char*& p, const string& s) { uint8_t n = min<size_t>(s.size(), 255); *p++ = n; memcpy(p, s.data(), n); p += n; }
+    inline size_t sizeOfAll() { return 0; }
+    template <typename T, typename... R> inline size_t sizeOfAll(const T& v, const R&... rest) { return sizeOf(v) + sizeOfAll(rest...); }
+    inline void putAll(char*&) {}
+    template <typename T, typename... R> inline void putAll(char*& p, const T& v, const R&... rest) { put(p, v); putAll(p, rest...); }
+
+    // 解碼一筆記錄並附加文字 (回傳讀取的位元組數，0 表示資料損毀)
+    size_t decode(const vector<Format>& table, const char* p, const char* end, string& text) {
+        const char* start = p;
+        uint16_t id;
+        if (end - p < 2) return 0;
+        memcpy(&id, p, 2); p += 2;
+        if (id >= table.size()) return 0;
+        const Format& f = table[id];
+        const char* sig = f.sig;
+        for (const char* t = f.text; *t; ++t) {
+            if (t[0] != '{' || t[1] != '}') { text += *t; continue; }
+            ++t;
+            char type = *sig ? *sig++ : 0;
+            if (type == 'i') {
+                int32_t v;
+                if (end - p < 4) return 0;
+                memcpy(&v, p, 4); p += 4;
+                text += to_string(v);
+            } else if (type == 'u') {
+                uint64_t v;
+                if (end - p < 8) return 0;
+                memcpy(&v, p, 8); p += 8;
+                text += to_string(v);
+            } else if (type == 's') {
+                if (end - p < 1 || end - p - 1 < (uint8_t)*p) return 0;
+                uint8_t n = *p++;
+                text.append(p, n); p += n;
+            } else return 0;
+        }
+        return p - start;
+    }
+
+    // 背景寫入端：收下寫滿的區塊，依模式寫出原始位元組或格式化後的文字
+    class Writer {
+        ofstream file;
+        bool text = false;
+        vector<Format> table;
+        thread worker;
+        mutex lock;
+        condition_variable wake, room;
+        deque<Block*> full;
+        vector<Block*> spare;
+        bool stopping = false;
+        atomic<uint32_t> threads{0};
+        uint64_t records = 0, bytes = 0;
+        void emit(const Block& b) {
+            records += b.records;
+            if (!text) {
+                uint32_t head[2] = {b.thread, b.used};
+                file.write((const char*)head, sizeof(head));
+                file.write(b.data, b.used);
+                bytes += sizeof(head) + b.used;
+                return;
+            }
+            string out;
+            const char* p = b.data;
+            const char* end = b.data + b.used;
+            while (p < end) {
+                out += "[t" + to_string(b.thread) + "] ";
+                size_t n = decode(table, p, end, out);
+                out += '\n';
+                if (!n) break;
+                p += n;
+            }
+            file << out;
+            bytes += out.size();
+        }
+        void loop() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                wake.wait(guard, [&] { return !full.empty() || stopping; });
+                if (full.empty()) break;
+                Block* b = full.front();
+                full.pop_front();
+                room.notify_all();
+                guard.unlock();
+                emit(*b);
+                guard.lock();
+                spare.push_back(b);
+            }
+        }
+    public:
+        ~Writer() { close(); for (auto* b : spare) delete b; }
+        bool open(const string& path, bool asText) {
+            text = asText;
+            table.assign(FORMATS, FORMATS + FMT_COUNT);
+            file.open(path.c_str(), ios::binary | ios::trunc);
+            if (!file) return false;
+            // 二進位檔頭內含格式表，舊記錄檔不受之後格式編號變動影響
+            if (!text) {
+                string head(MAGIC, MAGIC_LEN);
+                uint32_t n = FMT_COUNT;
+                head.append((const char*)&n, 4);
+                for (const auto& f : table) { head += f.text; head += '\0'; head += f.sig; head += '\0'; }
+                file.write(head.data(), head.size());
+            }
+            worker = thread(&Writer::loop, this);
+            return true;
+        }
+        uint32_t newThreadId() { return threads++; }
+        // 交出寫滿的區塊
+        void submit(Block* done) {
+            unique_lock<mutex> guard(lock);
+            room.wait(guard, [&] { return full.size() < MAX_QUEUED; });
+            full.push_back(done);
+            wake.notify_one();
+        }
+        // 取得空區塊 (優先重用已寫出的區塊)
+        Block* acquire() {
+            lock_guard<mutex> guard(lock);
+            if (spare.empty()) return new Block();
+            Block* b = spare.back();
+            spare.pop_back();
+            return b;
+        }
+        void close() {
+            if (!worker.joinable()) return;
+            { lock_guard<mutex> guard(lock); stopping = true; }
+            wake.notify_one();
+            worker.join();
+            file.flush();
+        }
+        uint64_t recordCount() const { return records; }
+        uint64_t byteCount() const { return bytes; }
+    };
+    atomic<Writer*> current{nullptr};
+
+    // 各執行緒的目前區塊 (執行緒結束時交出剩餘記錄)
+    struct Local {
+        Writer* owner = nullptr;
+        Block* block = nullptr;
+        uint32_t id = 0;
+        void flush() {
+            Writer* w = current.load();
+            if (block && w == owner && block->used) { w->submit(block); block = nullptr; }
+            delete block; // 所屬的寫入端已關閉 (或區塊是空的)
+            block = nullptr;
+            owner = nullptr;
+        }
+        ~Local() { flush(); }
+        char* reserve(Writer* w, size_t n) {
+            if (!block || owner != w || block->used + n > BLOCK_SIZE) {
+                if (owner != w) { flush(); owner = w; id = w->newThreadId(); }
+                if (block) w->submit(block);
+                block = w->acquire();
+                block->thread = id; block->used = 0; block->records = 0;
+            }
+            char* p = block->data + block->used;
+            block->used += n;
+            block->records++;
+            return p;
+        }
+    };
+    thread_local Local local;
+
+    // 以格式表組出文字並顯示 (只在互動模式呼叫)
+    template <typename... A> void show(Fmt f, const A&... args) {
+        Memory::Scope tag(Memory::STRINGS);
+        string buf(2 + sizeOfAll(args...), '\0');
+        char* p = &buf[0];
+        uint16_t id = f;
+        memcpy(p, &id, 2); p += 2;
+        putAll(p, args...);
+        static const vector<Format> table(FORMATS, FORMATS + FMT_COUNT);
+        string text;
+        decode(table, buf.data(), buf.data() + buf.size(), text);
+        const Format& fmt = FORMATS[f];
+        if (fmt.plain) cout << fmt.color << text << Color::RESET << "\n";
+        else printMessage(text, "", fmt.delay, fmt.color);
+    }
+    // 記錄一筆 (有開啟記錄時) 並在互動模式下顯示
+    template <typename... A> inline void say(Fmt f, const A&... args) {
+        Writer* w = current.load(memory_order_relaxed);
+        if (w) {
+            char* p = local.reserve(w, 2 + sizeOfAll(args...));
+            uint16_t id = f;
+            memcpy(p, &id, 2); p += 2;
+            putAll(p, args...);
+        }
+        if (!headless) show(f, args...);
+    }
+
+    // 開始記錄 (同一時間只有一個寫入端)
+    bool start(const string& path, bool asText) {
+        Writer* w = new Writer();
+        if (!w->open(path, asText)) { delete w; return false; }
+        current = w;
+        return true;
+    }
+    // 停止記錄並回報筆數 (其他記錄中的執行緒須已結束)
+    void stop(ostream& report) {
+        Writer* w = current.load();
+        if (!w) return;
+        local.flush();
+        current = nullptr;
+        w->close();
+        report << "戰鬥記錄: " << w->recordCount() << " 筆，" << w->byteCount() << " 位元組\n";
+        delete w;
+    }
+
+    // 離線解碼：依檔頭內的格式表轉成文字 (thread >= 0 時只輸出該執行緒)
+    bool decodeFile(const string& path, ostream& os, int thread) {
+        ifstream file(path.c_str(), ios::binary);
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (data.size() < MAGIC_LEN + 4 || data.compare(0, MAGIC_LEN, MAGIC) != 0) return false;
+        const char* p = data.data() + MAGIC_LEN;
+        const char* end = data.data() + data.size();
+        uint32_t n;
+        memcpy(&n, p, 4); p += 4;
+        // 格式字串直接指向檔案內容 (以 '\0' 結尾)
+        vector<Format> table;
+        for (uint32_t i = 0; i < n; ++i) {
+            const char* text = p;
+            p += strnlen(p, end - p) + 1;
+            const char* sig = p;
+            p += strnlen(p, end - p) + 1;
+            if (p > end) return false;
+            table.push_back({text, sig, 0, "", true});
+        }
+        while (end - p >= 8) {
+            uint32_t head[2];
+            memcpy(head, p, 8); p += 8;
+            if (head[1] > (uint32_t)(end - p)) return false;
+            const char* q = p;
+            const char* stop = p + head[1];
+            p = stop;
+            if (thread >= 0 && (int)head[0] != thread) continue;
+            string out;
+            while (q < stop) {
+                out += "[t" + to_string(head[0]) + "] ";
+                size_t used = decode(table, q, stop, out);
+                if (!used) return false;
+                out += '\n';
+                q += used;
+            }
+            os << out;
+        }
+        return p == end;
+    }
 }
 
 // ==========================================
@@ -134,9 +964,11 @@ struct GameState {
     bool boss_Vodka;
     bool boss_Gin;
 };
+// 新遊戲的初始狀態 (序章、尚未擊敗任何 BOSS)
+GameState freshState(int money = 0) { return {0, money, 0, false, false, false, false}; }
 
-// 前向宣告
-GameState gState; // 全局遊戲狀態 
+// 遊戲進度：每個執行緒一份 (自動遊玩的各工作執行緒各玩各的場次，每場由 resetGame 重置)
+thread_local GameState gState;
 
 // 地點結構體
 struct Location {
@@ -163,8 +995,141 @@ const vector<Location> LOCATIONS = {
     {7, "外部水域", "波濤洶湧的海面。", 3.0, 5.0, 10, 7}
 };
 
-// 前向宣告
-Location currentLocation; // 當前地點
+// 當前地點 (與 gState 相同，每個執行緒一份)
+thread_local Location currentLocation;
+
+// ==========================================
+// 事件匯流排 (Event Bus)
+// ==========================================
+
+// 遊戲邏輯發出型別化事件，交給掛上的輸出端 (終端機、統計、二進位日誌...)。
+// 沒有掛任何輸出端時匯流排不存在，發出事件只多一次 thread_local 讀取。
+// 無頭模式 (--sim、--autopilot) 且沒有會寫終端機的輸出端時，事件進無鎖環形佇列由分派執行緒消化，遊戲邏輯不等輸出；
+// 互動模式或掛了 terminal 時改由遊戲執行緒當場呼叫輸出端，與選單、逐字顯示的文字保持順序，也不會有兩個執行緒同時寫 cout。
+// 匯流排只承載數值事件，戰鬥與狀態的敘述文字仍由 Transcript::say / printMessage 產生。
+namespace Bus {
+    enum Kind : uint8_t { DAMAGE, HEAL, LEVEL_UP, ITEM_USED, CHAPTER, KIND_COUNT };
+    const char* const KIND_NAMES[KIND_COUNT] = {"damage", "heal", "level-up", "item-used", "chapter"};
+    enum Side : uint8_t { PARTY, ENEMY };
+    const int16_t NOBODY = -1; // 來源或目標不是單一角色 (道具、全體技能)
+
+    // 固定 16 位元組的事件 (角色以 charId 表示，敵方以波次索引表示)
+    struct Event {
+        uint8_t kind;
+        uint8_t side;    // 行動方
+        int16_t source;
+        int16_t target;
+        int16_t pad;
+        int32_t amount;  // 傷害量 / 治療量
+        int32_t value;   // 等級 / 章節 / 受影響人數 / 道具種類
+    };
+    static_assert(sizeof(Event) == 16, "Bus::Event 應為 16 位元組");
+
+    // 輸出端介面：consume 只在一個執行緒上呼叫 (分派執行緒或遊戲執行緒)，不需自行加鎖；
+    // finish 在關閉匯流排的執行緒上呼叫 (分派執行緒已結束)，結尾要印到終端機的內容在這裡輸出
+    class Sink {
+    public:
+        virtual ~Sink() {}
+        virtual void consume(const Event& e) = 0;
+        virtual void finish(ostream&) {}
+        virtual bool console() const { return false; } // consume 會寫終端機 (必須同步分派)
+    };
+
+    // 單一生產者/單一消費者環形佇列 (啟動匯流排的執行緒專用)
+    class SpscQueue {
+        vector<Event> buf;
+        size_t mask;
+        atomic<size_t> head{0};
+        char pad[64]; // 讓兩端索引落在不同快取行 (C++11 的 new 不保證 alignas(64))
+        atomic<size_t> tail{0};
+    public:
+        explicit SpscQueue(size_t capacity) : buf(capacity), mask(capacity - 1) {}
+        bool push(const Event& e) {
+            size_t t = tail.load(memory_order_relaxed);
+            if (t - head.load(memory_order_acquire) == buf.size()) return false;
+            buf[t & mask] = e;
+            tail.store(t + 1, memory_order_release);
+            return true;
+        }
+        bool pop(Event& e) {
+            size_t h = head.load(memory_order_relaxed);
+            if (h == tail.load(memory_order_acquire)) return false;
+            e = buf[h & mask];
+            head.store(h + 1, memory_order_release);
+            return true;
+        }
+    };
+
+    // 分派器：非同步時擁有佇列與背景執行緒 (佇列滿時丟棄並計數，生產者永不等待)；同步時直接呼叫輸出端
+    class Dispatcher {
+        vector<Sink*> sinks;
+        bool async;
+        SpscQueue lane;
+        atomic<bool> running{true};
+        atomic<uint64_t> dropped{0};
+        uint64_t delivered = 0;
+        thread worker;
+
+        size_t drain() {
+            size_t n = 0;
+            Event e;
+            while (lane.pop(e)) { for (auto* s : sinks) s->consume(e); ++n; }
+            delivered += n;
+            return n;
+        }
+        void run() {
+            int idle = 0;
+            while (true) {
+                bool stopping = !running.load(memory_order_acquire);
+                if (drain()) { idle = 0; continue; }
+                if (stopping) break;
+                if (++idle < 64) this_thread::yield();
+                else this_thread::sleep_for(chrono::microseconds(200));
+            }
+        }
+    public:
+        Dispatcher(const vector<Sink*>& s, bool async) : sinks(s), async(async), lane(async ? 1 << 16 : 1) {
+            if (async) worker = thread(&Dispatcher::run, this);
+        }
+        void push(const Event& e) {
+            if (!async) { for (auto* s : sinks) s->consume(e); ++delivered; }
+            else if (!lane.push(e)) dropped.fetch_add(1, memory_order_relaxed);
+        }
+        // 生產者結束後呼叫：送完剩餘事件並通知輸出端收尾
+        void stop(ostream& console) {
+            if (async) {
+                running.store(false, memory_order_release);
+                worker.join();
+            }
+            for (auto* s : sinks) s->finish(console);
+        }
+        uint64_t getDelivered() const { return delivered; }
+        uint64_t getDropped() const { return dropped.load(); }
+    };
+
+    // 只有啟動匯流排的執行緒會看到分派器 (唯一的生產者)；其他執行緒的事件不收集
+    thread_local Dispatcher* current = nullptr;
+    thread_local bool muted = false; // 推演分支等假想局面不發事件
+
+    // RAII：範圍內暫停發出事件
+    struct Mute {
+        bool prev;
+        Mute() : prev(muted) { muted = true; }
+        ~Mute() { muted = prev; }
+    };
+
+    inline void publish(Kind kind, Side side, int source, int target, int amount, int value) {
+        Dispatcher* d = current;
+        if (!d || muted) return;
+        Event e = {kind, side, (int16_t)source, (int16_t)target, 0, amount, value};
+        d->push(e);
+    }
+    inline void damage(Side side, int source, int target, int amount) { publish(DAMAGE, side, source, target, amount, 0); }
+    inline void heal(int source, int target, int amount, int count) { publish(HEAL, PARTY, source, target, amount, count); }
+    inline void levelUp(int who, int level) { publish(LEVEL_UP, PARTY, who, who, 0, level); }
+    inline void itemUsed(int target, int amount, int itemKind) { publish(ITEM_USED, PARTY, NOBODY, target, amount, itemKind); }
+    inline void chapter(int ch) { publish(CHAPTER, PARTY, NOBODY, NOBODY, 0, ch); }
+}
 
 // ==========================================
 // 類別定義 (Classes)
@@ -172,35 +1137,87 @@ Location currentLocation; // 當前地點
 
 // 前向宣告
 class Character;
+class Party;
+class EnemyGroup;
+class Monster;
 Character* createRandomNPC();
+Character* createCharacter(int id, int lv);
+
+// 需要玩家選擇的決策點 (主選單、移動、商店、隊伍管理、道具、戰鬥行動、目標、重玩)
+enum Decision { D_MAIN, D_LOCATION, D_SHOP, D_TEAM_MENU, D_SWAP_OUT, D_SWAP_IN, D_ITEM, D_ITEM_TARGET, D_BATTLE_ACTION, D_TARGET, D_RESTART };
+// 決策時可參考的狀態 (不適用的欄位為 nullptr)
+struct DecisionContext {
+    const Party* team;
+    const vector<Character*>* reserve;
+    const Character* actor;
+    const EnemyGroup* enemies;
+    DecisionContext(const Party* t = nullptr, const vector<Character*>* r = nullptr, const Character* a = nullptr, const EnemyGroup* e = nullptr)
+        : team(t), reserve(r), actor(a), enemies(e) {}
+};
+// 自動操作策略：取代玩家輸入，回傳與選單相同編號的選項
+class Pilot {
+public:
+    virtual ~Pilot() {}
+    virtual int decide(Decision d, const DecisionContext& ctx, int min, int max) = 0;
+};
+thread_local Pilot* pilot = nullptr; // 目前接管輸入的策略 (nullptr 表示由玩家操作)
+// 詢問選擇：有策略接管時直接取其決定 (限制在合法範圍內)，否則讀取玩家輸入
+int askChoice(Decision d, int min, int max, const DecisionContext& ctx = DecisionContext(), string prompt = ">> 請選擇: ") {
+    if (pilot) return std::max(min, std::min(max, pilot->decide(d, ctx, min, max)));
+    return getValidInput(min, max, prompt);
+}
 
+// 台詞時機列舉 (QUOTE_ACTIONS 為種類數)
+enum QuoteAction { QUOTE_ATTACK, QUOTE_SKILL, QUOTE_WIN, QUOTE_ACTIONS }; // 普攻、技能、勝利
 // 屬性類型列舉
 enum StatType { ATK, INT, LUCK }; // 攻擊、智力、運氣
+// 狀態效果列舉
+enum EffectKind { EFFECT_COOLDOWN, EFFECT_BUFF, EFFECT_DEBUFF, EFFECT_POISON, EFFECT_STUN, EFFECT_HASTE, EFFECT_SLOW }; // 冷卻、增益、減益、中毒、暈眩、加速、減速
+// 技能附帶的狀態效果 (增益與加速作用於全隊，其餘作用於命中的敵人)
+struct EffectSpec {
+    EffectKind kind;
+    int magnitude; // 增益點數 / 減益% / 每回合毒傷 / 速率%
+    int rounds;    // 持續回合
+};
 
 // 技能類別
 class Skill {
 protected: 
-    //名稱、描述、最大冷卻、當前冷卻
+    //名稱、描述、最大冷卻(回合)、冷卻結束時刻、附帶效果
     string name;
     string description;
     int maxCooldown;
-    int currentCooldown;
+    long long readyTick = 0;
+    vector<EffectSpec> effects;
 public:
     // 建構子與解構子
-    Skill(string n, string d, int cd = 0) : name(n), description(d), maxCooldown(cd), currentCooldown(0) {}
+    // 名稱與描述在標記範圍內複製，字串記在技能名下
+    Skill(string n, string d, int cd = 0) : maxCooldown(cd) { Memory::Scope tag(Memory::SKILLS); name = n; description = d; }
     virtual ~Skill() {}
+    static void* operator new(size_t n) { return Memory::allocateOrThrow(n, Memory::SKILLS); }
+    static void operator delete(void* p) { Memory::release(p); }
     // 存取函式
-    string getName() const { return name; }
+    const string& getName() const { return name; }
     string getDesc() const { return description; }
     int getMaxCD() const { return maxCooldown; }
-    int getCurrentCD() const { return currentCooldown; }
-    bool isReady() const { return currentCooldown <= 0; }
-    // 冷卻管理
-    void startCooldown() { currentCooldown = maxCooldown; }
-    void reduceCooldown() { if(currentCooldown > 0) currentCooldown--; }
-    void resetCooldown() { currentCooldown = 0; }
+    long long getReadyTick() const { return readyTick; }
+    void setReadyTick(long long t) { readyTick = t; }
+    const vector<EffectSpec>& getEffects() const { return effects; }
+    Skill* addEffect(EffectKind kind, int magnitude, int rounds) { Memory::Scope tag(Memory::SKILLS); effects.push_back({kind, magnitude, rounds}); return this; }
+    // 複製 (角色深拷貝用)
+    virtual Skill* clone() const = 0;
     // 使用技能
-    virtual int use(Character* user, vector<Character*>& team) = 0;
+    virtual int use(Character* user, Party& team) = 0;
+    virtual bool isAreaEffect() const { return false; } // 是否對全體敵人生效
+    virtual bool targetsEnemy() const { return true; }  // 是否需要選擇敵方目標
+    virtual bool effectsLand() const { return true; }   // 最近一次施放的附帶效果是否生效
+    // 內容簽章：影響戰鬥結果的所有參數 (組合探索的快取鍵用)
+    virtual string signature() const {
+        ostringstream os;
+        os << name << "|cd" << maxCooldown;
+        for (const auto& e : effects) os << "|e" << e.kind << ":" << e.magnitude << ":" << e.rounds;
+        return os.str();
+    }
 };
 
 // 道具類別
@@ -212,12 +1229,17 @@ protected:
     int price;
 public:
     // 建構子與解構子
-    Item(string n, int p, string d) : name(n), price(p), description(d) {}
+    Item(string n, int p, string d) : price(p) { Memory::Scope tag(Memory::ITEMS); name = n; description = d; }
     virtual ~Item() {}
+    static void* operator new(size_t n) { return Memory::allocateOrThrow(n, Memory::ITEMS); }
+    static void operator delete(void* p) { Memory::release(p); }
     // 存取函式
-    string getName() const { return name; }
+    const string& getName() const { return name; }
     int getPrice() const { return price; }
     string getDesc() const { return description; }
+    // 分類查詢 (策略每回合都要掃背包與商店，以虛擬函式取代 dynamic_cast)
+    virtual int getAmount() const { return 0; } // 回復量 (非回復型為 0)
+    virtual bool revives() const { return false; }
     // 使用道具
     virtual bool apply(Character* target) = 0;
 };
@@ -232,12 +1254,22 @@ protected:
     bool isPlayer; 
     int hp, maxHP, level, exp, power, knowledge, luck;      
     vector<Skill*> skills; 
+    uint32_t readyMask = ~0u; // 可用技能位元遮罩 (冷卻結束時由狀態引擎設回)
     int tempBuff = 0; 
+    Party* party = nullptr; // 所屬隊伍 (狀態變化時通知)
+    int partySlot = -1;
+    int charId = -1;        // 角色編號 (同 createCharacter；-1 表示無台詞)
     void levelUp(int hInc, int pInc, int kInc, int lInc);
+    void notifyParty();
 public:
     // 建構子與解構子
     Character(string n, string cls, int lv, int h, int po, int kn, int lu, bool isPly = false);
+    Character(const Character& o); // 深拷貝技能，不隸屬任何隊伍
+    Character& operator=(const Character&) = delete;
     virtual ~Character();
+    virtual Character* clone() const = 0;
+    static void* operator new(size_t n) { return Memory::allocateOrThrow(n, Memory::CHARACTERS); }
+    static void operator delete(void* p) { Memory::release(p); }
     // 存取函式 
     virtual void print(); 
     virtual int getHP() const { return hp; }
@@ -245,24 +1277,33 @@ public:
     virtual int getAttack() const { return power + tempBuff; }
     virtual int getKnowledge() const { return knowledge; }
     virtual int getLuck() const { return luck; }
-    virtual string getName() const { return name; }
+    int getLevel() const { return level; }
+    virtual const string& getName() const { return name; }
     virtual int getSpeed() const { return luck; } 
     virtual bool getIsPlayer() const { return isPlayer; } 
     virtual int getTempBuff() const { return tempBuff; }
-    virtual string getQuote(string action) { return ""; } 
+    StrRef getQuote(QuoteAction action) const; // 依 (角色編號, 時機) 查台詞表
+    int getCharId() const { return charId; }
+    void setCharId(int id) { charId = id; }
     const vector<Skill*>& getSkills() const { return skills; } 
     // 狀態修改函式
     virtual void beatMonster(int exp) = 0;
-    virtual void setHP(int val) { hp = val; if(hp > maxHP) hp = maxHP; if(hp < 0) hp = 0; }
-    virtual void addBuff(int val) { tempBuff += val; }
-    virtual void clearBuff() { tempBuff = 0; }
-    // 冷卻管理
-    void tickCooldowns() { for(auto s : skills) s->reduceCooldown(); }
-    void resetCooldowns() { for(auto s : skills) s->resetCooldown(); }
+    virtual void setHP(int val) { hp = val; if(hp > maxHP) hp = maxHP; if(hp < 0) hp = 0; notifyParty(); }
+    virtual void addBuff(int val) { tempBuff += val; notifyParty(); }
+    virtual void clearBuff() { if (!tempBuff) return; tempBuff = 0; notifyParty(); }
+    // 隊伍掛載 (由 Party 呼叫)
+    void attachParty(Party* p, int slot) { party = p; partySlot = slot; }
+    int getPartySlot() const { return partySlot; }
+    // 冷卻管理 (到期由狀態引擎的時間輪處理，不逐回合走訪)
+    bool isSkillReady(int idx) const { return (readyMask >> idx) & 1; }
+    uint32_t getReadyMask() const { return readyMask & ((1u << skills.size()) - 1); }
+    void markSkillReady(int idx) { readyMask |= 1u << idx; }
+    void setReadyMask(uint32_t mask) { readyMask = mask; }
+    void resetCooldowns() { readyMask = ~0u; for(auto s : skills) s->setReadyTick(0); }
     // 技能使用介面
     void addSkill(Skill* skill) { skills.push_back(skill); }
-    virtual int performSkill(int skillIdx, vector<Character*>& team);
-    virtual int useRandomSkill(vector<Character*>& team); 
+    virtual int performSkill(int skillIdx, Party& team);
+    int pickRandomReadySkill() const;
     
 };
 // 建構子實作
@@ -270,6 +1311,12 @@ Character::Character(string n, string cls, int lv, int h, int po, int kn, int lu
     name = n; className = cls; level = lv; exp = pow(lv - 1, 2) * EXP_LV;
     hp = h; maxHP = h; power = po; knowledge = kn; luck = lu; isPlayer = isPly;
 }
+// 複製建構子實作
+Character::Character(const Character& o)
+    : name(o.name), className(o.className), isPlayer(o.isPlayer), hp(o.hp), maxHP(o.maxHP), level(o.level), exp(o.exp),
+      power(o.power), knowledge(o.knowledge), luck(o.luck), readyMask(o.readyMask), tempBuff(o.tempBuff), charId(o.charId) {
+    for (const Skill* s : o.skills) skills.push_back(s->clone());
+}
 // 解構子實作
 Character::~Character() {
     for (Skill* s : skills) delete s;
@@ -280,228 +1327,1249 @@ void Character::levelUp(int hInc, int pInc, int kInc, int lInc) {
     level++;
     exp -= pow(level - 1, 2) * EXP_LV;
     hp += hInc; maxHP += hInc; power += pInc; knowledge += kInc; luck += lInc;
-    cout << Color::GREEN << Color::BOLD << ">>> " + name + " 升級了！ (Lv." + to_string(level) + ")\n" << Color::RESET;
+    notifyParty();
+    Bus::levelUp(charId, level);
+    if (!headless) cout << Color::GREEN << Color::BOLD << ">>> " + name + " 升級了！ (Lv." + to_string(level) + ")\n" << Color::RESET;
     wait(500);
 }
 // 角色資訊顯示實作
 void Character::print() {
-    cout << Color::BOLD << name << Color::RESET << " [" << className << "] Lv." << level 
+    if (headless) return;
+    out() << Color::BOLD << name << Color::RESET << " [" << className << "] Lv." << level 
          << " HP:" << (hp > maxHP * 0.3 ? Color::GREEN : Color::RED) << hp << "/" << maxHP << Color::RESET
          << " 攻:" << getAttack() << " 智:" << knowledge << " 運:" << luck << "\n";
 }
 // 技能使用介面實作
-int Character::performSkill(int skillIdx, vector<Character*>& team) {
+int Character::performSkill(int skillIdx, Party& team) {
     if (skillIdx < 0 || skillIdx >= skills.size()) return 0;
     Skill* s = skills[skillIdx];
-    string quote = getQuote("SKILL");
-    if (quote != "") printMessage(quote, name);
-    printMessage(name + " 使用了技能：" + s->getName() + "！", "", 30, Color::MAGENTA);
+    StrRef quote = getQuote(QUOTE_SKILL);
+    if (!quote.empty()) printQuote(quote, name);
+    Transcript::say(Transcript::F_SKILL, name, s->getName());
     int result = s->use(this, team);
-    s->startCooldown(); 
-    if (result > 0 && getRandom(1, 100) <= luck) {
-        cout << Color::RED << Color::BOLD << "CRITICAL HIT! 爆擊！\n" << Color::RESET;
-        result = (int)(result * 1.5);
+    if (s->getMaxCD() > 0) readyMask &= ~(1u << skillIdx); // 冷卻到期時刻由狀態引擎排程
+    if (result <= 0) return result;
+    int critical = (int)(result * 1.5);
+    if (damageLuck) damageLuck->dealt -= result + (critical - result) * max(0, min(luck, 100)) / 100.0; // 擲骰前的期望值
+    if (getRandom(1, 100) <= luck) {
+        Transcript::say(Transcript::F_CRITICAL);
+        result = critical;
     }
+    if (damageLuck) damageLuck->dealt += result;
     return result;
 }
-// 隨機技能使用介面實作
-int Character::useRandomSkill(vector<Character*>& team) {
-    if (skills.empty()) return 0;
-    vector<int> readyIndices;
-    for(size_t i=0; i<skills.size(); ++i) if(skills[i]->isReady()) readyIndices.push_back(i);
-    if (readyIndices.empty()) return -1; 
-    int idx = readyIndices[getRandom(0, readyIndices.size() - 1)];
-    return performSkill(idx, team);
+// 隨機挑選可用技能實作 (無可用技能時回傳 -1)
+int Character::pickRandomReadySkill() const {
+    uint32_t mask = getReadyMask();
+    if (mask == 0) return -1; 
+    // 在位元遮罩中取第 k 個可用技能
+    for (int k = getRandom(0, __builtin_popcount(mask) - 1); k > 0; --k) mask &= mask - 1;
+    return __builtin_ctz(mask);
 }
 
 // ==========================================
-// 技能與道具實作
+// 目標選擇索引 (Target Index)
 // ==========================================
 
-// 攻擊型技能類別
-class AttackSkill : public Skill {
-    StatType stat; double multiplier; int baseDmg;
-public:
-    AttackSkill(string n, string d, StatType s, double m, int b, int cd) : Skill(n, d, cd), stat(s), multiplier(m), baseDmg(b) {}
-    int use(Character* user, vector<Character*>& team) override {
-        int val = (stat == ATK) ? user->getAttack() : ((stat == INT) ? user->getKnowledge() : user->getLuck());
-        return (int)(val * multiplier + baseDmg);
-    }
-};
-// 治療型技能類別
-class HealSkill : public Skill {
-    int baseHeal; double intMod;
+// 目標選擇策略
+enum TargetPolicy { TARGET_RANDOM, TARGET_LOWEST_HP, TARGET_HIGHEST_THREAT }; // 隨機存活、最低HP、最高威脅
+
+// 線段樹：維護存活數、最低HP與最高威脅的槽位，單點更新與查詢皆為 O(log n)
+class TargetIndex {
+    // 節點：子樹存活數、子樹內最低HP / 最高威脅的槽位 (-1 表示無)；葉節點另存該槽位的數值
+    struct Node { int cnt = 0, low = -1, top = -1, hp = 0, threat = 0; };
+    int cap = 1;        // 葉節點數 (2 的冪)
+    vector<Node> nodes; // 1 為根，槽位 i 的葉節點為 cap + i (一次配置)
+    void pull(int node);
+    void setLeaf(int i, int hpVal, int threatVal, bool alive);
 public:
-    HealSkill(string n, string d, int base, double mod, int cd) : Skill(n, d, cd), baseHeal(base), intMod(mod) {}
-    int use(Character* user, vector<Character*>& team) override {
-        int amount = baseHeal + (int)(user->getKnowledge() * intMod);
-        cout << Color::GREEN << ">>> 全體隊員恢復了 " << amount << " 點生命值！" << Color::RESET << "\n";
-        for(auto* member : team) if (member->getHP() > 0) member->setHP(member->getHP() + amount);
-        return 0; 
+    explicit TargetIndex(int n = 0) { resize(n); }
+    void resize(int n);
+    // 單點更新 O(log n)
+    void set(int i, int hpVal, int threatVal, bool alive) {
+        setLeaf(i, hpVal, threatVal, alive);
+        for (int node = (i + cap) / 2; node >= 1; node /= 2) pull(node);
     }
+    // 批次更新：先寫葉節點，最後呼叫 rebuild() 一次 O(n) 重建
+    void stage(int i, int hpVal, int threatVal, bool alive) { setLeaf(i, hpVal, threatVal, alive); }
+    void rebuild() { for (int node = cap - 1; node >= 1; --node) pull(node); }
+    // 查詢
+    int aliveCount() const { return nodes[1].cnt; }
+    int lowestHP() const { return nodes[1].low; }
+    int highestThreat() const { return nodes[1].top; }
+    int kthAlive(int k) const;
+    int pick(TargetPolicy policy) const;
 };
-// 恢復型道具類別
-class RestoreItem : public Item {
-    int amount;
-public:
-    RestoreItem(string n, int p, string d, int amt) : Item(n, p, d), amount(amt) {}
-    bool apply(Character* target) override {
-        if (target->getHP() <= 0) { cout << Color::RED << "無法對已陣亡角色使用！\n" << Color::RESET; return false; }
-        target->setHP(target->getHP() + amount);
-        cout << Color::GREEN << target->getName() << " 恢復了 " << amount << " 點生命！\n" << Color::RESET;
-        return true;
+// 合併子節點
+void TargetIndex::pull(int node) {
+    const Node& l = nodes[node * 2];
+    const Node& r = nodes[node * 2 + 1];
+    Node& n = nodes[node];
+    n.cnt = l.cnt + r.cnt;
+    int a = l.low, b = r.low;
+    n.low = (a < 0 || (b >= 0 && nodes[cap + b].hp < nodes[cap + a].hp)) ? b : a;
+    a = l.top; b = r.top;
+    n.top = (a < 0 || (b >= 0 && nodes[cap + b].threat > nodes[cap + a].threat)) ? b : a;
+}
+// 寫入葉節點
+void TargetIndex::setLeaf(int i, int hpVal, int threatVal, bool alive) {
+    Node& leaf = nodes[cap + i];
+    leaf.hp = hpVal; leaf.threat = threatVal;
+    leaf.cnt = alive ? 1 : 0;
+    leaf.low = leaf.top = alive ? i : -1;
+}
+// 調整容量 (保留既有槽位)
+void TargetIndex::resize(int n) {
+    int newCap = 1;
+    while (newCap < n) newCap *= 2;
+    if (newCap == cap && !nodes.empty()) return;
+    vector<Node> old;
+    old.swap(nodes);
+    int oldCap = old.empty() ? 0 : cap;
+    cap = newCap;
+    nodes.assign(cap * 2, Node());
+    for (int i = 0; i < oldCap && i < cap; ++i) {
+        const Node& leaf = old[oldCap + i];
+        setLeaf(i, leaf.hp, leaf.threat, leaf.cnt > 0);
     }
-};
-// 復活型道具類別
-class ReviveItem : public Item {
-public:
-    ReviveItem(string n, int p, string d) : Item(n, p, d) {}
-    bool apply(Character* target) override {
-        if (target->getHP() > 0) { cout << "該角色仍然存活。\n"; return false; }
-        target->setHP(target->getMaxHP() / 2);
-        cout << Color::GREEN << target->getName() << " 復活了！\n" << Color::RESET;
-        return true;
+    rebuild();
+}
+// 第 k 個存活槽位 (k 從 0 起算)
+int TargetIndex::kthAlive(int k) const {
+    if (k < 0 || k >= nodes[1].cnt) return -1;
+    int node = 1;
+    while (node < cap) {
+        if (nodes[node * 2].cnt > k) node = node * 2;
+        else { k -= nodes[node * 2].cnt; node = node * 2 + 1; }
     }
-};
+    return node - cap;
+}
+// 依策略選擇目標 (無存活者回傳 -1)
+int TargetIndex::pick(TargetPolicy policy) const {
+    if (nodes[1].cnt == 0) return -1;
+    if (policy == TARGET_LOWEST_HP) return lowestHP();
+    if (policy == TARGET_HIGHEST_THREAT) return highestThreat();
+    return kthAlive(getRandom(0, nodes[1].cnt - 1));
+}
 
 // ==========================================
-// 背包與商店
+// 行動時間軸 (Initiative Timeline)
 // ==========================================
 
-// 背包欄位結構體
-struct InventorySlot { Item* item; int count; };
-// 背包與商店容器
-vector<InventorySlot> inventory;
-vector<Item*> shopItems;             
-// 新增道具至背包
-void addToInventory(Item* itemRef) {
-    for (auto& slot : inventory) {
-        if (slot.item->getName() == itemRef->getName()) { slot.count++; return; }
+// ATB 時間軸：以優先佇列排出下一位行動者 O(log n)；加速/減速以世代編號作廢舊排程，不需重建
+class Timeline {
+public:
+    static const int BASE_SPEED = 100;                  // 基礎速度 (速度 0 時每回合行動一次)
+    static const long long ROUND_TICKS = 1000;          // 一回合的時間長度
+private:
+    struct Entry {
+        long long time; // 行動時間
+        long long seq;  // 同時間依排入順序
+        int actor;
+        int gen;        // 排程世代 (與 actor 目前世代不符即作廢)
+        bool operator>(const Entry& o) const { return time != o.time ? time > o.time : seq > o.seq; }
+    };
+    // 每位行動者的狀態放在同一個結構 (一場戰鬥只配置一次)
+    struct Slot {
+        int speed = 0, rate = 0, gen = 0; // 速度、速率加成(%)、目前世代
+        long long readyAt = 0;            // 下次行動時間
+        long long pendingSeq = 0;         // 有效排程的排入順序
+        char active = 0, queued = 0;      // 是否在時間軸上、是否有有效排程
+    };
+    vector<Entry> queue; // 最小堆 (push_heap/pop_heap，與 priority_queue 的順序相同，但可預先配置)
+    vector<Slot> slots;
+    long long now = 0, seqCounter = 0;
+    friend struct BattleSnapshot;
+    int effectiveRate(int actor) const { return max(25, min(400, 100 + slots[actor].rate)); } // 速率限制在 25% ~ 400%
+    long long delayOf(int actor) const { return ROUND_TICKS * BASE_SPEED * 100 / ((long long)(BASE_SPEED + max(0, slots[actor].speed)) * effectiveRate(actor)); }
+    void enqueue(const Entry& e) { queue.push_back(e); push_heap(queue.begin(), queue.end(), greater<Entry>()); }
+    void push(int actor, long long t) {
+        Slot& s = slots[actor];
+        s.readyAt = t; s.queued = 1; s.pendingSeq = seqCounter;
+        enqueue({t, seqCounter++, actor, s.gen});
+    }
+public:
+    // 預先配置 n 位行動者的空間 (避免逐一加入時反覆擴充)
+    void reserve(int n);
+    // 加入行動者 (首次行動時間依速度決定)
+    void join(int actor, int spd);
+    // 移出時間軸 (既有排程自動作廢)
+    void remove(int actor) { if (actor < (int)slots.size()) { slots[actor].active = 0; slots[actor].queued = 0; slots[actor].gen++; } }
+    // 取出下一位行動者並推進時間 (無人時回傳 -1)
+    int next();
+    // 行動結束，排入下一次行動
+    void endTurn(int actor) { if (slots[actor].active) push(actor, now + delayOf(actor)); }
+    // 加速/減速 (加成可疊加、到期時以負值撤銷)：剩餘等待時間依新速率等比縮放 O(log n)
+    void adjustRate(int actor, int deltaPct);
+    // 存取函式
+    long long getNow() const { return now; }
+    int round() const { return now <= 0 ? 1 : (int)((now - 1) / ROUND_TICKS) + 1; }
+    int getRate(int actor) const { return effectiveRate(actor); }
+    bool isActive(int actor) const { return actor < (int)slots.size() && slots[actor].active; }
+};
+const int Timeline::BASE_SPEED;
+const long long Timeline::ROUND_TICKS;
+// 預先配置實作
+void Timeline::reserve(int n) {
+    if (n <= (int)slots.size()) return;
+    slots.resize(n);
+    queue.reserve(n * 2); // 每人至多一個有效排程，加上等待略過的作廢排程
+}
+// 加入實作
+void Timeline::join(int actor, int spd) {
+    reserve(actor + 1);
+    Slot& s = slots[actor];
+    s.speed = spd; s.rate = 0; s.active = 1; s.gen++;
+    push(actor, now + delayOf(actor));
+}
+// 取出實作 (略過作廢的排程)
+int Timeline::next() {
+    while (!queue.empty()) {
+        Entry e = queue.front();
+        pop_heap(queue.begin(), queue.end(), greater<Entry>());
+        queue.pop_back();
+        Slot& s = slots[e.actor];
+        if (!s.active || e.gen != s.gen) continue;
+        now = e.time;
+        s.gen++; // 此排程已使用
+        s.queued = 0;
+        return e.actor;
+    }
+    return -1;
+}
+// 速率調整實作
+void Timeline::adjustRate(int actor, int deltaPct) {
+    if (!isActive(actor)) return;
+    int oldRate = effectiveRate(actor);
+    Slot& s = slots[actor];
+    s.rate += deltaPct;
+    // 尚在等待中：以新速率重算剩餘時間並重新排程
+    if (s.readyAt > now) {
+        long long remain = (s.readyAt - now) * oldRate / effectiveRate(actor);
+        s.gen++;
+        push(actor, now + max(1LL, remain));
     }
-    inventory.push_back({itemRef, 1});
 }
 
 // ==========================================
-// 職業與角色 (Characters)
+// 時間輪 (Timing Wheel)
 // ==========================================
 
-// Gadgeteer (道具專家 - 柯南)
-class Gadgeteer : public Character {
+// 階層式時間輪：兩層各 64 格，更遠的排程放在溢位清單；推進時以佔用位元跳過空格，只為到期項目付出成本。
+// 各格是同一個節點池裡依排入順序串起的串列，一場戰鬥只配置一次池子，不必為每一格各配一個 vector
+class TimingWheel {
+    static const int BITS = 6;
+    static const long long MASK = (1LL << BITS) - 1;
+    struct Timer { long long expire; int id; int next; };
+    struct List { int head = -1, tail = -1; };
+    vector<Timer> pool;              // 節點池 (空閒節點以 next 串起)
+    int freeNode = -1;
+    List nearSlots[1 << BITS];       // 第 0 層：本區塊內逐刻
+    List farSlots[1 << BITS];        // 第 1 層：本超區塊內逐區塊
+    List overflow;                   // 更遠的排程
+    uint64_t nearOcc = 0, farOcc = 0; // 各格是否有項目
+    long long current = 0;
+    static void append(vector<Timer>& pool, List& l, int node) {
+        pool[node].next = -1;
+        if (l.tail < 0) l.head = node; else pool[l.tail].next = node;
+        l.tail = node;
+    }
+    void place(int node);
+    void replace(List& from); // 取下整串並依序重新放置
+    void enterBlock();
 public:
-    Gadgeteer(string n, int lv=1) : Character(n, "名偵探", lv, lv*60, lv*5, lv*12, lv*8, true) {
-        addSkill(new AttackSkill("腳力增強鞋", "踢出強力的物品", ATK, 2.0, 10, 2));
-        addSkill(new AttackSkill("麻醉手錶", "精準射擊", INT, 1.5, 20, 4));
-        addSkill(new AttackSkill("領結變聲器", "擾亂敵人", INT, 1.2, 0, 3));
+    TimingWheel() { pool.reserve(16); }
+    long long now() const { return current; }
+    // 清空並把目前刻度設為 tick
+    void reset(long long tick) {
+        for (int i = 0; i <= MASK; ++i) { nearSlots[i] = List(); farSlots[i] = List(); }
+        overflow = List();
+        pool.clear(); freeNode = -1;
+        nearOcc = farOcc = 0;
+        current = tick;
     }
-    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(60, 5, 12, 8); }
-    string getQuote(string action) override {
-        if (action == "ATTACK") return "可惡... 看招！";
-        if (action == "SKILL") return "這招如何？";
-        if (action == "WIN") return "真相只有一個！";
-        return "";
+    // 排入到期刻度 (已過期者於下一刻觸發)
+    void schedule(long long expire, int id) {
+        int node = freeNode;
+        if (node >= 0) freeNode = pool[node].next;
+        else { node = pool.size(); pool.push_back(Timer()); }
+        pool[node].expire = max(expire, current + 1);
+        pool[node].id = id;
+        place(node);
     }
+    // 推進到指定刻度，依序觸發到期項目
+    template<class F> void advance(long long to, F fire);
 };
-
-// Fighter (格鬥家 - 小蘭、平次、京極真、赤井秀一、安室透、和葉)
-class Fighter : public Character {
-public:
-    Fighter(string n, string type, int lv=1) : Character(n, "格鬥家", lv, lv*100, lv*10, lv*3, lv*5, false) {
-        if (type == "Karate") { addSkill(new AttackSkill("空手道劈擊", "重擊", ATK, 1.8, 0, 1)); addSkill(new AttackSkill("迴旋踢", "連續踢擊", ATK, 2.2, 0, 2)); }
-        else if (type == "Kendo") { addSkill(new AttackSkill("劍道突刺", "精準", ATK, 1.5, 10, 1)); addSkill(new AttackSkill("居合斬", "拔刀", ATK, 2.5, 0, 3)); }
-        else if (type == "Super") { addSkill(new AttackSkill("正拳突刺", "極高傷", ATK, 3.0, 0, 3)); addSkill(new AttackSkill("迴旋踢", "踢擊", ATK, 2.2, 0, 2)); }
-        else if (type == "Sniper") { addSkill(new AttackSkill("銀色子彈", "狙擊", ATK, 3.5, 0, 4)); addSkill(new AttackSkill("截拳道", "近身", ATK, 2.0, 0, 2)); } 
-        else if (type == "SecretPolice") { addSkill(new AttackSkill("零之執行", "猛攻", ATK, 2.8, 0, 3)); addSkill(new AttackSkill("博擊", "連打", ATK, 1.5, 0, 1)); }
-        else if (type == "Aikido") { addSkill(new AttackSkill("合氣道摔", "防守反擊", ATK, 2.0, 0, 2)); addSkill(new AttackSkill("護身符", "幸運一擊", LUCK, 1.5, 20, 3)); }
+// 依到期刻度放入對應層級
+void TimingWheel::place(int node) {
+    long long expire = pool[node].expire;
+    if ((expire >> BITS) == (current >> BITS)) {
+        append(pool, nearSlots[expire & MASK], node);
+        nearOcc |= 1ULL << (expire & MASK);
+    } else if ((expire >> (2 * BITS)) == (current >> (2 * BITS))) {
+        int slot = (expire >> BITS) & MASK;
+        append(pool, farSlots[slot], node);
+        farOcc |= 1ULL << slot;
+    } else {
+        append(pool, overflow, node);
     }
-    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(100, 10, 3, 5); }
-    string getQuote(string action) override {
-        if (name == "毛利蘭") {
-            if (action == "ATTACK") return "哈啊——！";
-            if (action == "SKILL") return "我不會輸的！";
-            if (action == "WIN") return "大家沒事吧？";
-        } else if (name == "服部平次") {
-            if (action == "ATTACK") return "看劍！";
-            if (action == "SKILL") return "工藤，要上了！";
-            if (action == "WIN") return "這就是大阪偵探的實力！";
-        } else if (name == "京極真") {
-            if (action == "ATTACK") return "喝！";
-            if (action == "SKILL") return "為了園子小姐！";
-            if (action == "WIN") return "修練還不夠...";
-        } else if (name == "赤井秀一") {
-            if (action == "ATTACK") return "哼。";
-            if (action == "SKILL") return "墮落吧...";
-            if (action == "WIN") return "Target clear.";
-        } else if (name == "安室透") {
-            if (action == "ATTACK") return "不會讓你逃掉的。";
-            if (action == "SKILL") return "我的戀人是這個國家！";
-            if (action == "WIN") return "任務完成。";
-        } else if (name == "遠山和葉") {
-            if (action == "ATTACK") return "看招！";
-            if (action == "SKILL") return "不准碰平次！";
-            if (action == "WIN") return "平次，我也很強吧！";
-        }
-        return "";
+}
+void TimingWheel::replace(List& from) {
+    int node = from.head;
+    from = List();
+    while (node >= 0) {
+        int next = pool[node].next;
+        place(node);
+        node = next;
     }
-};
-
-// Support (後勤 - 灰原、博士、園子、優作)
-class Support : public Character {
-public:
-    Support(string n, string type, int lv=1) : Character(n, "後勤", lv, lv*50, lv*3, lv*15, lv*6, false) {
-        if (type == "Science") { addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); addSkill(new AttackSkill("化學知識", "智力傷害", INT, 2.0, 0, 2)); }
-        else if (type == "Inventor") { addSkill(new AttackSkill("冷謎語", "精神傷", INT, 1.0, 10, 1)); addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); }
-        else if (type == "Rich") { addSkill(new AttackSkill("鈔能力", "金錢攻擊", LUCK, 3.0, 0, 2)); addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); luck+=20; }
-        else if (type == "Novelist") { addSkill(new AttackSkill("世界級推理", "看穿一切", INT, 3.0, 0, 3)); addSkill(new HealSkill("冷靜分析", "恢復", 60, 2.0, 2)); }
+}
+// 進入新區塊：溢位清單 (新超區塊時) 與第 1 層對應格往下放
+void TimingWheel::enterBlock() {
+    if ((current & ((1LL << (2 * BITS)) - 1)) == 0 && overflow.head >= 0) replace(overflow);
+    int slot = (current >> BITS) & MASK;
+    if ((farOcc >> slot) & 1) {
+        farOcc &= ~(1ULL << slot);
+        replace(farSlots[slot]);
     }
-    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(50, 3, 15, 6); }
-    string getQuote(string action) override {
-        if (name == "灰原哀") {
-            if (action == "ATTACK") return "讓開。";
-            if (action == "SKILL") return "真是拿你們沒辦法...";
-            if (action == "WIN") return "結束了呢。";
-        } else if (name == "阿笠博士") {
-            if (action == "ATTACK") return "我也來戰鬥！";
-            if (action == "SKILL") return "試試我的新發明！";
-            if (action == "WIN") return "發明大成功！";
-        } else if (name == "鈴木園子") {
-            if (action == "ATTACK") return "走開啦！";
-            if (action == "SKILL") return "這可是鈴木財團的力量！";
-            if (action == "WIN") return "阿真，我贏了！";
-        } else if (name == "工藤優作") {
-            if (action == "ATTACK") return "還不賴。";
-            if (action == "SKILL") return "原來如此...";
-            if (action == "WIN") return "一切都在預料之中。";
-        }
-        return "";
+}
+// 推進實作 (觸發時可能排入新項目，先記下下一個節點再歸還)
+template<class F> void TimingWheel::advance(long long to, F fire) {
+    while (current < to) {
+        long long next = current + 1;
+        if ((next & MASK) == 0) {
+            current = next;
+            enterBlock();
+        } else {
+            // 同一區塊內直接跳到下一個有項目的刻度
+            uint64_t m = nearOcc & (~0ULL << (next & MASK));
+            long long target = m ? ((current & ~MASK) | __builtin_ctzll(m)) : (current | MASK);
+            if (target > to) { current = to; return; }
+            current = target;
+        }
+        int slot = current & MASK;
+        if ((nearOcc >> slot) & 1) {
+            int node = nearSlots[slot].head;
+            nearSlots[slot] = List();
+            nearOcc &= ~(1ULL << slot);
+            while (node >= 0) {
+                int id = pool[node].id, after = pool[node].next;
+                pool[node].next = freeNode; freeNode = node;
+                fire(id);
+                node = after;
+            }
+        }
     }
-};
+}
 
-// Trickster (特殊 - 基德、小五郎、有希子)
-class Trickster : public Character {
-public:
+// ==========================================
+// 隊伍容器 (Party)
+// ==========================================
+
+// 出戰隊伍：成員狀態變化時增量維護存活名單、總戰力與 HP 區間統計
+class Party {
+public:
+    static const int HP_BUCKETS = 10; // HP 百分比區間數 (每 10% 一格)
+private:
+    vector<Character*> members; // 出戰成員 (順序即行動順序)
+    vector<int> alive;          // 存活成員的槽位 (無序)
+    vector<int> alivePos;       // 槽位 → alive 中的位置 (-1 表示陣亡)
+    vector<int> power;          // 各槽位目前計入的戰力
+    vector<int> bucket;         // 各槽位目前的 HP 區間 (-1 表示陣亡)
+    int bucketCount[HP_BUCKETS] = {0};
+    int totalPower = 0;
+    TargetIndex targets;        // 供敵方選擇目標
+    friend struct BattleSnapshot;
+    static int powerOf(const Character* c) { return c->getAttack() + c->getHP() / 10; }
+    static int bucketOf(const Character* c) {
+        if (c->getHP() <= 0) return -1;
+        return min(HP_BUCKETS - 1, c->getHP() * HP_BUCKETS / max(1, c->getMaxHP()));
+    }
+    void markAlive(int slot);
+    void markDead(int slot);
+    void track(int slot);
+    void untrack(int slot);
+public:
+    Party() {}
+    Party(const Party&) = delete;
+    Party& operator=(const Party&) = delete;
+    ~Party() { release(); }
+    // 存取函式
+    size_t size() const { return members.size(); }
+    bool empty() const { return members.empty(); }
+    Character* operator[](size_t i) const { return members[i]; }
+    vector<Character*>::const_iterator begin() const { return members.begin(); }
+    vector<Character*>::const_iterator end() const { return members.end(); }
+    const vector<int>& aliveSlots() const { return alive; }
+    // 聚合查詢 (皆為 O(1))
+    int aliveCount() const { return alive.size(); }
+    bool wiped() const { return alive.empty(); }
+    int getTotalPower() const { return totalPower; }
+    int averagePower() const { return members.empty() ? 0 : totalPower / (int)members.size(); }
+    int countInBucket(int b) const { return bucketCount[b]; }
+    int lowHPCount() const { return bucketCount[0] + bucketCount[1] + bucketCount[2]; } // HP 低於 30%
+    Character* randomAlive() const { return alive.empty() ? nullptr : members[alive[getRandom(0, alive.size() - 1)]]; }
+    int pick(TargetPolicy policy) const { return targets.pick(policy); } // O(log n)
+    // 名冊異動
+    void add(Character* c);
+    void removeAt(size_t idx);
+    vector<Character*> release();
+    // 成員狀態變化通知 (存活名單只在生死改變時異動)
+    void onMemberChanged(int slot);
+};
+const int Party::HP_BUCKETS;
+// 加入存活名單
+void Party::markAlive(int slot) {
+    alivePos[slot] = alive.size();
+    alive.push_back(slot);
+}
+// 移出存活名單 (以尾端交換刪除)
+void Party::markDead(int slot) {
+    int pos = alivePos[slot], last = alive.back();
+    alive[pos] = last; alivePos[last] = pos;
+    alive.pop_back();
+    alivePos[slot] = -1;
+}
+// 計入單一槽位
+void Party::track(int slot) {
+    Character* c = members[slot];
+    targets.set(slot, c->getHP(), c->getAttack(), c->getHP() > 0);
+    power[slot] = powerOf(c);
+    totalPower += power[slot];
+    bucket[slot] = bucketOf(members[slot]);
+    if (bucket[slot] >= 0) { bucketCount[bucket[slot]]++; markAlive(slot); }
+}
+// 移除單一槽位的統計
+void Party::untrack(int slot) {
+    totalPower -= power[slot];
+    power[slot] = 0;
+    if (bucket[slot] >= 0) { bucketCount[bucket[slot]]--; markDead(slot); }
+    bucket[slot] = -1;
+    targets.set(slot, 0, 0, false);
+}
+// 狀態變化實作：補差值，不重掃隊伍
+void Party::onMemberChanged(int slot) {
+    Character* c = members[slot];
+    targets.set(slot, c->getHP(), c->getAttack(), c->getHP() > 0);
+    int p = powerOf(c);
+    totalPower += p - power[slot];
+    power[slot] = p;
+    int b = bucketOf(c);
+    if (b == bucket[slot]) return;
+    if (bucket[slot] >= 0) bucketCount[bucket[slot]]--;
+    if (b >= 0) bucketCount[b]++;
+    if (bucket[slot] < 0 && b >= 0) markAlive(slot);
+    else if (bucket[slot] >= 0 && b < 0) markDead(slot);
+    bucket[slot] = b;
+}
+// 加入成員
+void Party::add(Character* c) {
+    int slot = members.size();
+    members.push_back(c);
+    alivePos.push_back(-1); power.push_back(0); bucket.push_back(-1);
+    targets.resize(members.size());
+    c->attachParty(this, slot);
+    track(slot);
+}
+// 移除成員 (後方成員槽位前移)
+void Party::removeAt(size_t idx) {
+    for (size_t i = idx; i < members.size(); ++i) untrack(i);
+    members[idx]->attachParty(nullptr, -1);
+    members.erase(members.begin() + idx);
+    alivePos.pop_back(); power.pop_back(); bucket.pop_back();
+    for (size_t i = idx; i < members.size(); ++i) { members[i]->attachParty(this, i); track(i); }
+}
+// 解除所有成員並交還指標 (由呼叫端負責釋放)
+vector<Character*> Party::release() {
+    vector<Character*> out;
+    out.swap(members);
+    for (auto* c : out) c->attachParty(nullptr, -1);
+    alive.clear(); alivePos.clear(); power.clear(); bucket.clear();
+    targets = TargetIndex();
+    for (int& n : bucketCount) n = 0;
+    totalPower = 0;
+    return out;
+}
+// 狀態變化通知實作
+void Character::notifyParty() { if (party) party->onMemberChanged(partySlot); }
+
+// ==========================================
+// 技能公式 (Skill Formulas)
+// ==========================================
+
+// 小型算式語言：技能的傷害、治療與效果判定寫成算式，建立技能時編譯一次成暫存器位元組碼。
+//   變數   user.atk / user.power / user.int / user.luck / user.speed / user.hp / user.maxhp / user.hpr / user.level / user.buff
+//          target.hp / target.maxhp / target.hpr / target.atk / target.speed (目前鎖定的敵人)
+//          party.alive / party.size / party.low (HP 低於 30% 的人數)
+//   運算   + - * / 、比較 (結果 0/1)、&& || ! 、 條件 ? 甲 : 乙
+//   函式   min(a,b) max(a,b) floor(x) rand(lo,hi) (整數亂數) chance(p) (p% 機率為 1)
+namespace Formula {
+    enum Var : uint8_t {
+        USER_ATK, USER_POWER, USER_INT, USER_LUCK, USER_SPEED, USER_HP, USER_MAXHP, USER_HPR, USER_LEVEL, USER_BUFF,
+        TARGET_HP, TARGET_MAXHP, TARGET_HPR, TARGET_ATK, TARGET_SPEED,
+        PARTY_ALIVE, PARTY_SIZE, PARTY_LOW, VAR_COUNT
+    };
+    const char* const VAR_NAMES[VAR_COUNT] = {
+        "user.atk", "user.power", "user.int", "user.luck", "user.speed", "user.hp", "user.maxhp", "user.hpr", "user.level", "user.buff",
+        "target.hp", "target.maxhp", "target.hpr", "target.atk", "target.speed",
+        "party.alive", "party.size", "party.low"
+    };
+    // LOADV 之後每個變數各佔一個運算碼 (LOADV + 變數編號)，讀變數不必再分派一次
+    enum Op : uint8_t { MOV, ADD, SUB, MUL, DIV, NEG, LT, LE, GT, GE, EQ, NE, AND, OR, NOT, MIN, MAX, FLOOR, RAND, CHANCE, JZ, JMP, RET, LOADV };
+    const char* const OP_NAMES[] = {"mov", "add", "sub", "mul", "div", "neg", "lt", "le", "gt", "ge", "eq", "ne", "and", "or", "not", "min", "max", "floor", "rand", "chance", "jz", "jmp", "ret", "loadv"};
+
+    // 指令：dst = a op b；運算元小於 KBASE 為暫存器，否則為常數表索引 + KBASE (評估時不必複製常數)
+    // LOADV 的 a 為變數編號 (僅供反組譯)，JZ/JMP 的 a 為跳躍目的地 (JZ 以 dst 為條件)
+    struct Instr { uint8_t op, dst, a, b; };
+    const int KBASE = 128, MAX_REGS = 128, MAX_CONSTS = 128, MAX_CODE = 255;
+
+    // 評估時可參考的狀態 (兩個指標，以值傳遞；目標由戰鬥迴圈透過 foes/aim 提供)
+    struct Context {
+        const Character* user;
+        const Party* team;
+    };
+    // 可直接計算的形式：變數 × 倍率 + 常數，倍率與常數可依「test < limit」二選一
+    // (var < 0 表示只有常數，test < 0 表示不分支；[0] 為條件成立時、[1] 為不成立時)
+    struct Shape {
+        int var = -1, test = -1;
+        double limit = 0;
+        double scale[2] = {0, 0}, offset[2] = {0, 0};
+    };
+    thread_local const EnemyGroup* foes = nullptr; // 目前戰鬥的敵方 (戰鬥外為 nullptr，target.* 皆為 0)
+    thread_local const Monster* aim = nullptr;     // 戰鬥迴圈在施放前鎖定的目標 (未鎖定或已倒下時改取 HP 最低者)
+    void aimAt(int target);                        // 鎖定 foes 的第 target 隻 (-1 取消)；以下兩者定義於怪物系統之後
+    inline double targetStat(Var v);
+
+    // RAII：戰鬥期間提供敵方給公式
+    struct FoeScope {
+        const EnemyGroup* prev;
+        explicit FoeScope(const EnemyGroup& e) : prev(foes) { foes = &e; aim = nullptr; }
+        ~FoeScope() { foes = prev; aim = nullptr; }
+    };
+
+    // 編譯後的程式：指令、常數表與結果所在的運算元
+    class Program {
+        friend class Compiler;
+        vector<Instr> code;
+        vector<double> consts;
+        int regCount = 0;
+        int result = 0;
+        // 編譯器辨識出 Shape 形式的程式 (含 AttackSkill 相同的線性式與單一條件分支) 不進直譯迴圈，
+        // 改由 eval 直接計算；常見形式的 eval 在編譯期就決定讀哪些變數，不必再分派
+        typedef double (*Eval)(const Program&, Context);
+        Eval eval = nullptr;
+        Shape shape;
+        FORCE_INLINE static double read(Var v, Context ctx) {
+            const Character* u = ctx.user;
+            switch (v) {
+                case USER_ATK: return u->getAttack();
+                case USER_POWER: return u->getAttack() - u->getTempBuff();
+                case USER_INT: return u->getKnowledge();
+                case USER_LUCK: return u->getLuck();
+                case USER_SPEED: return u->getSpeed();
+                case USER_HP: return u->getHP();
+                case USER_MAXHP: return u->getMaxHP();
+                case USER_HPR: return u->getMaxHP() > 0 ? (double)u->getHP() / u->getMaxHP() : 0;
+                case USER_LEVEL: return u->getLevel();
+                case USER_BUFF: return u->getTempBuff();
+                case PARTY_ALIVE: return ctx.team->aliveCount();
+                case PARTY_SIZE: return ctx.team->size();
+                case PARTY_LOW: return ctx.team->lowHPCount();
+                default: return targetStat(v);
+            }
+        }
+        // 計算順序與位元組碼相同 (x × 倍率 + 常數，不分支時常數為 0)，結果逐位元一致
+        template<int T, int V> static double evalShape(const Program& p, Context ctx) {
+            int branch = T >= 0 && !(read((Var)T, ctx) < p.shape.limit);
+            double x = V >= 0 ? read((Var)V, ctx) : 0;
+            return x * p.shape.scale[branch] + p.shape.offset[branch];
+        }
+        static double evalAny(const Program& p, Context ctx) {
+            const Shape& s = p.shape;
+            int branch = s.test >= 0 && !(read((Var)s.test, ctx) < s.limit);
+            double x = s.var >= 0 ? read((Var)s.var, ctx) : 0;
+            return x * s.scale[branch] + s.offset[branch];
+        }
+        // 常見形式：AttackSkill 的三種屬性 (或只有常數)，不分支或依 HP 比例分支
+        static Eval specialize(const Shape& s) {
+            #define SHAPE(T, V) if (s.test == (T) && s.var == (V)) return &evalShape<T, V>;
+            #define SHAPES(T) SHAPE(T, -1) SHAPE(T, USER_ATK) SHAPE(T, USER_INT) SHAPE(T, USER_LUCK)
+            SHAPES(-1) SHAPES(USER_HPR) SHAPES(TARGET_HPR)
+            #undef SHAPES
+            #undef SHAPE
+            return &evalAny;
+        }
+    public:
+        // 直譯執行：GCC/Clang 以標籤位址做直接串接分派，每個指令結尾各自跳往下一個指令，分支預測可依前後指令配對；
+        // 其他編譯器退回 switch 迴圈。每個指令約 1.5 ns，含條件的算式約為手寫技能的 5–7 倍耗時，
+        // 因此常見形式由編譯器辨識為 Shape 後直接計算，只有其餘算式 (min/max、亂數、多重條件等) 走這裡
+        double execute(Context ctx) const {
+            double r[MAX_REGS];
+            const double* k = consts.data() - KBASE;
+            const Instr* base = code.data();
+            const Instr* pc = base;
+            const Instr* i;
+            #define RK(x) ((x) < KBASE ? r[x] : k[x])
+#ifdef __GNUC__
+            static const void* const dispatch[] = {
+                &&op_mov, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_neg, &&op_lt, &&op_le, &&op_gt, &&op_ge, &&op_eq,
+                &&op_ne, &&op_and, &&op_or, &&op_not, &&op_min, &&op_max, &&op_floor, &&op_rand, &&op_chance, &&op_jz, &&op_jmp, &&op_ret,
+                &&v_atk, &&v_power, &&v_int, &&v_luck, &&v_speed, &&v_hp, &&v_maxhp, &&v_hpr, &&v_level, &&v_buff,
+                &&v_target, &&v_target, &&v_target, &&v_target, &&v_target,
+                &&v_alive, &&v_size, &&v_low
+            };
+            #define NEXT i = pc++; goto *dispatch[i->op]
+            NEXT;
+            op_mov: r[i->dst] = RK(i->a); NEXT;
+            op_add: r[i->dst] = RK(i->a) + RK(i->b); NEXT;
+            op_sub: r[i->dst] = RK(i->a) - RK(i->b); NEXT;
+            op_mul: r[i->dst] = RK(i->a) * RK(i->b); NEXT;
+            op_div: r[i->dst] = RK(i->b) != 0 ? RK(i->a) / RK(i->b) : 0; NEXT;
+            op_neg: r[i->dst] = -r[i->a]; NEXT;
+            op_lt: r[i->dst] = RK(i->a) < RK(i->b); NEXT;
+            op_le: r[i->dst] = RK(i->a) <= RK(i->b); NEXT;
+            op_gt: r[i->dst] = RK(i->a) > RK(i->b); NEXT;
+            op_ge: r[i->dst] = RK(i->a) >= RK(i->b); NEXT;
+            op_eq: r[i->dst] = RK(i->a) == RK(i->b); NEXT;
+            op_ne: r[i->dst] = RK(i->a) != RK(i->b); NEXT;
+            op_and: r[i->dst] = RK(i->a) != 0 && RK(i->b) != 0; NEXT;
+            op_or: r[i->dst] = RK(i->a) != 0 || RK(i->b) != 0; NEXT;
+            op_not: r[i->dst] = r[i->a] == 0; NEXT;
+            op_min: r[i->dst] = std::min(RK(i->a), RK(i->b)); NEXT;
+            op_max: r[i->dst] = std::max(RK(i->a), RK(i->b)); NEXT;
+            op_floor: r[i->dst] = floor(r[i->a]); NEXT;
+            op_rand: r[i->dst] = getRandom((int)RK(i->a), std::max((int)RK(i->a), (int)RK(i->b))); NEXT;
+            op_chance: r[i->dst] = getRandom(1, 100) <= RK(i->a); NEXT;
+            op_jz: if (r[i->dst] == 0) pc = base + i->a; NEXT;
+            op_jmp: pc = base + i->a; NEXT;
+            // 變數編號為常數，read() 內聯後只剩對應的那一行
+            v_atk: r[i->dst] = read(USER_ATK, ctx); NEXT;
+            v_power: r[i->dst] = read(USER_POWER, ctx); NEXT;
+            v_int: r[i->dst] = read(USER_INT, ctx); NEXT;
+            v_luck: r[i->dst] = read(USER_LUCK, ctx); NEXT;
+            v_speed: r[i->dst] = read(USER_SPEED, ctx); NEXT;
+            v_hp: r[i->dst] = read(USER_HP, ctx); NEXT;
+            v_maxhp: r[i->dst] = read(USER_MAXHP, ctx); NEXT;
+            v_hpr: r[i->dst] = read(USER_HPR, ctx); NEXT;
+            v_level: r[i->dst] = read(USER_LEVEL, ctx); NEXT;
+            v_buff: r[i->dst] = read(USER_BUFF, ctx); NEXT;
+            v_target: r[i->dst] = targetStat((Var)i->a); NEXT;
+            v_alive: r[i->dst] = read(PARTY_ALIVE, ctx); NEXT;
+            v_size: r[i->dst] = read(PARTY_SIZE, ctx); NEXT;
+            v_low: r[i->dst] = read(PARTY_LOW, ctx); NEXT;
+            op_ret: return RK(i->a);
+            #undef NEXT
+#else
+            for (;;) {
+                i = pc++;
+                switch (i->op) {
+                    case MOV: r[i->dst] = RK(i->a); break;
+                    case ADD: r[i->dst] = RK(i->a) + RK(i->b); break;
+                    case SUB: r[i->dst] = RK(i->a) - RK(i->b); break;
+                    case MUL: r[i->dst] = RK(i->a) * RK(i->b); break;
+                    case DIV: r[i->dst] = RK(i->b) != 0 ? RK(i->a) / RK(i->b) : 0; break;
+                    case NEG: r[i->dst] = -r[i->a]; break;
+                    case LT: r[i->dst] = RK(i->a) < RK(i->b); break;
+                    case LE: r[i->dst] = RK(i->a) <= RK(i->b); break;
+                    case GT: r[i->dst] = RK(i->a) > RK(i->b); break;
+                    case GE: r[i->dst] = RK(i->a) >= RK(i->b); break;
+                    case EQ: r[i->dst] = RK(i->a) == RK(i->b); break;
+                    case NE: r[i->dst] = RK(i->a) != RK(i->b); break;
+                    case AND: r[i->dst] = RK(i->a) != 0 && RK(i->b) != 0; break;
+                    case OR: r[i->dst] = RK(i->a) != 0 || RK(i->b) != 0; break;
+                    case NOT: r[i->dst] = r[i->a] == 0; break;
+                    case MIN: r[i->dst] = std::min(RK(i->a), RK(i->b)); break;
+                    case MAX: r[i->dst] = std::max(RK(i->a), RK(i->b)); break;
+                    case FLOOR: r[i->dst] = floor(r[i->a]); break;
+                    case RAND: r[i->dst] = getRandom((int)RK(i->a), std::max((int)RK(i->a), (int)RK(i->b))); break;
+                    case CHANCE: r[i->dst] = getRandom(1, 100) <= RK(i->a); break;
+                    case JZ: if (r[i->dst] == 0) pc = base + i->a; break;
+                    case JMP: pc = base + i->a; break;
+                    case RET: return RK(i->a);
+                    default: r[i->dst] = read((Var)(i->op - LOADV), ctx); break; // LOADV + 變數編號
+                }
+            }
+#endif
+            #undef RK
+        }
+        // 評估：可直接計算的程式不進直譯迴圈
+        FORCE_INLINE double run(Context ctx) const { return eval ? eval(*this, ctx) : execute(ctx); }
+        // 反組譯 (除錯與 --formula 用)
+        void disassemble(ostream& os) const {
+            auto slot = [](int s) { return s < KBASE ? "r" + to_string(s) : "k" + to_string(s - KBASE); };
+            for (size_t pc = 0; pc < code.size(); ++pc) {
+                const Instr& i = code[pc];
+                os << setw(3) << pc << "  " << left << setw(7) << OP_NAMES[std::min<int>(i.op, LOADV)] << right;
+                if (i.op >= LOADV) os << slot(i.dst) << ", " << VAR_NAMES[i.a];
+                else if (i.op == JMP) os << "-> " << (int)i.a;
+                else if (i.op == JZ) os << slot(i.dst) << " -> " << (int)i.a;
+                else if (i.op == RET) os << slot(i.a);
+                else if (i.op == MOV || i.op == NEG || i.op == NOT || i.op == FLOOR || i.op == CHANCE) os << slot(i.dst) << ", " << slot(i.a);
+                else os << slot(i.dst) << ", " << slot(i.a) << ", " << slot(i.b);
+                os << "\n";
+            }
+            for (size_t k = 0; k < consts.size(); ++k) os << "  k" << k << " = " << consts[k] << "\n";
+            if (!eval) return;
+            // 界限可能是下一個可表示的數 (由 ≤ 改寫)，預設精度顯示不出差異時改用完整精度
+            ostringstream limit;
+            limit << shape.limit;
+            if (strtod(limit.str().c_str(), nullptr) != shape.limit) { limit.str(""); limit << setprecision(17) << shape.limit; }
+            os << "  (直接計算" << (eval == &evalAny ? "" : "，已特化") << ": ";
+            if (shape.test >= 0) os << VAR_NAMES[shape.test] << " < " << limit.str() << " ? ";
+            for (int b = 0; b < (shape.test >= 0 ? 2 : 1); ++b) {
+                if (b) os << " : ";
+                bool scaled = shape.var >= 0 && shape.scale[b] != 0;
+                if (scaled) os << VAR_NAMES[shape.var] << " * " << shape.scale[b];
+                if (scaled && shape.offset[b] != 0) os << (shape.offset[b] < 0 ? " - " : " + ") << fabs(shape.offset[b]);
+                else if (!scaled) os << shape.offset[b];
+            }
+            os << ")\n";
+        }
+        size_t size() const { return code.size(); }
+        bool isDirect() const { return eval != nullptr; }
+    };
+
+    // 遞迴下降編譯器：直接產生位元組碼，暫存器以堆疊方式配置，兩邊皆為常數時當場摺疊
+    class Compiler {
+        // 運算元：常數 (尚未放入槽位) 或暫存器；shaped 時 shape 為同一個值的 Shape 表示
+        struct Operand { bool isConst; double value; int reg; bool shaped; Shape shape; };
+        const string& src;
+        size_t pos = 0;
+        string error;
+        Program prog;
+        int top = 0; // 下一個可用暫存器
+
+        static Operand constant(double v) {
+            Operand o = {true, v, -1, true};
+            o.shape.offset[0] = o.shape.offset[1] = v;
+            return o;
+        }
+        static Operand reg(int r) { return {false, 0, r, false}; }
+        void fail(const string& msg) { if (error.empty()) error = msg + " (位置 " + to_string(pos) + ")"; }
+        void skipSpace() { while (pos < src.size() && isspace((unsigned char)src[pos])) ++pos; }
+        bool accept(const char* tok) {
+            skipSpace();
+            size_t n = strlen(tok);
+            if (src.compare(pos, n, tok) != 0) return false;
+            // 避免把 <= 的 < 或 && 的 & 當成較短的運算子
+            if (n == 1 && pos + 1 < src.size() && (tok[0] == '<' || tok[0] == '>' || tok[0] == '!') && src[pos + 1] == '=') return false;
+            pos += n;
+            return true;
+        }
+        void expect(const char* tok) { if (!accept(tok)) fail(string("預期 '") + tok + "'"); }
+        int alloc() {
+            if (top >= MAX_REGS) { fail("算式過於複雜"); return 0; }
+            prog.regCount = std::max(prog.regCount, top + 1);
+            return top++;
+        }
+        void release(const Operand& o) { if (!o.isConst && o.reg == top - 1) --top; }
+        int slotOf(const Operand& o) {
+            if (!o.isConst) return o.reg;
+            for (size_t k = 0; k < prog.consts.size(); ++k) if (prog.consts[k] == o.value) return KBASE + k;
+            if (prog.consts.size() >= (size_t)MAX_CONSTS) { fail("常數過多"); return KBASE; }
+            prog.consts.push_back(o.value);
+            return KBASE + prog.consts.size() - 1;
+        }
+        void emit(Op op, int dst, int a, int b) {
+            if (prog.code.size() >= (size_t)MAX_CODE) { fail("算式過長"); return; }
+            prog.code.push_back({op, (uint8_t)dst, (uint8_t)a, (uint8_t)b});
+        }
+        // 結果放進暫存器 (已是暫存器則沿用)
+        int materialize(const Operand& o) {
+            if (!o.isConst) return o.reg;
+            int r = alloc();
+            emit(MOV, r, slotOf(o), 0);
+            return r;
+        }
+        static double fold(Op op, double a, double b) {
+            switch (op) {
+                case ADD: return a + b; case SUB: return a - b; case MUL: return a * b; case DIV: return b != 0 ? a / b : 0;
+                case LT: return a < b; case LE: return a <= b; case GT: return a > b; case GE: return a >= b;
+                case EQ: return a == b; case NE: return a != b; case AND: return a != 0 && b != 0; case OR: return a != 0 || b != 0;
+                case MIN: return std::min(a, b); case MAX: return std::max(a, b);
+                default: return 0;
+            }
+        }
+        // Shape 的合併：只接受與位元組碼逐位元相同的組合 (不重新結合浮點運算，例如 (v × a) × b 不併成 v × ab)
+        static bool unit(const Shape& s) { return s.var >= 0 && s.scale[0] == 1 && s.scale[1] == 1 && s.offset[0] == 0 && s.offset[1] == 0; }
+        static bool noOffset(const Shape& s) { return s.offset[0] == 0 && s.offset[1] == 0; }
+        static bool mergeTest(const Shape& a, const Shape& b, Shape& out) {
+            if (a.test >= 0 && b.test >= 0 && (a.test != b.test || a.limit != b.limit)) return false;
+            const Shape& t = a.test >= 0 ? a : b;
+            out.test = t.test; out.limit = t.limit;
+            return true;
+        }
+        static bool combine(Op op, const Operand& l, const Operand& r, Shape& s) {
+            const Shape& a = l.shape;
+            const Shape& b = r.shape;
+            if (!l.shaped || !r.shaped || !mergeTest(a, b, s)) return false;
+            bool ka = a.var < 0, kb = b.var < 0;
+            if (op == ADD || op == SUB || op == MUL) {
+                if (ka && kb) {
+                    for (int i = 0; i < 2; ++i) s.offset[i] = fold(op, a.offset[i], b.offset[i]);
+                    return true;
+                }
+                const Shape& v = ka ? b : a;
+                const Shape& k = ka ? a : b;
+                s.var = v.var;
+                for (int i = 0; i < 2; ++i) {
+                    if (op == MUL) { s.scale[i] = k.offset[i]; continue; }            // v × k
+                    s.scale[i] = (op == SUB && ka) ? -v.scale[i] : v.scale[i];        // k - v×s = v×(-s) + k
+                    s.offset[i] = (op == SUB && kb) ? -k.offset[i] : k.offset[i];     // v×s - k = v×s + (-k)
+                }
+                return (op == MUL ? unit(v) : noOffset(v)) && (ka || kb);
+            }
+            if (op >= LT && op <= GE && a.test < 0 && b.test < 0 && ka != kb && unit(ka ? b : a)) {
+                // 條件：變數與常數比較，一律改寫成「變數 < 界限」(變數皆為有限值)：
+                // 常數在左側時反轉方向，≤ 與 > 以下一個可表示的數為界限，> 與 ≥ 則交換成立與不成立
+                static const Op flipped[] = {GT, GE, LT, LE};
+                Op cmp = ka ? flipped[op - LT] : op;
+                double k = ka ? a.offset[0] : b.offset[0];
+                s.test = ka ? b.var : a.var;
+                s.limit = (cmp == LE || cmp == GT) ? nextafter(k, numeric_limits<double>::infinity()) : k;
+                s.offset[cmp == GT || cmp == GE] = 1;
+                return true;
+            }
+            return false;
+        }
+        Operand binary(Op op, const Operand& l, const Operand& r) {
+            if (l.isConst && r.isConst) return constant(fold(op, l.value, r.value));
+            int a = slotOf(l), b = slotOf(r);
+            release(r); release(l); // 右側在堆疊頂端，依序釋放後結果沿用最低的暫存器
+            int dst = alloc();
+            emit(op, dst, a, b);
+            Operand o = reg(dst);
+            o.shaped = combine(op, l, r, o.shape);
+            return o;
+        }
+        Operand unary(Op op, const Operand& o) {
+            if (o.isConst) return constant(op == NEG ? -o.value : op == NOT ? (o.value == 0) : op == FLOOR ? floor(o.value) : 0);
+            emit(op, o.reg, o.reg, 0);
+            Operand res = o;
+            // -(v×s) = v×(-s)；其他一元運算不追蹤
+            res.shaped = o.shaped && op == NEG && (o.shape.var < 0 || noOffset(o.shape));
+            for (int i = 0; i < 2; ++i) { res.shape.scale[i] = -o.shape.scale[i]; res.shape.offset[i] = -o.shape.offset[i]; }
+            return res;
+        }
+
+        Operand primary() {
+            skipSpace();
+            if (pos >= src.size()) { fail("算式不完整"); return constant(0); }
+            char c = src[pos];
+            if (isdigit((unsigned char)c) || c == '.') {
+                char* end;
+                double v = strtod(src.c_str() + pos, &end);
+                if (end == src.c_str() + pos) { fail("數字格式錯誤"); return constant(0); }
+                pos = end - src.c_str();
+                return constant(v);
+            }
+            if (accept("(")) { Operand o = ternary(); expect(")"); return o; }
+            if (isalpha((unsigned char)c) || c == '_') {
+                size_t start = pos;
+                while (pos < src.size() && (isalnum((unsigned char)src[pos]) || src[pos] == '_' || src[pos] == '.')) ++pos;
+                string name = src.substr(start, pos - start);
+                if (accept("(")) return call(name);
+                for (int v = 0; v < VAR_COUNT; ++v) if (name == VAR_NAMES[v]) {
+                    Operand o = reg(alloc());
+                    emit((Op)(LOADV + v), o.reg, v, 0);
+                    o.shaped = true;
+                    o.shape.var = v;
+                    o.shape.scale[0] = o.shape.scale[1] = 1;
+                    return o;
+                }
+                fail("未知的變數 " + name);
+                return constant(0);
+            }
+            fail(string("無法解析 '") + c + "'");
+            return constant(0);
+        }
+        Operand call(const string& name) {
+            vector<Operand> args;
+            if (!accept(")")) {
+                do args.push_back(ternary()); while (accept(","));
+                expect(")");
+            }
+            auto arity = [&](size_t n) { if (args.size() != n) fail(name + " 需要 " + to_string(n) + " 個參數"); return args.size() == n; };
+            if (name == "min" && arity(2)) return binary(MIN, args[0], args[1]);
+            if (name == "max" && arity(2)) return binary(MAX, args[0], args[1]);
+            if (name == "floor" && arity(1)) return unary(FLOOR, args[0]);
+            if ((name == "rand" && arity(2)) || (name == "chance" && arity(1))) {
+                // 亂數不能摺疊：參數先放進槽位再取結果暫存器
+                int a = slotOf(args[0]), b = args.size() > 1 ? slotOf(args[1]) : 0;
+                for (size_t k = args.size(); k-- > 0;) release(args[k]);
+                int dst = alloc();
+                emit(name == "rand" ? RAND : CHANCE, dst, a, b);
+                return reg(dst);
+            }
+            if (error.empty() && name != "min" && name != "max" && name != "floor" && name != "rand" && name != "chance") fail("未知的函式 " + name);
+            return constant(0);
+        }
+        Operand unaryExpr() {
+            if (accept("-")) return unary(NEG, unaryExpr());
+            if (accept("!")) return unary(NOT, unaryExpr());
+            if (accept("+")) return unaryExpr();
+            return primary();
+        }
+        Operand term() {
+            Operand l = unaryExpr();
+            while (error.empty()) {
+                if (accept("*")) l = binary(MUL, l, unaryExpr());
+                else if (accept("/")) l = binary(DIV, l, unaryExpr());
+                else break;
+            }
+            return l;
+        }
+        Operand sum() {
+            Operand l = term();
+            while (error.empty()) {
+                if (accept("+")) l = binary(ADD, l, term());
+                else if (accept("-")) l = binary(SUB, l, term());
+                else break;
+            }
+            return l;
+        }
+        Operand compare() {
+            Operand l = sum();
+            while (error.empty()) {
+                if (accept("<=")) l = binary(LE, l, sum());
+                else if (accept(">=")) l = binary(GE, l, sum());
+                else if (accept("==")) l = binary(EQ, l, sum());
+                else if (accept("!=")) l = binary(NE, l, sum());
+                else if (accept("<")) l = binary(LT, l, sum());
+                else if (accept(">")) l = binary(GT, l, sum());
+                else break;
+            }
+            return l;
+        }
+        Operand logicAnd() {
+            Operand l = compare();
+            while (error.empty() && accept("&&")) l = binary(AND, l, compare());
+            return l;
+        }
+        Operand logicOr() {
+            Operand l = logicAnd();
+            while (error.empty() && accept("||")) l = binary(OR, l, logicAnd());
+            return l;
+        }
+        // 條件運算只執行選到的一邊 (分支內的亂數不會多耗用)
+        Operand ternary() {
+            Operand cond = logicOr();
+            if (!accept("?")) return cond;
+            int r = materialize(cond);
+            size_t jz = prog.code.size();
+            emit(JZ, r, 0, 0);
+            Operand a = ternary();
+            if (a.isConst || a.reg != r) { emit(MOV, r, slotOf(a), 0); release(a); }
+            size_t jmp = prog.code.size();
+            emit(JMP, 0, 0, 0);
+            expect(":");
+            if (jz < prog.code.size()) prog.code[jz].a = prog.code.size();
+            Operand b = ternary();
+            if (b.isConst || b.reg != r) { emit(MOV, r, slotOf(b), 0); release(b); }
+            if (jmp < prog.code.size()) prog.code[jmp].a = prog.code.size();
+            // 條件為單一比較、兩邊為同一個變數 (或常數) 的線性式時，結果可直接計算
+            Operand o = reg(r);
+            const Shape& c = cond.shape;
+            int yes = c.offset[0] == 1 ? 0 : 1; // 條件成立時取 a 的那一邊
+            o.shaped = cond.shaped && c.var < 0 && c.test >= 0 && c.offset[yes] == 1 && c.offset[!yes] == 0 && a.shaped && b.shaped
+                    && a.shape.test < 0 && b.shape.test < 0 && (a.shape.var < 0 || b.shape.var < 0 || a.shape.var == b.shape.var);
+            o.shape = c;
+            o.shape.var = a.shape.var >= 0 ? a.shape.var : b.shape.var;
+            o.shape.scale[yes] = a.shape.scale[0]; o.shape.scale[!yes] = b.shape.scale[0];
+            o.shape.offset[yes] = a.shape.offset[0]; o.shape.offset[!yes] = b.shape.offset[0];
+            return o;
+        }
+    public:
+        explicit Compiler(const string& text) : src(text) {}
+        bool compile(Program& out, string& err) {
+            Operand o = ternary();
+            skipSpace();
+            if (error.empty() && pos < src.size()) fail("多餘的字元");
+            prog.result = slotOf(o);
+            emit(RET, 0, prog.result, 0);
+            prog.shape = o.shape;
+            prog.eval = o.shaped ? Program::specialize(o.shape) : nullptr;
+            if (!error.empty()) {
+                err = error;
+                out = Program();
+                out.consts.push_back(0); // 失敗時為結果恆為 0 的程式
+                out.result = KBASE;
+                out.code.push_back({RET, 0, KBASE, 0});
+                return false;
+            }
+            out = prog;
+            return true;
+        }
+    };
+
+    // 編譯並快取：同一段算式只編譯一次 (角色每場戰鬥都重新建立，技能共用同一份程式)
+    shared_ptr<const Program> compile(const string& text) {
+        static mutex lock;
+        static unordered_map<string, shared_ptr<const Program>> cache;
+        lock_guard<mutex> guard(lock);
+        auto it = cache.find(text);
+        if (it != cache.end()) return it->second;
+        Program prog;
+        string err;
+        if (!Compiler(text).compile(prog, err)) cerr << "公式編譯失敗: " << text << " : " << err << "\n";
+        shared_ptr<const Program> p = make_shared<Program>(prog);
+        cache[text] = p;
+        return p;
+    }
+}
+
+// ==========================================
+// 技能與道具實作
+// ==========================================
+
+// 攻擊型技能類別
+class AttackSkill : public Skill {
+    StatType stat; double multiplier; int baseDmg; bool area;
+public:
+    AttackSkill(string n, string d, StatType s, double m, int b, int cd, bool aoe = false) : Skill(n, d, cd), stat(s), multiplier(m), baseDmg(b), area(aoe) {}
+    Skill* clone() const override { return new AttackSkill(*this); }
+    bool isAreaEffect() const override { return area; }
+    void scaleMultiplier(double f) { multiplier *= f; } // 平衡變體比較用
+    string signature() const override {
+        ostringstream os;
+        os << Skill::signature() << "|atk" << stat << ":" << multiplier << ":" << baseDmg << ":" << area;
+        return os.str();
+    }
+    int use(Character* user, Party& team) override {
+        int val = (stat == ATK) ? user->getAttack() : ((stat == INT) ? user->getKnowledge() : user->getLuck());
+        return (int)(val * multiplier + baseDmg);
+    }
+};
+// 治療型技能類別
+class HealSkill : public Skill {
+    int baseHeal; double intMod;
+public:
+    HealSkill(string n, string d, int base, double mod, int cd) : Skill(n, d, cd), baseHeal(base), intMod(mod) {}
+    Skill* clone() const override { return new HealSkill(*this); }
+    bool targetsEnemy() const override { return false; }
+    string signature() const override {
+        ostringstream os;
+        os << Skill::signature() << "|heal" << baseHeal << ":" << intMod;
+        return os.str();
+    }
+    int use(Character* user, Party& team) override {
+        int amount = baseHeal + (int)(user->getKnowledge() * intMod);
+        Transcript::say(Transcript::F_HEAL_ALL, amount);
+        vector<int> alive = team.aliveSlots();
+        for(int slot : alive) team[slot]->setHP(team[slot]->getHP() + amount);
+        Bus::heal(user->getCharId(), Bus::NOBODY, amount, alive.size());
+        return 0; 
+    }
+};
+// 公式型技能類別：傷害或治療量由算式決定，效果算式 (可省略) 大於 0 時附帶效果才生效
+enum FormulaKind { FORMULA_DAMAGE, FORMULA_HEAL };
+class FormulaSkill : public Skill {
+    FormulaKind kind;
+    shared_ptr<const Formula::Program> amount, effect;
+    string amountText, effectText;
+    bool area;
+    bool plain;  // 單純的傷害算式 (無效果判定)
+    bool landed = true;
+public:
+    FormulaSkill(string n, string d, FormulaKind k, const string& amountExpr, int cd, const string& effectExpr = "", bool aoe = false)
+        : Skill(n, d, cd), kind(k), amount(Formula::compile(amountExpr)), effect(effectExpr.empty() ? nullptr : Formula::compile(effectExpr)),
+          amountText(amountExpr), effectText(effectExpr), area(aoe), plain(k == FORMULA_DAMAGE && effectExpr.empty()) {}
+    Skill* clone() const override { return new FormulaSkill(*this); }
+    bool isAreaEffect() const override { return area; }
+    bool targetsEnemy() const override { return kind == FORMULA_DAMAGE; }
+    bool effectsLand() const override { return landed; }
+    string signature() const override { return Skill::signature() + "|f" + to_string(kind) + ":" + amountText + ":" + effectText + ":" + to_string(area); }
+    // 單純的傷害算式 (無效果判定) 只做一次評估，其餘情形交給 resolve()
+    int use(Character* user, Party& team) override {
+        if (plain) return std::max(0, (int)amount->run({user, &team}));
+        return resolve(user, team);
+    }
+    NO_INLINE int resolve(Character* user, Party& team) {
+        Formula::Context ctx = {user, &team};
+        int value = std::max(0, (int)amount->run(ctx));
+        if (effect) landed = effect->run(ctx) > 0;
+        if (kind == FORMULA_DAMAGE) return value;
+        Transcript::say(Transcript::F_HEAL_ALL, value);
+        vector<int> alive = team.aliveSlots();
+        for (int slot : alive) team[slot]->setHP(team[slot]->getHP() + value);
+        Bus::heal(user->getCharId(), Bus::NOBODY, value, alive.size());
+        return 0;
+    }
+};
+// 恢復型道具類別
+class RestoreItem : public Item {
+    int amount;
+public:
+    RestoreItem(string n, int p, string d, int amt) : Item(n, p, d), amount(amt) {}
+    int getAmount() const override { return amount; }
+    bool apply(Character* target) override {
+        if (target->getHP() <= 0) { out() << Color::RED << "無法對已陣亡角色使用！\n" << Color::RESET; return false; }
+        target->setHP(target->getHP() + amount);
+        Bus::itemUsed(target->getCharId(), amount, 0);
+        Bus::heal(Bus::NOBODY, target->getCharId(), amount, 1);
+        out() << Color::GREEN << target->getName() << " 恢復了 " << amount << " 點生命！\n" << Color::RESET;
+        return true;
+    }
+};
+// 復活型道具類別
+class ReviveItem : public Item {
+public:
+    ReviveItem(string n, int p, string d) : Item(n, p, d) {}
+    bool revives() const override { return true; }
+    bool apply(Character* target) override {
+        if (target->getHP() > 0) { out() << "該角色仍然存活。\n"; return false; }
+        target->setHP(target->getMaxHP() / 2);
+        Bus::itemUsed(target->getCharId(), target->getHP(), 1);
+        out() << Color::GREEN << target->getName() << " 復活了！\n" << Color::RESET;
+        return true;
+    }
+};
+// 技能秘笈類別：讓一名隊員學會新技能 (每本秘笈的技能各人只能學一次)
+class SkillBookItem : public Item {
+    Skill* lesson; // 技能樣板，學習時複製一份
+public:
+    SkillBookItem(string n, int p, string d, Skill* s) : Item(n, p, d), lesson(s) {}
+    ~SkillBookItem() { delete lesson; }
+    bool apply(Character* target) override {
+        if (target->getHP() <= 0) { out() << Color::RED << "無法對已陣亡角色使用！\n" << Color::RESET; return false; }
+        for (auto* s : target->getSkills()) if (s->getName() == lesson->getName()) { out() << target->getName() << " 已經學會 " << lesson->getName() << "。\n"; return false; }
+        target->addSkill(lesson->clone());
+        out() << Color::GREEN << target->getName() << " 學會了 " << lesson->getName() << "！\n" << Color::RESET;
+        return true;
+    }
+};
+
+// ==========================================
+// 背包與商店
+// ==========================================
+
+// 背包欄位結構體
+struct InventorySlot { Item* item; int count; };
+// 背包與商店容器 (每個執行緒一份；商店道具由各執行緒的 resetGame 建立，結束前自行釋放)
+thread_local vector<InventorySlot> inventory;
+thread_local vector<Item*> shopItems;
+// 新增道具至背包
+void addToInventory(Item* itemRef) {
+    Memory::Scope tag(Memory::INVENTORY);
+    for (auto& slot : inventory) {
+        if (slot.item->getName() == itemRef->getName()) { slot.count++; return; }
+    }
+    inventory.push_back({itemRef, 1});
+}
+
+// ==========================================
+// 職業與角色 (Characters)
+// ==========================================
+
+// Gadgeteer (道具專家 - 柯南)
+class Gadgeteer : public Character {
+public:
+    Gadgeteer(string n, int lv=1) : Character(n, "名偵探", lv, lv*60, lv*5, lv*12, lv*8, true) {
+        addSkill(new AttackSkill("腳力增強鞋", "踢出強力的物品", ATK, 2.0, 10, 2));
+        addSkill(new AttackSkill("麻醉手錶", "精準射擊", INT, 1.5, 20, 4));
+        addSkill((new AttackSkill("領結變聲器", "擾亂敵人", INT, 1.2, 0, 3))->addEffect(EFFECT_SLOW, 30, 2));
+    }
+    Character* clone() const override { return new Gadgeteer(*this); }
+    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(60, 5, 12, 8); }
+};
+
+// Fighter (格鬥家 - 小蘭、平次、京極真、赤井秀一、安室透、和葉)
+class Fighter : public Character {
+public:
+    Fighter(string n, string type, int lv=1) : Character(n, "格鬥家", lv, lv*100, lv*10, lv*3, lv*5, false) {
+        if (type == "Karate") { addSkill(new AttackSkill("空手道劈擊", "重擊", ATK, 1.8, 0, 1)); addSkill(new AttackSkill("迴旋踢", "連續踢擊", ATK, 2.2, 0, 2)); }
+        else if (type == "Kendo") { addSkill(new AttackSkill("劍道突刺", "精準", ATK, 1.5, 10, 1)); addSkill(new AttackSkill("居合斬", "拔刀", ATK, 2.5, 0, 3)); }
+        else if (type == "Super") { addSkill(new AttackSkill("正拳突刺", "極高傷", ATK, 3.0, 0, 3)); addSkill(new AttackSkill("迴旋踢", "踢擊", ATK, 2.2, 0, 2)); }
+        else if (type == "Sniper") { addSkill(new AttackSkill("銀色子彈", "狙擊", ATK, 3.5, 0, 4)); addSkill(new AttackSkill("截拳道", "近身", ATK, 2.0, 0, 2)); } 
+        else if (type == "SecretPolice") { addSkill(new AttackSkill("零之執行", "猛攻", ATK, 2.8, 0, 3)); addSkill(new AttackSkill("博擊", "連打", ATK, 1.5, 0, 1)); }
+        else if (type == "Aikido") { addSkill(new AttackSkill("合氣道摔", "防守反擊", ATK, 2.0, 0, 2)); addSkill(new AttackSkill("護身符", "幸運一擊", LUCK, 1.5, 20, 3)); }
+    }
+    Character* clone() const override { return new Fighter(*this); }
+    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(100, 10, 3, 5); }
+};
+
+// Support (後勤 - 灰原、博士、園子、優作)
+class Support : public Character {
+public:
+    Support(string n, string type, int lv=1) : Character(n, "後勤", lv, lv*50, lv*3, lv*15, lv*6, false) {
+        if (type == "Science") { addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); addSkill(new AttackSkill("化學知識", "智力傷害", INT, 2.0, 0, 2)); }
+        else if (type == "Inventor") { addSkill(new AttackSkill("冷謎語", "精神傷", INT, 1.0, 10, 1)); addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); }
+        else if (type == "Rich") { addSkill(new AttackSkill("鈔能力", "金錢攻擊", LUCK, 3.0, 0, 2)); addSkill(new HealSkill("應急處置", "治療", 50, 3.0, 3)); luck+=20; }
+        else if (type == "Novelist") { addSkill(new AttackSkill("世界級推理", "看穿一切", INT, 3.0, 0, 3)); addSkill((new HealSkill("冷靜分析", "恢復並加速", 60, 2.0, 2))->addEffect(EFFECT_HASTE, 20, 3)); }
+    }
+    Character* clone() const override { return new Support(*this); }
+    void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(50, 3, 15, 6); }
+};
+
+// Trickster (特殊 - 基德、小五郎、有希子)
+class Trickster : public Character {
+public:
     Trickster(string n, string type, int lv=1) : Character(n, "特殊", lv, lv*80, lv*6, lv*8, lv*15, false) {
-        if (type == "Thief") { addSkill(new AttackSkill("撲克牌槍", "運氣傷", LUCK, 2.0, 10, 2)); addSkill(new AttackSkill("化學炸彈", "爆炸", INT, 2.0, 0, 2)); }
+        if (type == "Thief") { addSkill(new AttackSkill("撲克牌槍", "運氣傷", LUCK, 2.0, 10, 2)); addSkill(new AttackSkill("化學炸彈", "全體爆炸", INT, 2.0, 0, 2, true)); }
         else if (type == "Sleep") { addSkill(new AttackSkill("過肩摔", "反擊", ATK, 1.5, 30, 2)); addSkill(new AttackSkill("沉睡推理", "爆發", INT, 2.5, 0, 4)); }
         else if (type == "Actress") { addSkill(new AttackSkill("易容術", "迷惑敵人", INT, 2.0, 10, 2)); addSkill(new AttackSkill("暗夜男爵夫人", "神秘攻擊", LUCK, 2.5, 0, 3)); }
     }
+    Character* clone() const override { return new Trickster(*this); }
     void beatMonster(int exp) override { this->exp += exp; while (this->exp >= pow(this->level, 2) * 100) levelUp(80, 6, 8, 15); }
-    string getQuote(string action) override {
-        if (name == "怪盜基德") {
-            if (action == "ATTACK") return "這不過是魔術罷了。";
-            if (action == "SKILL") return "Ladies and Gentlemen!";
-            if (action == "WIN") return "再會了，名偵探。";
-        } else if (name == "毛利小五郎") {
-            if (action == "ATTACK") return "看我的柔道！";
-            if (action == "SKILL") return "呼... (沉睡)";
-            if (action == "WIN") return "哈哈哈哈！真不愧是我！";
-        } else if (name == "工藤有希子") {
-            if (action == "ATTACK") return "哼哼，被騙到了吧？";
-            if (action == "SKILL") return "好戲上場囉！";
-            if (action == "WIN") return "這可是好萊塢級的演技！";
-        }
-        return "";
+};
+
+// ==========================================
+// 台詞表 (Quotes)
+// ==========================================
+
+const int CHARACTER_COUNT = 14; // 柯南 + 13 名可招募 NPC (編號同 createCharacter)
+// 台詞資料：角色編號、時機、權重、台詞 (同一格可有多句，依權重抽選)
+struct QuoteEntry { int character; QuoteAction action; int weight; StrRef text; };
+const QuoteEntry QUOTES[] = {
+    {0, QUOTE_ATTACK, 1, "可惡... 看招！"}, {0, QUOTE_SKILL, 1, "這招如何？"},
+    {0, QUOTE_WIN, 3, "真相只有一個！"}, {0, QUOTE_WIN, 1, "這下案子就解決了。"},
+    {1, QUOTE_ATTACK, 1, "哈啊——！"}, {1, QUOTE_SKILL, 1, "我不會輸的！"}, {1, QUOTE_WIN, 1, "大家沒事吧？"},
+    {2, QUOTE_ATTACK, 1, "看劍！"}, {2, QUOTE_SKILL, 1, "工藤，要上了！"}, {2, QUOTE_WIN, 1, "這就是大阪偵探的實力！"},
+    {3, QUOTE_ATTACK, 1, "喝！"}, {3, QUOTE_SKILL, 1, "為了園子小姐！"}, {3, QUOTE_WIN, 1, "修練還不夠..."},
+    {4, QUOTE_ATTACK, 1, "哼。"}, {4, QUOTE_SKILL, 1, "墮落吧..."}, {4, QUOTE_WIN, 1, "Target clear."},
+    {5, QUOTE_ATTACK, 1, "不會讓你逃掉的。"}, {5, QUOTE_SKILL, 1, "我的戀人是這個國家！"}, {5, QUOTE_WIN, 1, "任務完成。"},
+    {6, QUOTE_ATTACK, 1, "看招！"}, {6, QUOTE_SKILL, 1, "不准碰平次！"}, {6, QUOTE_WIN, 1, "平次，我也很強吧！"},
+    {7, QUOTE_ATTACK, 1, "讓開。"}, {7, QUOTE_SKILL, 1, "真是拿你們沒辦法..."}, {7, QUOTE_WIN, 1, "結束了呢。"},
+    {8, QUOTE_ATTACK, 1, "我也來戰鬥！"}, {8, QUOTE_SKILL, 1, "試試我的新發明！"}, {8, QUOTE_WIN, 1, "發明大成功！"},
+    {9, QUOTE_ATTACK, 1, "走開啦！"}, {9, QUOTE_SKILL, 1, "這可是鈴木財團的力量！"}, {9, QUOTE_WIN, 1, "阿真，我贏了！"},
+    {10, QUOTE_ATTACK, 1, "還不賴。"}, {10, QUOTE_SKILL, 1, "原來如此..."}, {10, QUOTE_WIN, 1, "一切都在預料之中。"},
+    {11, QUOTE_ATTACK, 1, "這不過是魔術罷了。"}, {11, QUOTE_SKILL, 1, "Ladies and Gentlemen!"},
+    {11, QUOTE_WIN, 2, "再會了，名偵探。"}, {11, QUOTE_WIN, 1, "今晚的月色真美呢。"},
+    {12, QUOTE_ATTACK, 1, "看我的柔道！"}, {12, QUOTE_SKILL, 1, "呼... (沉睡)"}, {12, QUOTE_WIN, 1, "哈哈哈哈！真不愧是我！"},
+    {13, QUOTE_ATTACK, 1, "哼哼，被騙到了吧？"}, {13, QUOTE_SKILL, 1, "好戲上場囉！"}, {13, QUOTE_WIN, 1, "這可是好萊塢級的演技！"},
+};
+
+// 台詞索引：每格 (角色編號 × 時機) 記錄其台詞在排序後陣列中的範圍與總權重，查詢只需一次陣列索引
+class QuoteTable {
+    struct Slot { int first, count, totalWeight; };
+    Slot slots[CHARACTER_COUNT * QUOTE_ACTIONS];
+    vector<QuoteEntry> entries; // 依格子排序
+public:
+    QuoteTable() {
+        for (auto& s : slots) s = {0, 0, 0};
+        for (const auto& q : QUOTES) entries.push_back(q);
+        stable_sort(entries.begin(), entries.end(), [](const QuoteEntry& a, const QuoteEntry& b) {
+            return a.character * QUOTE_ACTIONS + a.action < b.character * QUOTE_ACTIONS + b.action;
+        });
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Slot& s = slots[entries[i].character * QUOTE_ACTIONS + entries[i].action];
+            if (s.count++ == 0) s.first = i;
+            s.totalWeight += entries[i].weight;
+        }
+    }
+    // 單句的格子不耗用亂數；多句時依權重抽選 (每格只有幾句，線性累加即可)
+    StrRef pick(int character, QuoteAction action) const {
+        if (character < 0 || character >= CHARACTER_COUNT) return StrRef();
+        const Slot& s = slots[character * QUOTE_ACTIONS + action];
+        if (s.count <= 1) return s.count ? entries[s.first].text : StrRef();
+        int r = getRandom(1, s.totalWeight);
+        int i = s.first;
+        while ((r -= entries[i].weight) > 0) ++i;
+        return entries[i].text;
     }
 };
+const QuoteTable QUOTE_TABLE;
+// 查詢實作
+StrRef Character::getQuote(QuoteAction action) const { return QUOTE_TABLE.pick(charId, action); }
 
 // ==========================================
 // 劇情系統 (Story)
@@ -510,6 +2578,7 @@ public:
 namespace Story {
     void triggerChapter0() {
         gState.chapter = 0;
+        Bus::chapter(0);
         printMessage("\n=== 序章：警視廳的暗流 ===", "", 30, Color::YELLOW);
         printMessage("雨夜的東京，警視廳大樓燈火通明。", "", 30, Color::CYAN);
         wait(1000);
@@ -523,6 +2592,7 @@ namespace Story {
 
     void triggerChapter1() {
         gState.chapter = 1;
+        Bus::chapter(1);
         printMessage("\n=== 第一章：鈴木財團的邀請函 ===", "", 30, Color::YELLOW);
         printMessage("噹噹！這就是前往太平洋中心「五稜星」的特邀嘉賓證！", "鈴木園子");
         printMessage("如果那個傳聞是真的，黑衣組織絕對不會放過這個機會。", "柯南");
@@ -533,6 +2603,7 @@ namespace Story {
 
     void triggerChapter2() {
         gState.chapter = 2;
+        Bus::chapter(2);
         printMessage("\n=== 第二章：駛向太平洋 ===", "", 30, Color::YELLOW);
         printMessage("載著柯南一行人的船隻，正劃破太平洋的波浪。", "", 30, Color::CYAN);
         wait(1000);
@@ -545,6 +2616,7 @@ namespace Story {
 
     void triggerChapter3() {
         gState.chapter = 3;
+        Bus::chapter(3);
         printMessage("\n=== 第三章：諾亞方舟的凝視 ===", "", 30, Color::YELLOW);
         printMessage("進入設施內部，巨大的全息投影螢幕占據了整個牆面。", "", 30, Color::CYAN);
         printMessage("偵測到訪客。開始進行身分驗證。", "諾亞方舟");
@@ -556,6 +2628,7 @@ namespace Story {
 
     void triggerChapter4() {
         gState.chapter = 4;
+        Bus::chapter(4);
         printMessage("\n=== 第四章：黑衣的入侵者 ===", "", 30, Color::YELLOW);
         printMessage("基爾，內部情況如何？", "琴酒");
         printMessage("我已經將「後門」程式植入了維修系統。", "基爾");
@@ -567,6 +2640,7 @@ namespace Story {
 
     void triggerChapter5() {
         gState.chapter = 5;
+        Bus::chapter(5);
         printMessage("\n=== 第五章：伺服器過熱 ===", "", 30, Color::YELLOW);
         printMessage("C區冷卻水管破裂！伺服器溫度急劇升高！", "技術員");
         printMessage("灰原！妳那邊能看到系統狀況嗎？", "柯南");
@@ -579,6 +2653,7 @@ namespace Story {
 
     void triggerChapter6() {
         gState.chapter = 6;
+        Bus::chapter(6);
         printMessage("\n=== 第六章：伺服器攻防戰 ===", "", 30, Color::YELLOW);
         printMessage("哎呀，小偵探，你來得太晚了。", "苦艾酒");
         printMessage("苦艾酒！妳果然混進來了。", "柯南");
@@ -590,6 +2665,7 @@ namespace Story {
 
     void triggerChapter7() {
         gState.chapter = 7;
+        Bus::chapter(7);
         printMessage("\n=== 第七章：深海的逆轉 ===", "", 30, Color::YELLOW);
         printMessage("魚雷來了！把冷卻系統切換到「緊急排放」模式！", "柯南");
         printMessage("但是那樣會把海水全部灌進機房...", "阿笠博士");
@@ -602,6 +2678,7 @@ namespace Story {
 
     void triggerChapter8() {
         gState.chapter = 8;
+        Bus::chapter(8);
         printMessage("\n=== 終章：黎明前的五稜星 ===", "", 50, Color::YELLOW);
         printMessage("琴酒的潛艇在被國際刑警包圍前，強行切斷系統控制逃逸了。", "", 30, Color::CYAN);
         wait(1000);
@@ -627,6 +2704,7 @@ namespace Story {
 
 // 怪物類型列舉
 enum MonsterType { NORMAL, ELITE, BOSS }; // 普通、精英、頭目
+const char* const MONSTER_TYPE_NAMES[] = {"NORMAL", "ELITE", "BOSS"};
 
 // 怪物類別
 class Monster {
@@ -635,66 +2713,246 @@ public:
     string name;
     int hp, maxHp, attack, moneyDrop;
     MonsterType type;
+    int speed; // 行動速度 (時間軸用)
     // 建構子
-    Monster(string n, int h, int a, MonsterType t, int money) : name(n), hp(h), maxHp(h), attack(a), type(t), moneyDrop(money) {}
+    Monster(string n, int h, int a, MonsterType t, int money, int spd = 0) : name(move(n)), hp(h), maxHp(h), attack(a), type(t), moneyDrop(money), speed(spd) {}
     // 存取函式
     void print() {
+        if (headless) return;
         string color = (type == BOSS) ? Color::RED : (type == ELITE ? Color::MAGENTA : Color::RESET);
         cout << Color::BOLD << "敵人遭遇: " << color << name << Color::RESET 
              << " (HP: " << hp << "/" << maxHp << ", ATK: " << attack << ")\n";
     }
-    int getHP() { return hp; }
+    int getHP() const { return hp; }
     // 狀態修改函式
     void setHP(int newHP) { hp = newHP; if(hp < 0) hp = 0;}
 };
 
-// 生成怪物函式
-Monster generateMonster(const vector<Character*>& team) {
-    // 計算隊伍平均戰力
-    int totalPwr = 0;
-    for (auto c : team) totalPwr += c->getAttack() + c->getHP()/10;
-    int avgStr = totalPwr / team.size();
-    double envMod = currentLocation.enemyStatMod;
-    // 基礎屬性計算
-    int baseHP = (100 + (avgStr * 4)) * envMod;
-    int baseAtk = (15 + (avgStr / 3)) * envMod;
-    int baseMoney = 50 * currentLocation.moneyDropMod; 
-    // BOSS 生成邏輯
-    // Ch3: 基爾 (Kir)
-    if (getRandom(1, 100) <= 80 && currentLocation.id == 3 && !gState.boss_Kir) { 
-        return Monster("基爾 (Kir)", baseHP*2.5, baseAtk*1.3, BOSS, baseMoney*3);
+// 敵方隊伍：一般戰鬥為一隻，突襲戰為一整波；以目標索引支援 O(log n) 選擇目標
+class EnemyGroup {
+    vector<Monster> monsters;
+    TargetIndex index;
+public:
+    // 存取函式
+    size_t size() const { return monsters.size(); }
+    Monster& operator[](size_t i) { return monsters[i]; }
+    const Monster& operator[](size_t i) const { return monsters[i]; }
+    int aliveCount() const { return index.aliveCount(); }
+    bool wiped() const { return index.aliveCount() == 0; }
+    int pick(TargetPolicy policy) const { return index.pick(policy); }
+    // 預先配置 n 隻的空間 (一波敵人一次配置)
+    explicit EnemyGroup(size_t n = 0) : index(n) { monsters.reserve(n); }
+    // 狀態修改函式 (直接修改怪物屬性後需呼叫 refresh)
+    void add(Monster m) { monsters.push_back(move(m)); index.resize(monsters.size()); refresh(monsters.size() - 1); }
+    void refresh(size_t i) { index.set(i, monsters[i].hp, monsters[i].attack, monsters[i].hp > 0); }
+    void damage(size_t i, int amount) { monsters[i].setHP(monsters[i].hp - amount); refresh(i); }
+    int damageAll(int amount);
+};
+// 全體傷害：一次走訪套用，最後 O(n) 重建索引；回傳擊倒數
+int EnemyGroup::damageAll(int amount) {
+    int kills = 0;
+    for (size_t i = 0; i < monsters.size(); ++i) {
+        Monster& m = monsters[i];
+        if (m.hp <= 0) continue;
+        m.setHP(m.hp - amount);
+        if (m.hp <= 0) kills++;
+        index.stage(i, m.hp, m.attack, m.hp > 0);
+    }
+    index.rebuild();
+    return kills;
+}
+// 公式的 target.* 變數：戰鬥迴圈鎖定的目標 (施放前以 aimAt 解析成指標)，否則為 HP 最低的存活敵人
+void Formula::aimAt(int target) { aim = (foes && target >= 0 && target < (int)foes->size()) ? &(*foes)[target] : nullptr; }
+namespace Formula {
+    NO_INLINE const Monster* lowestFoe() { return (!foes || foes->wiped()) ? nullptr : &(*foes)[foes->pick(TARGET_LOWEST_HP)]; }
+}
+// 內聯到直接計算與直譯迴圈：已鎖定的目標只需讀一個指標
+FORCE_INLINE double Formula::targetStat(Var v) {
+    const Monster* m = aim;
+    if (!m || m->hp <= 0) m = lowestFoe();
+    if (!m) return 0;
+    switch (v) {
+        case TARGET_HP: return m->hp;
+        case TARGET_MAXHP: return m->maxHp;
+        case TARGET_HPR: return m->maxHp > 0 ? (double)m->hp / m->maxHp : 0;
+        case TARGET_ATK: return m->attack;
+        case TARGET_SPEED: return m->speed;
+        default: return 0;
+    }
+}
+
+// ==========================================
+// 遭遇表 (Encounter Tables)
+// ==========================================
+
+// BOSS 出現設定：同一地點若有多名 BOSS，依序判定 (與逐一擲骰的機率相同)
+struct BossSpec {
+    // 出現地點、名稱、出現率(%)、HP倍率、ATK倍率、金錢倍率、擊敗旗標 (nullptr 表示不檢查)
+    int locationId;
+    string name;
+    int spawnRate;
+    double hpMul, atkMul;
+    int moneyMul;
+    bool GameState::* defeated;
+};
+const vector<BossSpec> BOSSES = {
+    {3, "基爾 (Kir)", 80, 2.5, 1.3, 3, &GameState::boss_Kir},
+    {4, "苦艾酒 (Vermouth)", 75, 3.0, 1.5, 5, &GameState::boss_Vermouth},
+    {5, "伏特加 (Vodka)", 70, 3.5, 1.6, 5, &GameState::boss_Vodka},
+    {6, "琴酒 (Gin)", 70, 4.5, 2.0, 10, nullptr} // 最終BOSS
+};
+// 小怪與菁英名單 (非 BOSS 遭遇中 20% 為菁英)
+const vector<string> ELITE_NAMES = {"組織菁英狙擊手", "重裝蛙人隊長", "駭客首領"};
+const vector<string> NORMAL_NAMES = { "組織外圍成員", "被駭入的保全機器人", "武裝蛙人", "不明潛入者" };
+const int ELITE_RATE = 20;
+
+// 遭遇表欄位：怪物種類與相對基礎屬性的倍率
+struct EncounterEntry {
+    string name;
+    MonsterType type;
+    double hpMul, atkMul;
+    int moneyMul;
+};
+// 依隊伍戰力換算後的怪物屬性
+struct EncounterStats { int hp, atk, money, speed; };
+
+// 單一地點的遭遇表：建表一次，之後每次生成只需抽樣與查表
+class EncounterTable {
+    vector<EncounterEntry> entries;
+    AliasTable picker;
+    AliasTable minionPicker;     // 只含小怪與菁英 (突襲戰的隨從)
+    vector<int> minionEntries;   // 隨從抽樣欄位 → entries 編號
+    double envMod = 1.0, moneyMod = 1.0;
+    unordered_map<int, vector<EncounterStats>> statsCache; // 以隊伍平均戰力分桶快取
+    static const size_t STATS_CACHE_LIMIT = 256;           // 快取上限 (超過時整個清空，回傳的參照只在下次查表前有效)
+public:
+    bool built = false;
+    void build(const Location& loc, const GameState& state, const vector<BossSpec>& bosses = BOSSES);
+    const vector<EncounterStats>& statsFor(int avgStr);
+    Monster spawn(int avgStr);
+    Monster spawnMinion(int avgStr);
+    // BOSS 固定排在表首 (難度調校用來單獨測試 BOSS 戰)
+    bool hasBoss() const { return !entries.empty() && entries[0].type == BOSS; }
+    Monster spawnBoss(int avgStr);
+};
+// 建表實作
+void EncounterTable::build(const Location& loc, const GameState& state, const vector<BossSpec>& bosses) {
+    Memory::Scope tag(Memory::MONSTERS);
+    entries.clear(); statsCache.clear(); minionEntries.clear();
+    envMod = loc.enemyStatMod; moneyMod = loc.moneyDropMod;
+    vector<double> weights;
+    double remain = 1.0; // 尚未被 BOSS 判定吃掉的機率
+    for (const auto& b : bosses) {
+        if (b.locationId != loc.id || (b.defeated && state.*b.defeated)) continue;
+        entries.push_back({b.name, BOSS, b.hpMul, b.atkMul, b.moneyMul});
+        weights.push_back(remain * b.spawnRate / 100.0);
+        remain *= 1.0 - b.spawnRate / 100.0;
+    }
+    for (const auto& n : ELITE_NAMES) {
+        entries.push_back({n, ELITE, 1.6, 1.3, 2});
+        weights.push_back(remain * ELITE_RATE / 100.0 / ELITE_NAMES.size());
     }
-    // Ch4: 苦艾酒 (Vermouth)
-    if (getRandom(1, 100) <= 75 && currentLocation.id == 4 && !gState.boss_Vermouth) { 
-        return Monster("苦艾酒 (Vermouth)", baseHP*3.0, baseAtk*1.5, BOSS, baseMoney*5);
+    for (const auto& n : NORMAL_NAMES) {
+        entries.push_back({n, NORMAL, 1.0, 1.0, 1});
+        weights.push_back(remain * (100 - ELITE_RATE) / 100.0 / NORMAL_NAMES.size());
     }
-    // Ch5: 伏特加 (Vodka)
-    if (getRandom(1, 100) <= 70 && currentLocation.id == 5 && !gState.boss_Vodka) { 
-        return Monster("伏特加 (Vodka)", baseHP*3.5, baseAtk*1.6, BOSS, baseMoney*5);
+    picker.build(weights);
+    vector<double> minionWeights;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].type == BOSS) continue;
+        minionEntries.push_back(i);
+        minionWeights.push_back(weights[i]);
     }
-    // Ch6: 琴酒 (Gin) - 最終BOSS
-    if (getRandom(1, 100) <= 70 && currentLocation.id == 6) { 
-        return Monster("琴酒 (Gin)", baseHP*4.5, baseAtk*2.0, BOSS, baseMoney*10);
+    minionPicker.build(minionWeights);
+    built = true;
+}
+const size_t EncounterTable::STATS_CACHE_LIMIT;
+// 屬性查表實作 (同一戰力只計算一次)
+const vector<EncounterStats>& EncounterTable::statsFor(int avgStr) {
+    Memory::Scope tag(Memory::MONSTERS);
+    auto it = statsCache.find(avgStr);
+    if (it != statsCache.end()) return it->second;
+    if (statsCache.size() >= STATS_CACHE_LIMIT) statsCache.clear();
+    // 基礎屬性計算 (與逐次計算的取整方式相同)
+    int baseHP = (100 + (avgStr * 4)) * envMod;
+    int baseAtk = (15 + (avgStr / 3)) * envMod;
+    int baseMoney = 50 * moneyMod;
+    vector<EncounterStats>& stats = statsCache[avgStr];
+    // 速度隨隊伍戰力成長，菁英與 BOSS 較快
+    for (const auto& e : entries) {
+        int speed = avgStr / 4 + (e.type == BOSS ? 20 : (e.type == ELITE ? 10 : 0));
+        stats.push_back({(int)(baseHP * e.hpMul), (int)(baseAtk * e.atkMul), baseMoney * e.moneyMul, speed});
     }
+    return stats;
+}
+// 生成實作
+Monster EncounterTable::spawn(int avgStr) {
+    Memory::Scope tag(Memory::MONSTERS);
+    const vector<EncounterStats>& stats = statsFor(avgStr);
+    int idx = picker.sample();
+    return Monster(entries[idx].name, stats[idx].hp, stats[idx].atk, entries[idx].type, stats[idx].money, stats[idx].speed);
+}
+// 隨從生成實作
+Monster EncounterTable::spawnMinion(int avgStr) {
+    Memory::Scope tag(Memory::MONSTERS);
+    const vector<EncounterStats>& stats = statsFor(avgStr);
+    int idx = minionEntries[minionPicker.sample()];
+    return Monster(entries[idx].name, stats[idx].hp, stats[idx].atk, entries[idx].type, stats[idx].money, stats[idx].speed);
+}
+// BOSS 生成實作 (呼叫前需確認 hasBoss)
+Monster EncounterTable::spawnBoss(int avgStr) {
+    Memory::Scope tag(Memory::MONSTERS);
+    const EncounterStats& st = statsFor(avgStr)[0];
+    return Monster(entries[0].name, st.hp, st.atk, BOSS, st.money, st.speed);
+}
 
-    // 小怪與菁英生成
-    int roll = getRandom(1, 100);
-    if (roll > 80) { // 20% 機率遭遇菁英
-        vector<string> elites = {"組織菁英狙擊手", "重裝蛙人隊長", "駭客首領"};
-        string name = elites[getRandom(0, elites.size() - 1)];
-        return Monster(name, baseHP*1.6, baseAtk*1.3, ELITE, baseMoney*2);
+// 遭遇表管理：章節或 BOSS 進度改變才重建，換地點只切換使用的表
+class EncounterDirector {
+    vector<EncounterTable> tables; // 依地點編號索引
+    int builtChapter = -1;
+    int builtBossMask = -1;
+public:
+    EncounterTable& tableFor(const Location& loc) {
+        int mask = 0;
+        for (size_t i = 0; i < BOSSES.size(); ++i) if (BOSSES[i].defeated && gState.*BOSSES[i].defeated) mask |= 1 << i;
+        if (gState.chapter != builtChapter || mask != builtBossMask || tables.size() != LOCATIONS.size()) {
+            tables.assign(LOCATIONS.size(), EncounterTable());
+            builtChapter = gState.chapter; builtBossMask = mask;
+        }
+        EncounterTable& t = tables[loc.id];
+        if (!t.built) t.build(LOCATIONS[loc.id], gState);
+        return t;
     }
-    
-    vector<string> normals = { "組織外圍成員", "被駭入的保全機器人", "武裝蛙人", "不明潛入者" };
-    return Monster(normals[getRandom(0, normals.size()-1)], baseHP, baseAtk, NORMAL, baseMoney);
+};
+thread_local EncounterDirector encounters; // 依各執行緒自己的進度建表
+
+// 生成怪物函式
+Monster generateMonster(const Party& team) {
+    // 隊伍平均戰力由 Party 增量維護
+    return encounters.tableFor(currentLocation).spawn(team.averagePower());
+}
+
+// 生成一波敵人：首隻依一般規則 (可能是 BOSS)，其餘為小怪與菁英
+EnemyGroup generateWave(const Party& team, int count) {
+    Memory::Scope tag(Memory::MONSTERS);
+    EnemyGroup wave(count);
+    wave.add(generateMonster(team));
+    EncounterTable& table = encounters.tableFor(currentLocation);
+    for (int i = 1; i < count; ++i) wave.add(table.spawnMinion(team.averagePower()));
+    return wave;
 }
 
 // 顯示戰鬥狀態函式
-void printBattleStatus(const vector<Character*>& team, Monster* monster) {
+void printBattleStatus(const Party& team, const EnemyGroup& enemies) {
+    if (headless) return;
     cout << Color::WHITE << "\n══════════════════════════════════════════════════" << Color::RESET << endl;
-    string mColor = (monster->type == BOSS) ? Color::RED : Color::MAGENTA;
-    cout << "【敵方】 " << mColor << Color::BOLD << monster->name << Color::RESET << "\n";
-    cout << "  HP: " << monster->getHP() << "/" << monster->maxHp << " (ATK: " << monster->attack << ")\n";
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        const Monster& monster = enemies[i];
+        string mColor = (monster.type == BOSS) ? Color::RED : Color::MAGENTA;
+        if (monster.getHP() <= 0) { cout << "【敵方】 " << Color::GRAY << monster.name << " (已擊倒)" << Color::RESET << "\n"; continue; }
+        cout << "【敵方】 " << mColor << Color::BOLD << monster.name << Color::RESET << "\n";
+        cout << "  HP: " << monster.getHP() << "/" << monster.maxHp << " (ATK: " << monster.attack << ")\n";
+    }
     cout << "\n【我方】\n";
     for(auto* c : team) {
          if (c->getHP() <= 0) cout << "  " << Color::GRAY << c->getName() << " (無法戰鬥)" << Color::RESET << "\n";
@@ -708,22 +2966,21 @@ void printBattleStatus(const vector<Character*>& team, Monster* monster) {
 // ==========================================
 
 // 前向宣告
-void openMenu(vector<Character*>& team, vector<Character*>& reserve);
-bool useItemMenu(vector<Character*>& team);
+void openMenu(Party& team, vector<Character*>& reserve);
+bool useItemMenu(Party& team);
 void openShop();
 
 // 重新開始遊戲 (初始化所有狀態)
-void resetGame(vector<Character*>& team, vector<Character*>& reserve) {
+void resetGame(Party& team, vector<Character*>& reserve) {
     printMessage("\n系統啟動中...", "", 50, Color::BLUE);
 
     // 清空角色
-    for(auto* c : team) delete c;
+    for(auto* c : team.release()) delete c;
     for(auto* c : reserve) delete c;
-    team.clear();
     reserve.clear();
 
     // 重置全域狀態
-    gState = {0, 200, 0, false, false, false};
+    gState = freshState(200);
     currentLocation = LOCATIONS[1];
     inventory.clear();
     
@@ -734,11 +2991,23 @@ void resetGame(vector<Character*>& team, vector<Character*>& reserve) {
     shopItems.push_back(new RestoreItem("阿笠博士特製藥", 500, "恢復 200 HP", 200));
     shopItems.push_back(new RestoreItem("波羅麵包", 100, "恢復 50 HP", 50));
     shopItems.push_back(new ReviveItem("急救箱", 600, "復活並恢復 50% HP"));
+    // 秘笈：新技能附帶狀態效果 (暈眩、減益、中毒、全隊增益)
+    shopItems.push_back(new SkillBookItem("麻醉針秘笈", 1500, "學會麻醉針: 暈眩 1 回合並降低攻擊 20%",
+        (new AttackSkill("麻醉針", "麻醉並削弱敵人", INT, 1.0, 10, 4))->addEffect(EFFECT_STUN, 0, 1)->addEffect(EFFECT_DEBUFF, 20, 2)));
+    shopItems.push_back(new SkillBookItem("毒霧配方", 1500, "學會毒霧: 全體中毒，每回合 10 點持續 3 回合",
+        (new AttackSkill("毒霧", "全體中毒", INT, 0.8, 0, 3, true))->addEffect(EFFECT_POISON, 10, 3)));
+    shopItems.push_back(new SkillBookItem("鼓舞之書", 1200, "學會鼓舞: 全隊攻擊 +10 持續 2 回合",
+        (new AttackSkill("鼓舞", "一擊並鼓舞全隊", LUCK, 1.0, 10, 3))->addEffect(EFFECT_BUFF, 10, 2)));
+    // 以公式描述的秘笈技能 (算式見 README 的技能公式一節)
+    shopItems.push_back(new SkillBookItem("斬鐵劍譜", 1800, "學會斬鐵: 對 HP 低於 30% 的敵人更痛，可能暈眩",
+        (new FormulaSkill("斬鐵", "對重傷敵人更痛", FORMULA_DAMAGE, "user.atk * (target.hpr < 0.3 ? 3.2 : 2.3)", 3, "chance(20 + user.luck / 2)"))->addEffect(EFFECT_STUN, 0, 1)));
+    shopItems.push_back(new SkillBookItem("急救講義", 1500, "學會急救: 全隊治療，隊友危急時加量",
+        new FormulaSkill("急救", "全隊治療", FORMULA_HEAL, "40 + user.int * 1.5 + 20 * party.low", 3)));
 
     // 重新建立主角與隊友
     
     printMessage("\n系統正在載入使用者資料...\n", "", 20, Color::BLUE);
-    team.push_back(new Gadgeteer("江戶川柯南", 1));
+    team.add(createCharacter(0, 1));
     wait(500);
 
     printMessage("正在隨機連線隊友...\n", "", 20, Color::BLUE);
@@ -748,7 +3017,7 @@ void resetGame(vector<Character*>& team, vector<Character*>& reserve) {
         bool exists = false;
         for(auto* m : team) if(m->getName() == npc->getName()) exists = true;
         if(exists) { delete npc; i--; } 
-        else { team.push_back(npc); printMessage(">>> " + npc->getName() + " 加入了隊伍！", "", 20, Color::GREEN); }
+        else { team.add(npc); printMessage(">>> " + npc->getName() + " 加入了隊伍！", "", 20, Color::GREEN); }
     }
 
     // 初始道具
@@ -759,245 +3028,1113 @@ void resetGame(vector<Character*>& team, vector<Character*>& reserve) {
     wait(1000);
 }
 
-// 隨機事件
-void triggerRandomEvent(vector<Character*>& team, vector<Character*>& reserve) {
-    if (getRandom(1, 100) > 60) return;
-    
-    // 可觸發事件列表
-    vector<string> events;
-    if(currentLocation.id > 1) events.push_back("SHARK");
-    if(currentLocation.id > 1) events.push_back("SYSTEM_ERROR");
-    if(currentLocation.id > 0) events.push_back("LUNCH");
-    if(currentLocation.id > 0) events.push_back("RAN_KARATE");
-    if(currentLocation.id > 0) events.push_back("AGASA_QUIZ");
-    if(events.empty()) return;
-
-    printMessage("\n[隨機事件]", "", 0, Color::MAGENTA);
-    string type = events[getRandom(0, events.size()-1)];
-
-    if (type == "SHARK") {
-        printMessage("透過玻璃窗看到巨大的鯊魚游過...", "");
-    } else if (type == "SYSTEM_ERROR") {
-        printMessage("系統出現短暫的雜訊...", "諾亞方舟");
-        printMessage("別擔心，只是防火牆攔截了一次攻擊。", "諾亞方舟");
-    } else if (type == "LUNCH") {
-        printMessage("元太肚子餓了，吵著要吃鰻魚飯...", "");
-        gState.playerMoney -= 30; if(gState.playerMoney < 0) gState.playerMoney = 0;
-        printMessage("只好花錢買點東西吃 (金錢-30)", "", 20, Color::RED);
-    } else if (type == "RAN_KARATE") {
-        printMessage("有人想偷襲！哈啊——！", "毛利蘭");
-        printMessage("小蘭一腳踢飛了可疑的無人機。", "");
-        gState.playerClues++;
-        printMessage("從殘骸中發現了晶片 (線索+1)", "", 20, Color::GREEN);
-    } else if (type == "AGASA_QUIZ") {
-        printMessage("現在是博士的猜謎時間！", "阿笠博士");
-        printMessage("答對了！獎勵大家恢復體力！(全員HP+50)", "", 20, Color::GREEN);
-        for(auto* c : team) if(c->getHP() > 0) c->setHP(c->getHP() + 50);
+// ==========================================
+// 隨機事件系統 (Random Events)
+// ==========================================
+
+// 事件執行環境
+struct EventContext {
+    Party& team;
+    vector<Character*>& reserve;
+};
+// 事件紀錄：地點資格、權重、劇情文字、狀態效果
+struct RandomEvent {
+    string id;
+    int weight;
+    function<bool(const Location&)> eligible; // 只依地點判定，建表時預先計算
+    function<void()> narrate;                 // 劇情文字 (無頭模式不呼叫)
+    function<void(EventContext&)> apply;      // 對遊戲狀態的影響
+};
+
+// 事件登錄表：每個地點預先算好資格位元遮罩與加權抽樣表，觸發成本與事件總數無關
+class EventRegistry {
+    vector<RandomEvent> events;
+    vector<vector<uint64_t>> eligibleMask; // [地點][事件編號 / 64]
+    vector<AliasTable> pickers;            // 每個地點的加權抽樣表
+    vector<vector<int>> pickerEvents;      // 抽樣欄位 → 事件編號
+    bool dirty = true;
+    void rebuild();
+public:
+    void add(const RandomEvent& e) { events.push_back(e); dirty = true; }
+    void prepare() { if (dirty) rebuild(); } // 預先建表 (之後抽樣只讀，可多執行緒共用)
+    size_t size() const { return events.size(); }
+    bool isEligible(int locId, int eventIdx) {
+        if (dirty) rebuild();
+        return (eligibleMask[locId][eventIdx / 64] >> (eventIdx % 64)) & 1;
     }
-    wait(1000);
+    const RandomEvent* pick(int locId) {
+        if (dirty) rebuild();
+        if (pickers[locId].empty()) return nullptr;
+        return &events[pickerEvents[locId][pickers[locId].sample()]];
+    }
+};
+// 重建實作
+void EventRegistry::rebuild() {
+    size_t words = (events.size() + 63) / 64;
+    eligibleMask.assign(LOCATIONS.size(), vector<uint64_t>(words, 0));
+    pickers.assign(LOCATIONS.size(), AliasTable());
+    pickerEvents.assign(LOCATIONS.size(), vector<int>());
+    for (size_t loc = 0; loc < LOCATIONS.size(); ++loc) {
+        vector<double> weights;
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (events[i].weight <= 0 || !events[i].eligible(LOCATIONS[loc])) continue;
+            eligibleMask[loc][i / 64] |= 1ULL << (i % 64);
+            pickerEvents[loc].push_back(i);
+            weights.push_back(events[i].weight);
+        }
+        pickers[loc].build(weights);
+    }
+    dirty = false;
 }
 
-// 戰鬥函式
-void battle(vector<Character*>& team, Monster* monster) {
-    printMessage("=== 戰鬥開始 ===", "", 30, Color::RED);
-
-    // 戰鬥前劇情
-    if (monster->name == "基爾 (Kir)") printMessage("對不起了，我不能在這裡暴露身分...", "基爾");
-    else if (monster->name == "苦艾酒 (Vermouth)") printMessage("A secret makes a woman woman...", "苦艾酒");
-    else if (monster->name == "伏特加 (Vodka)") printMessage("老大說了，今天一定要拿下你們！", "伏特加");
-    else if (monster->name == "琴酒 (Gin)") printMessage("哼，一群老鼠。", "琴酒");
-
-    // 削弱機制
-    if (monster->type == BOSS && gState.playerClues >= 5) {
-            printMessage("利用掌握的情報，看穿了 " + monster->name + " 的破綻！", "", 20, Color::GREEN);
-            gState.playerClues -= 5;
-            monster->attack = (int)(monster->attack * 0.7);
-            monster->hp = (int)(monster->hp * 0.7);
-            monster->maxHp = monster->hp;
-    }
-    if (monster->type == ELITE && gState.playerClues >= 3) {
-            printMessage("利用掌握的情報，看穿了 " + monster->name + " 的破綻！", "", 20, Color::GREEN);
-            gState.playerClues -= 3;
-            monster->attack = (int)(monster->attack * 0.8);
-            monster->hp = (int)(monster->hp * 0.8);
-            monster->maxHp = monster->hp;
+// 內建事件 (建好抽樣表才交出，之後只讀)
+EventRegistry builtinEvents() {
+    EventRegistry reg;
+    reg.add({"SHARK", 1, [](const Location& l) { return l.id > 1; },
+        [] { printMessage("透過玻璃窗看到巨大的鯊魚游過...", ""); },
+        [](EventContext&) {}});
+    reg.add({"SYSTEM_ERROR", 1, [](const Location& l) { return l.id > 1; },
+        [] {
+            printMessage("系統出現短暫的雜訊...", "諾亞方舟");
+            printMessage("別擔心，只是防火牆攔截了一次攻擊。", "諾亞方舟");
+        },
+        [](EventContext&) {}});
+    reg.add({"LUNCH", 1, [](const Location& l) { return l.id > 0; },
+        [] {
+            printMessage("元太肚子餓了，吵著要吃鰻魚飯...", "");
+            printMessage("只好花錢買點東西吃 (金錢-30)", "", 20, Color::RED);
+        },
+        [](EventContext&) { gState.playerMoney -= 30; if(gState.playerMoney < 0) gState.playerMoney = 0; }});
+    reg.add({"RAN_KARATE", 1, [](const Location& l) { return l.id > 0; },
+        [] {
+            printMessage("有人想偷襲！哈啊——！", "毛利蘭");
+            printMessage("小蘭一腳踢飛了可疑的無人機。", "");
+            printMessage("從殘骸中發現了晶片 (線索+1)", "", 20, Color::GREEN);
+        },
+        [](EventContext&) { gState.playerClues++; }});
+    reg.add({"AGASA_QUIZ", 1, [](const Location& l) { return l.id > 0; },
+        [] {
+            printMessage("現在是博士的猜謎時間！", "阿笠博士");
+            printMessage("答對了！獎勵大家恢復體力！(全員HP+50)", "", 20, Color::GREEN);
+        },
+        [](EventContext& ctx) { for(int slot : ctx.team.aliveSlots()) ctx.team[slot]->setHP(ctx.team[slot]->getHP() + 50); }});
+    reg.prepare();
+    return reg;
+}
+// 內建事件登錄 (靜態區域變數的初始化在多執行緒下只執行一次)
+EventRegistry& randomEvents() {
+    static EventRegistry reg = builtinEvents();
+    return reg;
+}
+
+// 觸發一次隨機事件 (narrate = false 供無頭模擬使用)，回傳觸發的事件
+const RandomEvent* fireRandomEvent(EventContext& ctx, bool narrate) {
+    if (getRandom(1, 100) > 60) return nullptr;
+    const RandomEvent* ev = randomEvents().pick(currentLocation.id);
+    if (!ev) return nullptr;
+    if (narrate) {
+        printMessage("\n[隨機事件]", "", 0, Color::MAGENTA);
+        ev->narrate();
+    }
+    ev->apply(ctx);
+    return ev;
+}
+
+// 隨機事件
+void triggerRandomEvent(Party& team, vector<Character*>& reserve) {
+    EventContext ctx{team, reserve};
+    if (fireRandomEvent(ctx, true)) wait(1000);
+}
+
+// ==========================================
+// 狀態與冷卻引擎 (Status Engine)
+// ==========================================
+
+// 單場戰鬥的狀態效果：冷卻、增益、減益、中毒、暈眩、加速、減速的到期都排入時間輪
+class StatusEngine {
+public:
+    static const int TICK = 100;                                           // 時間輪一刻 = 時間軸 100 單位
+    static const int TICKS_PER_ROUND = (int)(Timeline::ROUND_TICKS / TICK); // 一回合的刻數
+private:
+    struct Effect {
+        EffectKind kind;
+        int actor;   // 作用對象 (時間軸編號：隊伍槽位，敵方接在其後)
+        int skill;   // 冷卻中的技能編號
+        int value;   // 實際套用量 (到期時撤銷)
+        int periods; // 中毒剩餘發作次數
+        long long due;   // 到期刻度
+        long long order; // 排入時間輪的順序 (-1 表示已結束)
+        Effect(EffectKind k, int a, int s, int v, int p, long long d = 0, long long o = 0)
+            : kind(k), actor(a), skill(s), value(v), periods(p), due(d), order(o) {}
+    };
+    Party& team;
+    EnemyGroup& enemies;
+    Timeline& timeline;
+    TimingWheel wheel;
+    vector<Effect> effects;
+    vector<int> freeIds;   // 可重複使用的效果編號
+    vector<int> stunCount; // 依時間軸編號
+    int partySize;
+    int active = 0;
+    long long scheduled = 0; // 排入次數 (同刻到期依此順序觸發)
+    friend struct BattleSnapshot;
+    void schedule(Effect& e, int id, long long due) { e.due = due; e.order = scheduled++; wheel.schedule(due, id); }
+    bool isParty(int actor) const { return actor < partySize; }
+    string nameOf(int actor) const { return isParty(actor) ? team[actor]->getName() : enemies[actor - partySize].name; }
+    bool aliveActor(int actor) const { return isParty(actor) ? team[actor]->getHP() > 0 : enemies[actor - partySize].getHP() > 0; }
+    void add(const Effect& e, int rounds);
+    void expire(int id);
+public:
+    StatusEngine(Party& t, EnemyGroup& e, Timeline& tl) : team(t), enemies(e), timeline(tl), stunCount(t.size() + e.size(), 0), partySize(t.size()) { effects.reserve(16); }
+    ~StatusEngine() { for (auto* c : team) c->clearBuff(); } // 戰鬥結束時撤銷剩餘增益
+    // 推進到時間軸時刻，只處理真正到期的效果
+    void advance(long long time) { wheel.advance(time / TICK, [this](int id) { expire(id); }); }
+    // 冷卻
+    void startCooldown(int slot, int skillIdx);
+    int cooldownLeft(const Skill* s) const { return max(0LL, (s->getReadyTick() - wheel.now() + TICKS_PER_ROUND - 1) / TICKS_PER_ROUND); }
+    // 套用技能附帶效果
+    void apply(const Skill* skill, int target);
+    // 查詢
+    bool isStunned(int actor) const { return stunCount[actor] > 0; }
+    int activeEffects() const { return active; }
+};
+const int StatusEngine::TICK;
+const int StatusEngine::TICKS_PER_ROUND;
+// 登錄效果並排入時間輪 (中毒每回合發作一次)
+void StatusEngine::add(const Effect& e, int rounds) {
+    int id;
+    if (freeIds.empty()) { id = effects.size(); effects.push_back(e); }
+    else { id = freeIds.back(); freeIds.pop_back(); effects[id] = e; }
+    active++;
+    schedule(effects[id], id, wheel.now() + (e.kind == EFFECT_POISON ? 1 : max(1, rounds)) * TICKS_PER_ROUND);
+}
+// 開始冷卻：技能位元已在施放時清除，到期時設回
+void StatusEngine::startCooldown(int slot, int skillIdx) {
+    Skill* s = team[slot]->getSkills()[skillIdx];
+    if (s->getMaxCD() <= 0) return;
+    s->setReadyTick(wheel.now() + s->getMaxCD() * TICKS_PER_ROUND);
+    add({EFFECT_COOLDOWN, slot, skillIdx, 0, 0}, s->getMaxCD());
+}
+// 套用實作：增益與加速作用於全體存活隊員，其餘作用於命中的敵人 (全體技能則為整波)
+void StatusEngine::apply(const Skill* skill, int target) {
+    for (const auto& spec : skill->getEffects()) {
+        if (spec.kind == EFFECT_BUFF || spec.kind == EFFECT_HASTE) {
+            for (int slot : team.aliveSlots()) {
+                if (spec.kind == EFFECT_BUFF) team[slot]->addBuff(spec.magnitude);
+                else timeline.adjustRate(slot, spec.magnitude);
+                add({spec.kind, slot, -1, spec.magnitude, 0}, spec.rounds);
+            }
+            printMessage(spec.kind == EFFECT_BUFF ? "全體隊員的攻擊力提升了！" : "全體隊員的行動加快了！", "", 20, Color::BLUE);
+            continue;
+        }
+        for (size_t i = 0; i < enemies.size(); ++i) {
+            if (enemies[i].getHP() <= 0 || (!skill->isAreaEffect() && (int)i != target)) continue;
+            int actor = partySize + i;
+            Monster& m = enemies[i];
+            if (spec.kind == EFFECT_DEBUFF) {
+                int cut = m.attack * spec.magnitude / 100;
+                m.attack -= cut;
+                enemies.refresh(i);
+                add({EFFECT_DEBUFF, actor, -1, cut, 0}, spec.rounds);
+                printMessage(m.name + " 的攻擊力下降了！", "", 20, Color::BLUE);
+            } else if (spec.kind == EFFECT_POISON) {
+                add({EFFECT_POISON, actor, -1, spec.magnitude, spec.rounds}, spec.rounds);
+                printMessage(m.name + " 中毒了！", "", 20, Color::BLUE);
+            } else if (spec.kind == EFFECT_STUN) {
+                stunCount[actor]++;
+                add({EFFECT_STUN, actor, -1, 0, 0}, spec.rounds);
+                printMessage(m.name + " 陷入暈眩！", "", 20, Color::BLUE);
+            } else if (spec.kind == EFFECT_SLOW) {
+                timeline.adjustRate(actor, -spec.magnitude);
+                add({EFFECT_SLOW, actor, -1, -spec.magnitude, 0}, spec.rounds);
+                printMessage(m.name + " 的行動變慢了！", "", 20, Color::BLUE);
+            }
+        }
+    }
+}
+// 到期實作：撤銷效果或讓中毒再次發作
+void StatusEngine::expire(int id) {
+    Effect& e = effects[id];
+    switch (e.kind) {
+        case EFFECT_COOLDOWN: team[e.actor]->markSkillReady(e.skill); break;
+        case EFFECT_BUFF: team[e.actor]->addBuff(-e.value); break;
+        case EFFECT_DEBUFF:
+            if (isParty(e.actor)) team[e.actor]->addBuff(e.value);
+            else { enemies[e.actor - partySize].attack += e.value; enemies.refresh(e.actor - partySize); }
+            break;
+        case EFFECT_STUN: stunCount[e.actor]--; break;
+        case EFFECT_HASTE:
+        case EFFECT_SLOW: timeline.adjustRate(e.actor, -e.value); break;
+        case EFFECT_POISON:
+            if (!aliveActor(e.actor)) break;
+            if (isParty(e.actor)) team[e.actor]->setHP(team[e.actor]->getHP() - e.value);
+            else enemies.damage(e.actor - partySize, e.value);
+            printMessage(nameOf(e.actor) + " 受到 " + to_string(e.value) + " 點毒素傷害！", "", 20, Color::MAGENTA);
+            if (--e.periods > 0 && aliveActor(e.actor)) {
+                schedule(e, id, wheel.now() + TICKS_PER_ROUND);
+                return;
+            }
+            break;
+    }
+    e.order = -1;
+    freeIds.push_back(id);
+    active--;
+}
+
+// 隊伍上限與突襲戰設定
+const int MAX_TEAM_SIZE = 6;  // 出戰人數上限
+const int RAID_WAVES = 3;     // 突襲戰波數
+const int RAID_MAX_WAVE = 8;  // 每波敵人上限
+
+// ==========================================
+// 戰鬥快照 (Battle Snapshot)
+// ==========================================
+
+// 戰鬥中會變動的狀態 (HP、增益、冷卻、怪物 HP/攻擊、時間軸、狀態效果、亂數流位置) 攤平成固定大小的值型別，
+// 複製一份就是一次分支；角色職業、技能與怪物名稱等不變內容留在 BattleBranch，由所有快照共用
+struct BattleSnapshot {
+    static const int MAX_ACTORS = MAX_TEAM_SIZE + RAID_MAX_WAVE;
+    static const int MAX_EFFECTS = 48;
+    struct Member { int32_t hp, buff; uint32_t readyMask; };
+    struct Foe { int32_t hp, attack; };
+    struct Actor { int32_t wait, seqBack; int16_t rate; int8_t active, queued; }; // 等待時間與排入順序皆相對於目前時刻
+    struct Effect { int32_t due, value; int8_t kind, actor, skill, periods; };   // 到期刻度相對於時間輪目前刻度
+    uint64_t rngSeed, rngCounter;
+    int64_t now, seq, wheelNow;
+    int8_t partySize, foeCount, effectCount;
+    int8_t aliveOrder[MAX_TEAM_SIZE]; // 存活名單順序 (影響全隊效果的套用順序)
+    Member members[MAX_TEAM_SIZE];
+    Foe foes[RAID_MAX_WAVE];
+    Actor actors[MAX_ACTORS];
+    Effect effects[MAX_EFFECTS];
+    // 擷取目前戰鬥狀態 (超出容量時回傳 false)
+    bool capture(const Party& team, const EnemyGroup& enemies, const Timeline& timeline, const StatusEngine& status, const RngStream& rng);
+    // 把狀態寫回一組戰鬥物件 (隊伍與敵人須與擷取時同一組成)
+    void restore(Party& team, EnemyGroup& enemies, Timeline& timeline, StatusEngine& status, RngStream& rng) const;
+    // 狀態雜湊 (FNV-1a，逐欄位計算不含填充位元組；合作模式用來偵測不同步)
+    uint64_t hash() const;
+};
+const int BattleSnapshot::MAX_ACTORS;
+const int BattleSnapshot::MAX_EFFECTS;
+// 擷取實作
+bool BattleSnapshot::capture(const Party& team, const EnemyGroup& enemies, const Timeline& timeline, const StatusEngine& status, const RngStream& rng) {
+    if (team.size() > (size_t)MAX_TEAM_SIZE || enemies.size() > (size_t)RAID_MAX_WAVE || status.active > MAX_EFFECTS) return false;
+    rngSeed = rng.seed; rngCounter = rng.counter;
+    now = timeline.now; seq = timeline.seqCounter; wheelNow = status.wheel.now();
+    partySize = team.size(); foeCount = enemies.size();
+    for (int i = 0; i < partySize; ++i) members[i] = {team[i]->getHP(), team[i]->getTempBuff(), team[i]->getReadyMask()};
+    for (int i = 0; i < team.aliveCount(); ++i) aliveOrder[i] = team.alive[i];
+    for (int i = 0; i < foeCount; ++i) foes[i] = {enemies[i].hp, enemies[i].attack};
+    for (int a = 0; a < partySize + foeCount; ++a) {
+        Actor& x = actors[a];
+        x = Actor();
+        if (a >= (int)timeline.slots.size()) continue;
+        const Timeline::Slot& s = timeline.slots[a];
+        x.wait = s.readyAt - now;
+        x.seqBack = seq - s.pendingSeq;
+        x.rate = s.rate;
+        x.active = s.active;
+        x.queued = s.queued;
+    }
+    // 依排入順序保存，還原後同刻到期的效果觸發順序不變
+    vector<int> ids;
+    for (size_t id = 0; id < status.effects.size(); ++id) if (status.effects[id].order >= 0) ids.push_back(id);
+    sort(ids.begin(), ids.end(), [&](int a, int b) { return status.effects[a].order < status.effects[b].order; });
+    effectCount = ids.size();
+    for (int k = 0; k < effectCount; ++k) {
+        const StatusEngine::Effect& e = status.effects[ids[k]];
+        effects[k] = {(int32_t)(e.due - wheelNow), e.value, (int8_t)e.kind, (int8_t)e.actor, (int8_t)e.skill, (int8_t)e.periods};
+    }
+    return true;
+}
+// 雜湊實作
+uint64_t BattleSnapshot::hash() const {
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](int64_t v) { for (int b = 0; b < 8; ++b) { h ^= (uint8_t)(v >> (b * 8)); h *= 1099511628211ULL; } };
+    mix(rngSeed); mix(rngCounter); mix(now); mix(seq); mix(wheelNow);
+    mix(partySize); mix(foeCount); mix(effectCount);
+    int alive = 0;
+    for (int i = 0; i < partySize; ++i) { mix(members[i].hp); mix(members[i].buff); mix(members[i].readyMask); alive += members[i].hp > 0; }
+    for (int i = 0; i < alive; ++i) mix(aliveOrder[i]);
+    for (int i = 0; i < foeCount; ++i) { mix(foes[i].hp); mix(foes[i].attack); }
+    for (int a = 0; a < partySize + foeCount; ++a) { const Actor& x = actors[a]; mix(x.wait); mix(x.seqBack); mix(x.rate); mix(x.active); mix(x.queued); }
+    for (int k = 0; k < effectCount; ++k) { const Effect& e = effects[k]; mix(e.due); mix(e.value); mix(e.kind); mix(e.actor); mix(e.skill); mix(e.periods); }
+    return h;
+}
+// 還原實作
+void BattleSnapshot::restore(Party& team, EnemyGroup& enemies, Timeline& timeline, StatusEngine& status, RngStream& rng) const {
+    rng.seed = rngSeed; rng.counter = rngCounter;
+    for (int i = 0; i < partySize; ++i) {
+        Character* c = team[i];
+        c->setReadyMask(members[i].readyMask);
+        for (auto* sk : c->getSkills()) sk->setReadyTick(0);
+        c->addBuff(members[i].buff - c->getTempBuff());
+        c->setHP(members[i].hp);
+    }
+    for (int i = 0; i < team.aliveCount(); ++i) { team.alive[i] = aliveOrder[i]; team.alivePos[aliveOrder[i]] = i; }
+    for (int i = 0; i < foeCount; ++i) { enemies[i].hp = foes[i].hp; enemies[i].attack = foes[i].attack; enemies.refresh(i); }
+    // 時間軸：作廢所有舊排程，依原本的排入順序重新排入
+    int n = partySize + foeCount;
+    timeline.reserve(n);
+    timeline.queue.clear();
+    timeline.now = now; timeline.seqCounter = seq;
+    for (int a = 0; a < n; ++a) {
+        const Actor& x = actors[a];
+        Timeline::Slot& s = timeline.slots[a];
+        s.speed = a < partySize ? team[a]->getSpeed() : enemies[a - partySize].speed;
+        s.rate = x.rate;
+        s.active = x.active;
+        s.queued = x.queued;
+        s.readyAt = now + x.wait;
+        s.pendingSeq = seq - x.seqBack;
+        s.gen++;
+        if (x.queued) timeline.enqueue({s.readyAt, s.pendingSeq, a, s.gen});
+    }
+    // 狀態效果：重建時間輪，效果編號依排入順序重新編排
+    status.wheel.reset(wheelNow);
+    status.effects.clear(); status.freeIds.clear();
+    status.partySize = partySize;
+    status.stunCount.assign(n, 0);
+    status.active = effectCount;
+    status.scheduled = 0;
+    for (int k = 0; k < effectCount; ++k) {
+        const Effect& x = effects[k];
+        status.effects.push_back({(EffectKind)x.kind, x.actor, x.skill, x.value, x.periods, 0, 0});
+        status.schedule(status.effects.back(), k, wheelNow + x.due);
+        if (x.kind == EFFECT_STUN) status.stunCount[x.actor]++;
+        if (x.kind == EFFECT_COOLDOWN) team[x.actor]->getSkills()[x.skill]->setReadyTick(wheelNow + x.due);
+    }
+}
+
+// 分支執行環境：建立時深拷貝隊伍與敵人一次，之後每個分支只需還原快照 (不再配置角色)
+class BattleBranch {
+    Party team;
+    EnemyGroup enemies;
+    Timeline timeline;
+    StatusEngine status;
+    RngStream rng;
+public:
+    BattleBranch(const Party& src, const EnemyGroup& foes) : enemies(foes), status(team, enemies, timeline) {
+        Memory::Scope tag(Memory::CHARACTERS);
+        for (auto* c : src) team.add(c->clone());
+    }
+    ~BattleBranch() { for (auto* c : team.release()) delete c; }
+    void restore(const BattleSnapshot& snap) { snap.restore(team, enemies, timeline, status, rng); }
+    Party& party() { return team; }
+    EnemyGroup& foes() { return enemies; }
+    Timeline& getTimeline() { return timeline; }
+    StatusEngine& getStatus() { return status; }
+    RngStream& getRng() { return rng; }
+};
+
+// 電腦行動：一半機率施放隨機可用技能，否則普通攻擊 (skillIdx 回傳使用的技能，-1 表示普攻或無可用技能)
+int autoAction(Character* member, Party& team, int& skillIdx) {
+    skillIdx = -1;
+    if (getRandom(1,10) > 5) {
+        skillIdx = member->pickRandomReadySkill();
+        return (skillIdx >= 0) ? member->performSkill(skillIdx, team) : 0;
+    }
+    Transcript::say(Transcript::F_ATTACK, member->getName());
+    return member->getAttack();
+}
+
+// 怪物攻擊結算：回傳造成的傷害 (-1 表示被閃避)
+int monsterStrike(const Monster& monster, Character* target) {
+    // 閃避判定: 1-100 隨機數 < 角色速度(幸運)
+    if (damageLuck) damageLuck->taken -= monster.attack * (1 - max(0, min(target->getSpeed() - 1, 100)) / 100.0); // 擲骰前的期望值
+    if (getRandom(1, 100) < target->getSpeed()) return -1;
+    if (damageLuck) damageLuck->taken += monster.attack;
+    target->setHP(target->getHP() - monster.attack);
+    Bus::damage(Bus::ENEMY, Bus::NOBODY, target->getCharId(), monster.attack);
+    return monster.attack;
+}
+
+// 選擇攻擊目標 (只剩一名敵人時不詢問)
+int chooseTarget(const EnemyGroup& enemies) {
+    if (enemies.aliveCount() == 1) return enemies.pick(TARGET_LOWEST_HP);
+    vector<int> options;
+    out() << "選擇目標:\n";
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        if (enemies[i].getHP() <= 0) continue;
+        options.push_back(i);
+        out() << options.size() << ". " << enemies[i].name << " (HP: " << enemies[i].getHP() << "/" << enemies[i].maxHp << ")\n";
+    }
+    return options[askChoice(D_TARGET, 1, options.size(), DecisionContext(nullptr, nullptr, nullptr, &enemies)) - 1];
+}
+
+// 對敵方套用傷害 (全體技能一次結算整波敵人)，回傳計入統計的總傷害 (全體技能依命中的敵人數加總)
+int applyDamage(EnemyGroup& enemies, int target, int damage, bool area) {
+    if (area) {
+        int hit = enemies.aliveCount();
+        enemies.damageAll(damage);
+        Transcript::say(Transcript::F_DAMAGE_ALL, damage);
+        return damage * hit;
+    }
+    enemies.damage(target, damage);
+    Transcript::say(Transcript::F_DAMAGE, damage);
+    if (enemies[target].getHP() <= 0 && enemies.size() > 1) Transcript::say(Transcript::F_FOE_DOWN, enemies[target].name);
+    return damage;
+}
+
+// 將雙方排入時間軸 (我方編號為隊伍槽位，敵方接在其後)
+void scheduleCombatants(Timeline& timeline, const Party& team, const EnemyGroup& enemies) {
+    timeline.reserve(team.size() + enemies.size());
+    for (size_t slot = 0; slot < team.size(); ++slot) timeline.join(slot, team[slot]->getSpeed());
+    for (size_t i = 0; i < enemies.size(); ++i) if (enemies[i].getHP() > 0) timeline.join(team.size() + i, enemies[i].speed);
+}
+
+// 我方行動結算：套用傷害、開始技能冷卻並附加技能效果；回傳對所有目標造成的總傷害
+int resolvePartyAction(StatusEngine& status, Party& team, EnemyGroup& enemies, int slot, int skillIdx, int target, int damage) {
+    const Skill* skill = (skillIdx >= 0) ? team[slot]->getSkills()[skillIdx] : nullptr;
+    bool area = skill && skill->isAreaEffect();
+    int dealt = 0;
+    if (damage > 0) {
+        dealt = applyDamage(enemies, target, damage, area);
+        Bus::damage(Bus::PARTY, team[slot]->getCharId(), area ? Bus::NOBODY : target, dealt);
+    }
+    if (!skill) return dealt;
+    status.startCooldown(slot, skillIdx);
+    if (!enemies.wiped() && skill->effectsLand()) status.apply(skill, target);
+    return dealt;
+}
+
+// 戰鬥結束判定與結算 (勝利發放戰利品、全滅顯示 GAME OVER)，回傳戰鬥是否結束
+bool checkBattleEnd(Party& team, EnemyGroup& enemies) {
+    if (team.wiped()) {
+        Transcript::say(Transcript::F_GAME_OVER);
+        // 失敗直接重來
+        return true;
+    }
+    if (!enemies.wiped()) return false;
+    for (size_t i = 0; i < enemies.size(); ++i) Transcript::say(Transcript::F_FOE_DEFEATED, enemies[i].name);
+    
+    // 戰鬥勝利語音
+    for (auto* member : team) {
+        if (member->getHP() > 0 && getRandom(1, 100) < 40) {
+            StrRef quote = member->getQuote(QUOTE_WIN);
+            if (!quote.empty()) printQuote(quote, member->getName());
+            break; 
+        }
+    }
+    int totalExp = 0;
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        const Monster* monster = &enemies[i];
+        // 章節觸發檢查 (只有 BOSS 會推進章節，其餘不比對名稱)
+        bool boss = monster->type == BOSS;
+        if (boss && monster->name == "基爾 (Kir)") { 
+            gState.boss_Kir = true; 
+            Story::triggerChapter4(); 
+        } else if (boss && monster->name == "苦艾酒 (Vermouth)") { 
+            gState.boss_Vermouth = true; 
+            Story::triggerChapter5(); 
+        } else if (boss && monster->name == "伏特加 (Vodka)") { 
+            gState.boss_Vodka = true; 
+            Story::triggerChapter6(); 
+        } else if (boss && monster->name == "琴酒 (Gin)") { 
+            gState.boss_Gin = true; 
+            Story::triggerChapter7();
+            currentLocation = LOCATIONS[7]; 
+            Story::triggerChapter8();
+        }
+        // 戰利品累計
+        gState.playerMoney += monster->moneyDrop;
+        totalExp += (monster->type == BOSS ? 2000 : 150);
     }
     
+    // 戰利品發放
+    for(auto* member : team) if(member->getHP() > 0) member->beatMonster(totalExp);
+    return true;
+}
 
-    // 戰鬥初始化
-    for(auto* c : team) { c->clearBuff(); c->resetCooldowns(); }
-    // 戰鬥迴圈
-    int round = 1;
-    while (monster->getHP() > 0) {
-        // 顯示狀態
-        printBattleStatus(team, monster);
-        cout << Color::BLUE << "--- Round " << round << " ---" << Color::RESET << endl;
-        // 玩家回合
-        for (auto* member : team) {
-            // 檢查存活
-            if (member->getHP() > 0 && monster->getHP() > 0) {
-                cout << "輪到 " << Color::BOLD << member->getName() << Color::RESET << "\n";
-                int damage = 0;
-                // 玩家選擇行動
-                if (member->getIsPlayer()) {
-                    bool validAction = false;
-                    // 行動選單
-                    while (!validAction) {
-                        cout << "1. 普通攻擊\n";
-                        const auto& skills = member->getSkills();
-                        // 列出技能
-                        for(size_t i=0; i<skills.size(); ++i) {
-                            string status = "";
-                            string color = Color::RESET;
-                            if (!skills[i]->isReady()) {
-                                status = " (冷卻中 " + to_string(skills[i]->getCurrentCD()) + ")";
-                                color = Color::GRAY;
-                            } else {
-                                status = " (CD:" + to_string(skills[i]->getMaxCD()) + ")";
-                            }
-                            cout << (i + 2) << ". " << color << "技能: " << skills[i]->getName() << status << Color::RESET << "\n";
-                        }
-                        // 列出道具選項
-                        int itemOpt = skills.size() + 2;
-                        cout << itemOpt << ". 使用道具\n";
-                        // 取得有效輸入
-                        int choice = getValidInput(1, itemOpt);
-                        // 處理選擇
-                        if (choice == 1) { // 普通攻擊 
-                            damage = member->getAttack();
-                            damage = getRandom((int)(damage*0.8), (int)(damage*1.2));
-                            if (getRandom(1, 100) < 40) {
-                                string quote = member->getQuote("ATTACK");
-                                if (quote != "") printMessage(quote, member->getName());
-                            }
-                            printMessage(member->getName() + " 進行攻擊！");
-                            validAction = true;
-                        } else if (choice == itemOpt) { // 使用道具 
-                            if (useItemMenu(team)) validAction = true;
-                            else cout << "取消使用，請重新選擇行動。\n";
-                            damage = 0; 
-                        } else { // 使用技能
-                            int skillIdx = choice - 2;
-                            if (skills[skillIdx]->isReady()) {
-                                damage = member->performSkill(skillIdx, team);
-                                validAction = true;
-                            } else {
-                                cout << Color::RED << "該技能冷卻中！請選擇其他行動。\n" << Color::RESET;
-                            }
-                        }
-                    }
-                // 電腦隊友行動
-                } else {
-                    wait(300);
-                    if(getRandom(1,10)>5) damage = member->useRandomSkill(team);
-                    else { damage = member->getAttack(); printMessage(member->getName() + " 攻擊！"); }
-                }
-                // 計算傷害並套用
-                if (damage > 0) {
-                    monster->setHP(monster->getHP() - damage);
-                    printMessage("造成 " + to_string(damage) + " 傷害！");
-                }
-                wait(200);
+// ==========================================
+// 本機合作連線 (Local Co-op Lockstep)
+// ==========================================
+
+// 多名玩家各自執行同一場戰鬥 (同一亂數種子)，每回合只交換指令與狀態雜湊：
+// 各玩家送出本回合指令 → 主持端收齊後比對雜湊並廣播全員指令 → 各自推進。每回合每人一來一回，延遲只取決於最慢的輸入
+namespace Coop {
+    enum PacketType { P_INPUT = 1, P_FRAME, P_DESYNC };
+    // 每回合的封包 (固定長度)：指令依隊伍槽位，技能 -1 為普通攻擊，目標 -1 由系統決定
+    struct Packet {
+        int32_t type;
+        int32_t round;
+        uint64_t hash; // 回合開始時的狀態雜湊
+        int8_t skill[MAX_TEAM_SIZE];
+        int8_t target[MAX_TEAM_SIZE];
+    };
+    // 開局設定 (主持端送給每位玩家)
+    struct Setup {
+        uint32_t magic;
+        int32_t player, players;
+        uint64_t seed;
+        int32_t level, location, enemies, partySize;
+        int32_t party[MAX_TEAM_SIZE];
+    };
+    const uint32_t SETUP_MAGIC = 0x52504743; // "RPGC"
+
+    // 完整收送 (連線中斷回傳 false)；對方已離線時不產生 SIGPIPE，EPIPE 視為斷線
+    bool sendAll(int fd, const void* data, size_t size) {
+#ifndef _WIN32
+#ifndef MSG_NOSIGNAL
+        const int MSG_NOSIGNAL = 0; // 不支援的平台改由 runCoopCommand 忽略 SIGPIPE
+#endif
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n; size -= n;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+    bool recvAll(int fd, void* data, size_t size) {
+#ifndef _WIN32
+        char* p = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t n = read(fd, p, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n; size -= n;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // 連線中的一場合作戰鬥：隊伍槽位依序輪流分給各玩家 (槽位 % 玩家數)
+    class Session {
+        bool host;
+        int self, players;
+        vector<int> fds;          // 主持端：各玩家連線；加入端：連往主持端的連線
+        Packet frame;             // 本回合全員指令
+        int rounds = 0;           // 已核對雜湊的回合數
+        string error;
+        RngStream localRng;       // 本地輸入專用 (電腦代打的亂數不可動到共用的戰鬥亂數流)
+        void gatherLocal(const Party& team, const EnemyGroup& enemies, Packet& pkt);
+    public:
+        Session(bool isHost, int player, int count, const vector<int>& conns) : host(isHost), self(player), players(count), fds(conns), localRng(player) { memset(&frame, 0, sizeof(frame)); }
+        bool controls(int slot) const { return slot % players == self; }
+        int skillFor(int slot) const { return frame.skill[slot]; }
+        int targetFor(int slot) const { return frame.target[slot]; }
+        int verifiedRounds() const { return rounds; }
+        const string& lastError() const { return error; }
+        bool exchange(int round, uint64_t hash, const Party& team, const EnemyGroup& enemies);
+    };
+    thread_local Session* session = nullptr; // 目前進行中的合作戰鬥 (nullptr 表示單人)
+
+    // 本地玩家替自己負責的存活隊員選擇本回合行動 (加速時一回合內可能行動多次，沿用同一指令)
+    void Session::gatherLocal(const Party& team, const EnemyGroup& enemies, Packet& pkt) {
+        RngScope scope(localRng);
+        for (size_t slot = 0; slot < team.size(); ++slot) {
+            Character* member = team[slot];
+            if (!controls(slot) || member->getHP() <= 0) continue;
+            const auto& skills = member->getSkills();
+            int skillIdx = -1;
+            while (true) {
+                out() << "指令：" << Color::BOLD << member->getName() << Color::RESET << "\n1. 普通攻擊\n";
+                for (size_t i = 0; i < skills.size() && !headless; ++i)
+                    out() << (i + 2) << ". " << (member->isSkillReady(i) ? Color::RESET : Color::GRAY) << "技能: " << skills[i]->getName() << Color::RESET << "\n";
+                int choice = askChoice(D_BATTLE_ACTION, 1, skills.size() + 1, DecisionContext(&team, nullptr, member, &enemies));
+                skillIdx = choice - 2;
+                if (skillIdx < 0 || member->isSkillReady(skillIdx)) break;
+                out() << Color::RED << "該技能冷卻中！\n" << Color::RESET;
+                if (pilot) { skillIdx = -1; break; } // 策略選到冷卻中的技能時改為普通攻擊
             }
+            pkt.skill[slot] = skillIdx;
+            if (skillIdx < 0 || (skills[skillIdx]->targetsEnemy() && !skills[skillIdx]->isAreaEffect())) pkt.target[slot] = chooseTarget(enemies);
         }
-        // 戰鬥結束判定
-        if (monster->getHP() <= 0) {
-            printMessage("\n" + monster->name + " 被擊敗了！", "", 50, Color::GREEN);
-            
-            // 戰鬥勝利語音
-            for (auto* member : team) {
-                if (member->getHP() > 0 && getRandom(1, 100) < 40) {
-                    string quote = member->getQuote("WIN");
-                    if (quote != "") printMessage(quote, member->getName());
-                    break; 
+    }
+
+    // 交換一回合：送出本地指令與雜湊，取得全員指令；雜湊不符或斷線時回傳 false
+    bool Session::exchange(int round, uint64_t hash, const Party& team, const EnemyGroup& enemies) {
+        Packet pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.type = P_INPUT; pkt.round = round; pkt.hash = hash;
+        memset(pkt.skill, -1, sizeof(pkt.skill)); memset(pkt.target, -1, sizeof(pkt.target));
+        gatherLocal(team, enemies, pkt);
+        if (!host) {
+            if (!sendAll(fds[0], &pkt, sizeof(pkt)) || !recvAll(fds[0], &frame, sizeof(frame))) { error = "與主持端的連線中斷"; return false; }
+            if (frame.type == P_DESYNC) { error = "第 " + to_string(round) + " 回合狀態不同步 (玩家 " + to_string(frame.target[0]) + ")"; return false; }
+            if (frame.round != round || frame.hash != hash) { error = "第 " + to_string(round) + " 回合狀態不同步"; return false; }
+            rounds++;
+            return true;
+        }
+        // 主持端：依序收齊 (各玩家同時在輸入，總等待時間只取決於最慢的一位)
+        frame = pkt;
+        frame.type = P_FRAME;
+        int desyncPlayer = -1;
+        for (size_t i = 0; i < fds.size(); ++i) {
+            Packet in;
+            int player = i + 1;
+            if (!recvAll(fds[i], &in, sizeof(in)) || in.type != P_INPUT) { error = "玩家 " + to_string(player) + " 連線中斷"; return false; }
+            if (in.round != round || in.hash != hash) { if (desyncPlayer < 0) desyncPlayer = player; continue; }
+            for (size_t slot = 0; slot < team.size(); ++slot)
+                if ((int)slot % players == player) { frame.skill[slot] = in.skill[slot]; frame.target[slot] = in.target[slot]; }
+        }
+        if (desyncPlayer >= 0) { frame.type = P_DESYNC; frame.target[0] = desyncPlayer; }
+        for (size_t i = 0; i < fds.size(); ++i)
+            if (!sendAll(fds[i], &frame, sizeof(frame))) { error = "玩家 " + to_string(i + 1) + " 連線中斷"; return false; }
+        if (desyncPlayer >= 0) { error = "第 " + to_string(round) + " 回合狀態不同步 (玩家 " + to_string(desyncPlayer) + ")"; return false; }
+        rounds++;
+        return true;
+    }
+}
+
+// ==========================================
+// 觀戰廣播 (Spectator Broadcast)
+// ==========================================
+
+// 單一發佈端、多個觀戰端的共享記憶體環狀緩衝：戰鬥把精簡事件寫入映射檔，觀戰行程以唯讀方式附加。
+// 發佈端從不等待觀戰端 (寫滿即覆蓋最舊的事件)，落後的觀戰端自行偵測並略過
+namespace Spectate {
+    enum EventKind { EV_START = 1, EV_UNIT, EV_ROUND, EV_ACTION, EV_END };
+    // 固定 64 位元組的事件 (一個快取行)
+    struct Event {
+        uint8_t kind;
+        uint8_t side;   // 0 我方 / 1 敵方
+        uint8_t index;  // 隊伍槽位或敵人編號
+        uint8_t type;   // 怪物種類
+        int32_t round;
+        int32_t hp, maxHp, attack;
+        int32_t value;  // 行動：傷害 (-1 閃避)；結束：1 勝利；開始：地點編號
+        int16_t target, skill;
+        char name[36];  // UTF-8，超過時截斷
+    };
+    static_assert(sizeof(Event) == 64, "Spectate::Event 應為 64 位元組 (一個快取行)");
+    const uint64_t RING_MAGIC = 0x474E495252505247ULL;
+    const uint32_t MAX_SLOTS = 1u << 20; // 格數上限 (每格 72 位元組，約 72 MB)
+    // 映射檔開頭：head 為下一個寫入序號
+    struct Header {
+        uint64_t magic;
+        uint32_t slotCount, slotSize;
+        atomic<uint64_t> head;
+        atomic<uint32_t> closed; // 發佈端已結束
+    };
+    // 每格以序號作 seqlock：2n+1 表示第 n 筆寫入中，2n+2 表示寫入完成
+    struct Slot {
+        atomic<uint64_t> seq;
+        Event ev;
+    };
+
+    // 發佈端：寫入只有幾次儲存與一次 64 位元組複製，不呼叫系統呼叫也不取鎖
+    class Ring {
+        Header* header = nullptr;
+        Slot* slots = nullptr;
+        size_t bytes = 0;
+        uint64_t next = 0;
+    public:
+        Ring() {}
+        Ring(const Ring&) = delete;
+        Ring& operator=(const Ring&) = delete;
+        ~Ring() {
+#ifndef _WIN32
+            if (!header) return;
+            header->closed.store(1, memory_order_release);
+            munmap(header, bytes);
+#endif
+        }
+        // 先刪除舊檔再建立新檔：直接截斷會讓仍映射舊檔的觀戰端讀到檔尾之外而收到 SIGBUS，
+        // 刪除後舊的觀戰端保有原本的檔案，重新附加才看到新的廣播
+        bool create(const string& path, uint32_t count) {
+#ifndef _WIN32
+            if (count < 1 || count > MAX_SLOTS) return false;
+            bytes = sizeof(Header) + (size_t)count * sizeof(Slot);
+            if (::unlink(path.c_str()) != 0 && errno != ENOENT) return false;
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0) return false;
+            void* m = (ftruncate(fd, bytes) == 0) ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if (m == MAP_FAILED) return false;
+            header = new (m) Header();
+            slots = reinterpret_cast<Slot*>(static_cast<char*>(m) + sizeof(Header));
+            for (uint32_t i = 0; i < count; ++i) new (&slots[i]) Slot();
+            header->slotCount = count;
+            header->slotSize = sizeof(Slot);
+            header->head.store(0);
+            header->closed.store(0);
+            atomic_thread_fence(memory_order_release);
+            header->magic = RING_MAGIC; // 最後寫入，觀戰端看到魔數即表示初始化完成
+            return true;
+#else
+            return false;
+#endif
+        }
+        void publish(const Event& e) {
+            Slot& s = slots[next % header->slotCount];
+            s.seq.store(2 * next + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            s.ev = e;
+            s.seq.store(2 * next + 2, memory_order_release);
+            header->head.store(++next, memory_order_release);
+        }
+    };
+    thread_local Ring* ring = nullptr; // 目前的廣播目標 (nullptr 表示不廣播)
+
+    // 觀戰端：唯讀映射，自行追蹤讀取位置
+    class Reader {
+        const Header* header = nullptr;
+        const Slot* slots = nullptr;
+        size_t bytes = 0;
+        uint64_t next = 0;
+        uint32_t count = 0; // 附加時檢查過的格數 (之後不再讀映射檔裡的值)
+    public:
+        uint64_t dropped = 0; // 因落後而略過的事件數
+        Reader() {}
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        ~Reader() {
+#ifndef _WIN32
+            if (header) munmap((void*)header, bytes);
+#endif
+        }
+        // 附加到映射檔，從目前位置開始讀 (只看新事件)
+        bool attach(const string& path) {
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            void* m = MAP_FAILED;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (m == MAP_FAILED) return false;
+            header = static_cast<const Header*>(m);
+            bytes = st.st_size;
+            count = header->slotCount;
+            if (header->magic != RING_MAGIC || header->slotSize != sizeof(Slot) || count < 1 || count > MAX_SLOTS
+                || bytes < sizeof(Header) + (size_t)count * sizeof(Slot)) { count = 0; return false; }
+            slots = reinterpret_cast<const Slot*>(static_cast<const char*>(m) + sizeof(Header));
+            next = header->head.load(memory_order_acquire);
+            return true;
+#else
+            return false;
+#endif
+        }
+        bool closed() const { return header->closed.load(memory_order_acquire) && next >= header->head.load(memory_order_acquire); }
+        // 取出下一筆事件 (沒有新事件回傳 false)；落後超過一圈或讀取途中被覆寫時跳過
+        bool poll(Event& e) {
+            if (count == 0) return false; // 未成功附加
+            while (true) {
+                uint64_t head = header->head.load(memory_order_acquire);
+                if (next >= head) return false;
+                if (head - next > count) { dropped += head - count - next; next = head - count; }
+                const Slot& s = slots[next % count];
+                uint64_t want = 2 * next + 2;
+                if (s.seq.load(memory_order_acquire) == want) {
+                    memcpy(&e, &s.ev, sizeof(e));
+                    atomic_thread_fence(memory_order_acquire);
+                    if (s.seq.load(memory_order_relaxed) == want) { next++; return true; }
                 }
+                dropped++; next++;
             }
-            // 章節觸發檢查
-            if (monster->name == "基爾 (Kir)") { 
-                gState.boss_Kir = true; 
-                Story::triggerChapter4(); 
-            } else if (monster->name == "苦艾酒 (Vermouth)") { 
-                gState.boss_Vermouth = true; 
-                Story::triggerChapter5(); 
-            } else if (monster->name == "伏特加 (Vodka)") { 
-                gState.boss_Vodka = true; 
-                Story::triggerChapter6(); 
-            } else if (monster->name == "琴酒 (Gin)") { 
-                gState.boss_Gin = true; 
-                Story::triggerChapter7();
-                currentLocation = LOCATIONS[7]; 
-                Story::triggerChapter8();
-            }
-            
-            // 戰利品發放
-            gState.playerMoney += monster->moneyDrop;
-            for(auto* member : team) if(member->getHP() > 0) member->beatMonster(monster->type == BOSS ? 2000 : 150);
-            return;
         }
+    };
+
+    // 事件建立輔助
+    Event makeEvent(EventKind kind, int round) { Event e; memset(&e, 0, sizeof(e)); e.kind = kind; e.round = round; return e; }
+    void setName(Event& e, const string& name) {
+        size_t n = min(name.size(), sizeof(e.name) - 1);
+        while (n < name.size() && n > 0 && (name[n] & 0xC0) == 0x80) --n; // 不切斷 UTF-8 字元
+        memcpy(e.name, name.data(), n);
+    }
+    // 發佈整個戰況 (各單位的 HP 與攻擊力)，之後以 marker 標示一個完整的畫面
+    void publishBoard(EventKind marker, int round, int value, const Party& team, const EnemyGroup& enemies) {
+        for (size_t i = 0; i < team.size(); ++i) {
+            Event e = makeEvent(EV_UNIT, round);
+            e.side = 0; e.index = i; e.hp = team[i]->getHP(); e.maxHp = team[i]->getMaxHP(); e.attack = team[i]->getAttack();
+            setName(e, team[i]->getName());
+            ring->publish(e);
+        }
+        for (size_t i = 0; i < enemies.size(); ++i) {
+            const Monster& m = enemies[i];
+            Event e = makeEvent(EV_UNIT, round);
+            e.side = 1; e.index = i; e.type = m.type; e.hp = m.getHP(); e.maxHp = m.maxHp; e.attack = m.attack;
+            setName(e, m.name);
+            ring->publish(e);
+        }
+        Event e = makeEvent(marker, round);
+        e.value = value;
+        ring->publish(e);
+    }
+    void publishAction(int round, int side, int index, int target, int skill, int damage) {
+        Event e = makeEvent(EV_ACTION, round);
+        e.side = side; e.index = index; e.target = target; e.skill = skill; e.value = damage;
+        ring->publish(e);
+    }
+    // 戰鬥範圍：開始時發佈地點，離開 battle() 時 (任何結束路徑) 發佈最終戰況與勝負
+    class BattleScope {
+        const Party& team;
+        const EnemyGroup& enemies;
+        const Timeline& timeline;
+    public:
+        BattleScope(const Party& t, const EnemyGroup& e, const Timeline& tl) : team(t), enemies(e), timeline(tl) {
+            if (!ring) return;
+            Event ev = makeEvent(EV_START, 0);
+            ev.value = currentLocation.id;
+            setName(ev, currentLocation.name);
+            ring->publish(ev);
+        }
+        ~BattleScope() { if (ring) publishBoard(EV_END, timeline.round(), enemies.wiped() ? 1 : 0, team, enemies); }
+    };
+
+    // 觀戰畫面用的角色 (只承載名稱與 HP，沿用 printBattleStatus 的排版)
+    class Observed : public Character {
+    public:
+        Observed(const Event& e) : Character(e.name, "觀戰", 1, max(1, (int)e.maxHp), e.attack, 0, 0) { hp = e.hp; }
+        Character* clone() const override { return new Observed(*this); }
+        void beatMonster(int) override {}
+    };
+    // 以收到的單位重建隊伍與敵人並顯示
+    void render(const vector<Event>& units) {
+        Party team;
+        EnemyGroup enemies;
+        for (const auto& u : units) {
+            if (u.side == 0) team.add(new Observed(u));
+            else { Monster m(u.name, u.maxHp, u.attack, (MonsterType)u.type, 0); m.hp = u.hp; enemies.add(m); }
+        }
+        printBattleStatus(team, enemies);
+        for (auto* c : team.release()) delete c;
+    }
+}
+
+// 前向宣告 (戰術分析在無頭模擬之後定義)
+namespace Forecast { void run(const Party& team, const EnemyGroup& enemies, const Timeline& timeline, const StatusEngine& status, const RngStream& rng, int actor); }
+
+// 戰鬥函式
+void battle(Party& team, EnemyGroup& enemies) {
+    Memory::Scope tag(Memory::BATTLE);
+    Transcript::say(Transcript::F_BATTLE_START);
+
+    for (size_t i = 0; i < enemies.size(); ++i) {
+        Monster* monster = &enemies[i];
+        // 戰鬥前劇情 (只有 BOSS 有台詞，其餘不比對名稱)
+        bool boss = monster->type == BOSS;
+        if (boss && monster->name == "基爾 (Kir)") printMessage("對不起了，我不能在這裡暴露身分...", "基爾");
+        else if (boss && monster->name == "苦艾酒 (Vermouth)") printMessage("A secret makes a woman woman...", "苦艾酒");
+        else if (boss && monster->name == "伏特加 (Vodka)") printMessage("老大說了，今天一定要拿下你們！", "伏特加");
+        else if (boss && monster->name == "琴酒 (Gin)") printMessage("哼，一群老鼠。", "琴酒");
+
+        // 削弱機制
+        if (monster->type == BOSS && gState.playerClues >= 5) {
+                printMessage("利用掌握的情報，看穿了 " + monster->name + " 的破綻！", "", 20, Color::GREEN);
+                gState.playerClues -= 5;
+                monster->attack = (int)(monster->attack * 0.7);
+                monster->hp = (int)(monster->hp * 0.7);
+                monster->maxHp = monster->hp;
+        }
+        if (monster->type == ELITE && gState.playerClues >= 3) {
+                printMessage("利用掌握的情報，看穿了 " + monster->name + " 的破綻！", "", 20, Color::GREEN);
+                gState.playerClues -= 3;
+                monster->attack = (int)(monster->attack * 0.8);
+                monster->hp = (int)(monster->hp * 0.8);
+                monster->maxHp = monster->hp;
+        }
+        enemies.refresh(i);
+    }
+    
 
-        // 怪物回合
-        if(team.size() > 0) {
-            // 篩選存活角色
-            vector<Character*> aliveTeam;
-            for (auto* c : team) {
-                if (c->getHP() > 0) aliveTeam.push_back(c);
+    // 戰鬥初始化 (本場使用可重現的亂數流，戰術分析的快照會記錄其位置)
+    RngStream rng(((uint64_t)getRandom(0, numeric_limits<int>::max()) << 31) ^ (uint64_t)getRandom(0, numeric_limits<int>::max()));
+    RngScope rngScope(rng);
+    for(auto* c : team) { c->clearBuff(); c->resetCooldowns(); }
+    Timeline timeline;
+    scheduleCombatants(timeline, team, enemies);
+    StatusEngine status(team, enemies, timeline);
+    Spectate::BattleScope broadcast(team, enemies, timeline); // 觀戰廣播 (未啟用時不做事)
+    Formula::FoeScope focus(enemies); // 公式技能的 target.* 指向這一波敵人
+    // 戰鬥迴圈：依時間軸輪流行動
+    int round = 0;
+    int partySize = team.size();
+    while (true) {
+        int actor = timeline.next();
+        if (actor < 0) return;
+        // 處理到期的冷卻與狀態效果 (中毒可能結束戰鬥)
+        status.advance(timeline.getNow());
+        if (checkBattleEnd(team, enemies)) return;
+        // 新回合開始時顯示狀態
+        if (timeline.round() > round) {
+            round = timeline.round();
+            printBattleStatus(team, enemies);
+            if (!headless) cout << Color::BLUE << "--- Round " << round << " ---" << Color::RESET << endl;
+            if (Spectate::ring) Spectate::publishBoard(Spectate::EV_ROUND, round, 0, team, enemies);
+            // 合作模式：交換本回合全員指令並核對狀態雜湊 (不同步或斷線即中止)
+            if (Coop::session) {
+                BattleSnapshot snap;
+                snap.capture(team, enemies, timeline, status, rng);
+                if (!Coop::session->exchange(round, snap.hash(), team, enemies)) return;
+            }
+        }
+        // 怪物行動
+        if (actor >= partySize) {
+            const Monster& monster = enemies[actor - partySize];
+            if (monster.getHP() <= 0) { timeline.remove(actor); continue; }
+            if (status.isStunned(actor)) {
+                Transcript::say(Transcript::F_STUNNED, monster.name);
+                timeline.endTurn(actor);
+                continue;
             }
             // 隨機選擇一名存活角色攻擊
-            if (!aliveTeam.empty()) {
-                printMessage(monster->name + " 反擊！", "", 20, Color::MAGENTA);
-                int targetIdx = getRandom(0, aliveTeam.size()-1);
-                Character* target = aliveTeam[targetIdx];
-                // 閃避判定: 1-100 隨機數 < 角色速度(幸運)
-                if (getRandom(1, 100) < target->getSpeed()) {
-                    printMessage(target->getName() + " 靈巧地閃過了攻擊！", "", 20, Color::GREEN);
+            Transcript::say(Transcript::F_FOE_ATTACK, monster.name);
+            Character* target = team.randomAlive();
+            int dealt = monsterStrike(monster, target);
+            if (Spectate::ring) Spectate::publishAction(round, 1, actor - partySize, target->getPartySlot(), -1, dealt);
+            if (dealt < 0) Transcript::say(Transcript::F_DODGE, target->getName());
+            else Transcript::say(Transcript::F_HIT, target->getName(), dealt);
+            timeline.endTurn(actor);
+            // 全滅判定
+            if (checkBattleEnd(team, enemies)) return;
+            continue;
+        }
+        // 我方行動 (陣亡者保留排程，復活後可繼續行動)
+        Character* member = team[actor];
+        if (member->getHP() > 0 && status.isStunned(actor)) {
+            Transcript::say(Transcript::F_STUNNED, member->getName());
+        } else if (member->getHP() > 0) {
+            if (!headless) cout << "輪到 " << Color::BOLD << member->getName() << Color::RESET << "\n";
+            int damage = 0;
+            int skillIdx = -1;
+            int target = -1;
+            // 合作模式：套用本回合交換到的指令 (技能冷卻中改為普通攻擊，目標倒下改打 HP 最低者)
+            if (Coop::session) {
+                skillIdx = Coop::session->skillFor(actor);
+                if (skillIdx >= 0 && !member->isSkillReady(skillIdx)) skillIdx = -1;
+                const Skill* skill = (skillIdx >= 0) ? member->getSkills()[skillIdx] : nullptr;
+                if (!skill || (skill->targetsEnemy() && !skill->isAreaEffect())) {
+                    target = Coop::session->targetFor(actor);
+                    if (target < 0 || target >= (int)enemies.size() || enemies[target].getHP() <= 0) target = enemies.pick(TARGET_LOWEST_HP);
+                }
+                if (skill) {
+                    Formula::aimAt(target);
+                    damage = member->performSkill(skillIdx, team);
                 } else {
-                    target->setHP(target->getHP() - monster->attack);
-                    printMessage(target->getName() + " 受到 " + to_string(monster->attack) + " 傷害！");
+                    damage = member->getAttack();
+                    damage = getRandom((int)(damage*0.8), (int)(damage*1.2));
+                    Transcript::say(Transcript::F_PLAYER_ATTACK, member->getName());
+                }
+            // 玩家選擇行動
+            } else if (member->getIsPlayer()) {
+                bool validAction = false;
+                // 行動選單
+                while (!validAction) {
+                    out() << "1. 普通攻擊\n";
+                    const auto& skills = member->getSkills();
+                    // 列出技能 (無頭模式不組字串)
+                    for(size_t i=0; i<skills.size() && !headless; ++i) {
+                        string state = "";
+                        string color = Color::RESET;
+                        if (!member->isSkillReady(i)) {
+                            state = " (冷卻中 " + to_string(status.cooldownLeft(skills[i])) + ")";
+                            color = Color::GRAY;
+                        } else {
+                            state = " (CD:" + to_string(skills[i]->getMaxCD()) + ")";
+                        }
+                        out() << (i + 2) << ". " << color << "技能: " << skills[i]->getName() << state << Color::RESET << "\n";
+                    }
+                    // 列出道具選項
+                    int itemOpt = skills.size() + 2;
+                    out() << itemOpt << ". 使用道具\n";
+                    int forecastOpt = itemOpt + 1;
+                    if (!pilot) out() << forecastOpt << ". 戰術分析\n"; // 自動操作時不提供分析
+                    // 取得有效輸入
+                    int choice = askChoice(D_BATTLE_ACTION, 1, pilot ? itemOpt : forecastOpt, DecisionContext(&team, nullptr, member, &enemies));
+                    // 處理選擇
+                    if (choice == forecastOpt) { // 戰術分析 (不消耗行動)
+                        Forecast::run(team, enemies, timeline, status, rng, actor);
+                    } else if (choice == 1) { // 普通攻擊 
+                        target = chooseTarget(enemies);
+                        damage = member->getAttack();
+                        damage = getRandom((int)(damage*0.8), (int)(damage*1.2));
+                        if (getRandom(1, 100) < 40) {
+                            StrRef quote = member->getQuote(QUOTE_ATTACK);
+                            if (!quote.empty()) printQuote(quote, member->getName());
+                        }
+                        Transcript::say(Transcript::F_PLAYER_ATTACK, member->getName());
+                        validAction = true;
+                    } else if (choice == itemOpt) { // 使用道具 
+                        if (useItemMenu(team)) validAction = true;
+                        else out() << "取消使用，請重新選擇行動。\n";
+                        damage = 0; 
+                    } else { // 使用技能
+                        skillIdx = choice - 2;
+                        if (member->isSkillReady(skillIdx)) {
+                            if (skills[skillIdx]->targetsEnemy() && !skills[skillIdx]->isAreaEffect()) target = chooseTarget(enemies);
+                            Formula::aimAt(target);
+                            damage = member->performSkill(skillIdx, team);
+                            validAction = true;
+                        } else {
+                            out() << Color::RED << "該技能冷卻中！請選擇其他行動。\n" << Color::RESET;
+                            skillIdx = -1;
+                        }
+                    }
                 }
+            // 電腦隊友行動 (集火 HP 最低的敵人)
+            } else {
+                wait(300);
+                damage = autoAction(member, team, skillIdx);
+                target = enemies.pick(TARGET_LOWEST_HP);
             }
+            // 計算傷害並套用
+            resolvePartyAction(status, team, enemies, actor, skillIdx, target, damage);
+            Formula::aimAt(-1);
+            if (Spectate::ring) Spectate::publishAction(round, 0, actor, target, skillIdx, damage);
+            wait(200);
         }
+        timeline.endTurn(actor);
+        // 戰鬥結束判定
+        if (checkBattleEnd(team, enemies)) return;
+    }
+}
 
-        // 回合結束處理
-        for(auto* c : team) c->tickCooldowns();
-        
-        // 全滅判定
-        bool allDead = true;
-        for(auto* c : team) if(c->getHP() > 0) allDead = false;
-        if(allDead) {
-            printMessage("GAME OVER... 諾亞方舟被組織奪走了...", "", 50, Color::RED);
-            // 失敗直接重來
-            return;
-        }
-        round++;
+// 突襲戰：連續數波敵人，隊伍狀態延續到下一波
+void raid(Party& team) {
+    int waveSize = min(RAID_MAX_WAVE, 3 + gState.chapter / 2);
+    for (int wave = 1; wave <= RAID_WAVES && !team.wiped(); ++wave) {
+        printMessage("\n=== 突襲戰 第 " + to_string(wave) + " 波 ===", "", 30, Color::RED);
+        EnemyGroup enemies = generateWave(team, waveSize);
+        for (size_t i = 0; i < enemies.size(); ++i) enemies[i].print();
+        battle(team, enemies);
     }
 }
 
-// 產生隨機 NPC
-Character* createRandomNPC() {
-    int roll = getRandom(1, 13);
-    switch(roll) {
+// 依編號建立角色 (0 為柯南，1~13 為可招募 NPC)
+const int NPC_COUNT = 13;
+Character* createCharacter(int id, int lv) {
+    Memory::Scope tag(Memory::CHARACTERS);
+    Character* c = nullptr;
+    switch(id) {
+        case 0: c = new Gadgeteer("江戶川柯南", lv); break;
         // Fighter
-        case 1: return new Fighter("毛利蘭", "Karate", 1);
-        case 2: return new Fighter("服部平次", "Kendo", 1);
-        case 3: return new Fighter("京極真", "Super", 1);
-        case 4: return new Fighter("赤井秀一", "Sniper", 1);
-        case 5: return new Fighter("安室透", "SecretPolice", 1);
-        case 6: return new Fighter("遠山和葉", "Aikido", 1);
+        case 1: c = new Fighter("毛利蘭", "Karate", lv); break;
+        case 2: c = new Fighter("服部平次", "Kendo", lv); break;
+        case 3: c = new Fighter("京極真", "Super", lv); break;
+        case 4: c = new Fighter("赤井秀一", "Sniper", lv); break;
+        case 5: c = new Fighter("安室透", "SecretPolice", lv); break;
+        case 6: c = new Fighter("遠山和葉", "Aikido", lv); break;
         // Support
-        case 7: return new Support("灰原哀", "Science", 1);
-        case 8: return new Support("阿笠博士", "Inventor", 1);
-        case 9: return new Support("鈴木園子", "Rich", 1);
-        case 10: return new Support("工藤優作", "Novelist", 1);
+        case 7: c = new Support("灰原哀", "Science", lv); break;
+        case 8: c = new Support("阿笠博士", "Inventor", lv); break;
+        case 9: c = new Support("鈴木園子", "Rich", lv); break;
+        case 10: c = new Support("工藤優作", "Novelist", lv); break;
         // Trickster
-        case 11: return new Trickster("怪盜基德", "Thief", 1);
-        case 12: return new Trickster("毛利小五郎", "Sleep", 1);
-        case 13: return new Trickster("工藤有希子", "Actress", 1);
+        case 11: c = new Trickster("怪盜基德", "Thief", lv); break;
+        case 12: c = new Trickster("毛利小五郎", "Sleep", lv); break;
+        case 13: c = new Trickster("工藤有希子", "Actress", lv); break;
+        default: c = new Fighter("毛利蘭", "Karate", lv); id = 1;
     }
-    return new Fighter("毛利蘭", "Karate", 1);
+    c->setCharId(id); // 台詞表依此編號索引
+    return c;
+}
+
+// 產生隨機 NPC
+Character* createRandomNPC() {
+    return createCharacter(getRandom(1, NPC_COUNT), 1);
 }
 
 // 搜查周邊
-void investigate(vector<Character*>& team, vector<Character*>& reserve) {
+void investigate(Party& team, vector<Character*>& reserve) {
     printMessage("=== 開始搜查周邊 ===", "", 20, Color::CYAN);
     // 成功率計算
     int successRate = 50 + currentLocation.investigationBonus;
@@ -1031,8 +4168,8 @@ void investigate(vector<Character*>& team, vector<Character*>& reserve) {
 
         if (newChar) {
             printMessage("發現了 " + newChar->getName() + " 正在此處調查！", "", 20, Color::GREEN);
-            if(team.size() < 4) {
-                team.push_back(newChar);
+            if(team.size() < MAX_TEAM_SIZE) {
+                team.add(newChar);
                 printMessage(">>> " + newChar->getName() + " 加入了隊伍！", "", 20, Color::GREEN);
             } else {
                 reserve.push_back(newChar);
@@ -1048,49 +4185,52 @@ void investigate(vector<Character*>& team, vector<Character*>& reserve) {
 
 // 地點移動
 void changeLocation() {
-    printMessage("=== 移動地點 ===", "", 0, Color::CYAN);
-    // 列出地點選項
-    for(size_t i=0; i<LOCATIONS.size(); ++i) {
-        string locked = (gState.chapter < LOCATIONS[i].requiredChapter) ? " (未解鎖)" : "";
-        string color = (gState.chapter < LOCATIONS[i].requiredChapter) ? Color::GRAY : Color::RESET;
-        cout << color << i+1 << ". " << LOCATIONS[i].name << locked << "\n" << Color::RESET;
-    }
-    int choice = getValidInput(1, LOCATIONS.size());
+    // 列出地點選項 (無頭模式不組字串)
+    if (!headless) {
+        printMessage("=== 移動地點 ===", "", 0, Color::CYAN);
+        for(size_t i=0; i<LOCATIONS.size(); ++i) {
+            string locked = (gState.chapter < LOCATIONS[i].requiredChapter) ? " (未解鎖)" : "";
+            string color = (gState.chapter < LOCATIONS[i].requiredChapter) ? Color::GRAY : Color::RESET;
+            cout << color << i+1 << ". " << LOCATIONS[i].name << locked << "\n" << Color::RESET;
+        }
+    }
+    int choice = askChoice(D_LOCATION, 1, LOCATIONS.size());
     // 檢查解鎖條件
     if (gState.chapter >= LOCATIONS[choice-1].requiredChapter) {
         currentLocation = LOCATIONS[choice-1];
-        printMessage("移動到了 " + currentLocation.name, "", 20, Color::GREEN);
+        if (!headless) printMessage("移動到了 " + currentLocation.name, "", 20, Color::GREEN);
     } else {
         printMessage("該區域尚未解鎖！", "", 20, Color::RED);
     }
 }
 
 // 隊伍與道具管理選單
-void openMenu(vector<Character*>& team, vector<Character*>& reserve) {
+void openMenu(Party& team, vector<Character*>& reserve) {
     while(true) {
-        printMessage("\n=== 隊伍與道具管理 ===", "", 0, Color::CYAN);
-        // 列出隊伍成員
-        cout << Color::YELLOW << "[出戰]" << Color::RESET << endl;
-        for(size_t i=0; i<team.size(); ++i) { cout << " " << (i+1) << ". "; team[i]->print(); }
-        if (!reserve.empty()) {
-            cout << Color::YELLOW << "[待命]" << Color::RESET << endl;
-            for(size_t i=0; i<reserve.size(); ++i) { cout << " " << (i+1) << ". "; reserve[i]->print(); }
-        }
-        // 選單選項
-        cout << "1.使用道具\n2.替換成員\n0.返回\n";
-        int choice = getValidInput(0, 2);
+        // 列出隊伍成員與選單 (無頭模式不組字串)
+        if (!headless) {
+            printMessage("\n=== 隊伍與道具管理 ===", "", 0, Color::CYAN);
+            cout << Color::YELLOW << "[出戰]" << Color::RESET << endl;
+            for(size_t i=0; i<team.size(); ++i) { cout << " " << (i+1) << ". "; team[i]->print(); }
+            if (!reserve.empty()) {
+                cout << Color::YELLOW << "[待命]" << Color::RESET << endl;
+                for(size_t i=0; i<reserve.size(); ++i) { cout << " " << (i+1) << ". "; reserve[i]->print(); }
+            }
+            cout << "1.使用道具\n2.替換成員\n0.返回\n";
+        }
+        int choice = askChoice(D_TEAM_MENU, 0, 2, DecisionContext(&team, &reserve));
         if (choice == 0) break;
         if (choice == 1) useItemMenu(team); 
         else if (choice == 2) {
             // 替換成員邏輯
             if (reserve.empty()) { printMessage("無待命成員！", "", 0, Color::RED); continue; }
-            cout << "換下編號(0取消): "; int outIdx = getValidInput(0, team.size()); if(outIdx==0) continue;
+            out() << "換下編號(0取消): "; int outIdx = askChoice(D_SWAP_OUT, 0, team.size(), DecisionContext(&team, &reserve)); if(outIdx==0) continue;
             if(team[outIdx-1]->getIsPlayer()) { printMessage("隊長不可替換！", "", 0, Color::RED); continue; }
-            cout << "換上編號(0取消): "; int inIdx = getValidInput(0, reserve.size()); if(inIdx==0) continue;
+            out() << "換上編號(0取消): "; int inIdx = askChoice(D_SWAP_IN, 0, reserve.size(), DecisionContext(&team, &reserve)); if(inIdx==0) continue;
             Character* outC = team[outIdx-1];
             Character* inC = reserve[inIdx-1];
-            team.erase(team.begin()+outIdx-1); reserve.erase(reserve.begin()+inIdx-1);
-            team.push_back(inC); reserve.push_back(outC);
+            team.removeAt(outIdx-1); reserve.erase(reserve.begin()+inIdx-1);
+            team.add(inC); reserve.push_back(outC);
             printMessage("隊伍變更！", "", 0, Color::GREEN);
         }
     }
@@ -1100,19 +4240,21 @@ void openMenu(vector<Character*>& team, vector<Character*>& reserve) {
 void openShop() {
     printMessage("=== 五稜星補給站 ===", "", 20, Color::YELLOW);
     while(true) {
-        // 列出商品
-        cout << Color::CYAN << "\n持有金錢: " << gState.playerMoney << " 円" << Color::RESET << endl;
-        cout << "--------------------------------\n";
-        for(size_t i=0; i<shopItems.size(); ++i) cout << i+1 << ". " << shopItems[i]->getName() << " - " << shopItems[i]->getPrice() << "円 (" << shopItems[i]->getDesc() << ")\n";
-        cout << "0. 離開商店\n";
-        int choice = getValidInput(0, shopItems.size(), "請選擇購買商品: ");
+        // 列出商品 (無頭模式不組字串)
+        if (!headless) {
+            cout << Color::CYAN << "\n持有金錢: " << gState.playerMoney << " 円" << Color::RESET << endl;
+            cout << "--------------------------------\n";
+            for(size_t i=0; i<shopItems.size(); ++i) cout << i+1 << ". " << shopItems[i]->getName() << " - " << shopItems[i]->getPrice() << "円 (" << shopItems[i]->getDesc() << ")\n";
+            cout << "0. 離開商店\n";
+        }
+        int choice = askChoice(D_SHOP, 0, shopItems.size(), DecisionContext(), "請選擇購買商品: ");
         if (choice == 0) break;
         // 購買邏輯
         Item* selected = shopItems[choice-1];
         if (gState.playerMoney >= selected->getPrice()) {
             gState.playerMoney -= selected->getPrice();
             addToInventory(selected); 
-            printMessage("購買了 " + selected->getName() + "！", "", 20, Color::GREEN);
+            if (!headless) printMessage("購買了 " + selected->getName() + "！", "", 20, Color::GREEN);
         } else {
             printMessage("金錢不足！", "", 10, Color::RED);
         }
@@ -1120,20 +4262,24 @@ void openShop() {
 }
 
 // 使用道具選單
-bool useItemMenu(vector<Character*>& team) {
+bool useItemMenu(Party& team) {
     // 列出背包道具
     if (inventory.empty()) { printMessage("背包是空的！", "", 10, Color::RED); return false; }
-    cout << Color::YELLOW << "=== 背包 ===" << Color::RESET << endl;
-    for (size_t i = 0; i < inventory.size(); ++i) cout << i + 1 << ". " << inventory[i].item->getName() << " (x" << inventory[i].count << ")\n";
-    cout << "0. 取消\n";
-    int choice = getValidInput(0, inventory.size(), "選擇要使用的道具: ");
+    if (!headless) {
+        cout << Color::YELLOW << "=== 背包 ===" << Color::RESET << endl;
+        for (size_t i = 0; i < inventory.size(); ++i) cout << i + 1 << ". " << inventory[i].item->getName() << " (x" << inventory[i].count << ")\n";
+        cout << "0. 取消\n";
+    }
+    int choice = askChoice(D_ITEM, 0, inventory.size(), DecisionContext(&team), "選擇要使用的道具: ");
     if (choice == 0) return false;
     // 選擇目標
     InventorySlot& slot = inventory[choice - 1];
     Item* itemToUse = slot.item;
-    cout << "選擇目標:\n";
-    for(size_t i=0; i<team.size(); ++i) cout << i+1 << ". " << team[i]->getName() << " (HP: " << team[i]->getHP() << "/" << team[i]->getMaxHP() << ")\n"; 
-    int targetIdx = getValidInput(1, team.size()) - 1;
+    if (!headless) {
+        cout << "選擇目標:\n";
+        for(size_t i=0; i<team.size(); ++i) cout << i+1 << ". " << team[i]->getName() << " (HP: " << team[i]->getHP() << "/" << team[i]->getMaxHP() << ")\n";
+    }
+    int targetIdx = askChoice(D_ITEM_TARGET, 1, team.size(), DecisionContext(&team)) - 1;
     bool success = itemToUse->apply(team[targetIdx]);
     // 使用後處理
     if (success) {
@@ -1145,78 +4291,3065 @@ bool useItemMenu(vector<Character*>& team) {
     return false;
 }
 
+// 進行一回合主選單行動 (章節檢查、顯示狀態、執行選擇)；回傳遊戲是否繼續
+bool playTurn(Party& team, vector<Character*>& reserve) {
+    // 章節觸發檢查
+    if(gState.chapter == 0 && gState.playerClues >= 1) { 
+        gState.playerClues -= 1; 
+        Story::triggerChapter1();
+    }
+    if(gState.chapter == 1 && gState.playerClues >= 3 && currentLocation.id == 1) { 
+        gState.playerClues -= 3;
+        Story::triggerChapter2();
+    }
+    if(gState.chapter == 2 && gState.playerClues >= 5 && currentLocation.id == 2) { 
+        gState.playerClues -= 5;
+        Story::triggerChapter3();
+    }
+
+    // 顯示狀態與選單 (無頭模式不組字串)
+    if (!headless) {
+        cout << Color::CYAN << "\n==================================" << Color::RESET << endl;
+        cout << Color::CYAN << "[地點]: " << currentLocation.name << " | [章節]: " << gState.chapter << endl;
+        cout << Color::CYAN << "[金錢]: " << gState.playerMoney << " 円 | [線索]: " << gState.playerClues << Color::RESET << endl;
+        cout << "1.戰鬥\n2.移動\n3.商店\n4.隊伍\n5.搜查\n6.突襲戰\n0.退出遊戲" << Color::RESET << endl;
+    }
+    int action = askChoice(D_MAIN, 0, 6, DecisionContext(&team, &reserve));
+    // 處理選單行動
+    if (action == 1) {
+        EnemyGroup enemies = generateWave(team, 1);
+        enemies[0].print();
+        battle(team, enemies);
+        
+        // 檢查是否全滅
+        if(team.wiped()) return false;
+    } 
+    else if (action == 2) { changeLocation(); triggerRandomEvent(team, reserve); } 
+    else if (action == 3) { openShop(); }
+    else if (action == 4) { openMenu(team, reserve); }
+    else if (action == 5) { investigate(team, reserve); }
+    else if (action == 6) { raid(team); if(team.wiped()) return false; }
+    else if (action == 0) { return false; }
+    return true;
+}
+
 // ==========================================
-// 主程式 (Main Loop)
+// 無頭模擬 (Headless Simulation)
 // ==========================================
 
-int main() {
-    setupConsole(); // 設定編碼為 UTF-8 (Windows)
-    
-    // 隊伍與待命成員
-    vector<Character*> team;
-    vector<Character*> reserve;
+namespace Sim {
+    // 模擬設定
+    struct Options {
+        int maxRounds = 100;                        // 回合上限 (超過視為落敗)
+        TargetPolicy partyPolicy = TARGET_LOWEST_HP; // 我方選擇目標的策略
+        TargetPolicy enemyPolicy = TARGET_RANDOM;    // 敵方選擇目標的策略
+        bool alignTurns = false;                    // 每個行動從亂數流的固定位置開始取用 (共同亂數比較時，前面多用或少用亂數不影響後續)
+        bool antithetic = false;                    // 使用對偶亂數流
+        function<void(Party&)> tweak;               // 組隊後、開戰前調整隊伍 (平衡變體)
+    };
+    // 單場戰鬥結果
+    struct BattleResult {
+        bool won = false;
+        int rounds = 0;
+        int survivors = 0;
+        vector<int> damageDealt; // 依隊伍槽位
+    };
 
-    // 遊戲主迴圈
-    bool appRunning = true;
-    while(appRunning) {
-        // 初始化遊戲
-        resetGame(team, reserve);
+    // 進入無頭模式並切換亂數流，離開範圍時還原
+    class HeadlessScope {
+        bool prevHeadless;
+        RngStream* prevRng;
+    public:
+        explicit HeadlessScope(RngStream& rng) : prevHeadless(headless), prevRng(activeRng) { headless = true; activeRng = &rng; }
+        ~HeadlessScope() { headless = prevHeadless; activeRng = prevRng; }
+    };
 
-        // 遊戲內迴圈
-        bool playing = true;
-        while (playing) {
-            // 章節觸發檢查
-            if(gState.chapter == 0 && gState.playerClues >= 1) { 
-                gState.playerClues -= 1; 
-                Story::triggerChapter1();
-            }
-            if(gState.chapter == 1 && gState.playerClues >= 3 && currentLocation.id == 1) { 
-                gState.playerClues -= 3;
-                Story::triggerChapter2();
+    // 依角色編號組隊
+    void buildParty(Party& team, const vector<int>& ids, int level) {
+        for (int id : ids) team.add(createCharacter(id, level));
+    }
+    // 各成員各自的等級
+    void buildParty(Party& team, const vector<int>& ids, const vector<int>& levels) {
+        for (size_t i = 0; i < ids.size(); ++i) team.add(createCharacter(ids[i], levels[i]));
+    }
+
+    // 從目前狀態接續無頭戰鬥直到分出勝負 (快照分支也由此推演)
+    BattleResult resume(Party& team, EnemyGroup& enemies, Timeline& timeline, StatusEngine& status, const Options& opt) {
+        BattleResult r;
+        r.damageDealt.assign(team.size(), 0);
+        int partySize = team.size();
+        Formula::FoeScope focus(enemies);
+        uint64_t turn = 0;
+        while (!enemies.wiped() && !team.wiped()) {
+            int actor = timeline.next();
+            if (actor < 0 || timeline.round() > opt.maxRounds) break;
+            if (opt.alignTurns && activeRng) activeRng->counter = ++turn << 20;
+            r.rounds = timeline.round();
+            status.advance(timeline.getNow());
+            if (enemies.wiped()) break;
+            // 敵方行動
+            if (actor >= partySize) {
+                const Monster& monster = enemies[actor - partySize];
+                if (monster.getHP() <= 0) { timeline.remove(actor); continue; }
+                if (status.isStunned(actor)) Transcript::say(Transcript::F_STUNNED, monster.name);
+                else {
+                    Transcript::say(Transcript::F_FOE_ATTACK, monster.name);
+                    Character* target = team[team.pick(opt.enemyPolicy)];
+                    int dealt = monsterStrike(monster, target);
+                    if (dealt < 0) Transcript::say(Transcript::F_DODGE, target->getName());
+                    else Transcript::say(Transcript::F_HIT, target->getName(), dealt);
+                }
+                timeline.endTurn(actor);
+                continue;
             }
-            if(gState.chapter == 2 && gState.playerClues >= 5 && currentLocation.id == 2) { 
-                gState.playerClues -= 5;
-                Story::triggerChapter3();
-            }
-
-            // 顯示狀態與選單 
-            cout << Color::CYAN << "\n==================================" << Color::RESET << endl;
-            cout << Color::CYAN << "[地點]: " << currentLocation.name << " | [章節]: " << gState.chapter << endl;
-            cout << Color::CYAN << "[金錢]: " << gState.playerMoney << " 円 | [線索]: " << gState.playerClues << Color::RESET << endl;
-            cout << "1.戰鬥\n2.移動\n3.商店\n4.隊伍\n5.搜查\n0.退出遊戲" << Color::RESET << endl;
-            int action = getValidInput(0, 5);
-            // 處理選單行動
-            if (action == 1) {
-                Monster monster = generateMonster(team);
-                monster.print();
-                battle(team, &monster);
-                
-                // 檢查是否全滅
-                bool allDead = true;
-                for(auto* c : team) if(c->getHP() > 0) allDead = false;
-                if(allDead) playing = false;
-            } 
-            else if (action == 2) { changeLocation(); triggerRandomEvent(team, reserve); } 
-            else if (action == 3) { openShop(); }
-            else if (action == 4) { openMenu(team, reserve); }
-            else if (action == 5) { investigate(team, reserve); }
-            else if (action == 0) { playing = false; }
+            // 我方行動
+            Character* member = team[actor];
+            if (member->getHP() > 0 && status.isStunned(actor)) Transcript::say(Transcript::F_STUNNED, member->getName());
+            else if (member->getHP() > 0) {
+                int skillIdx;
+                int target = enemies.pick(opt.partyPolicy);
+                Formula::aimAt(target); // 公式技能的 target.* 與實際攻擊的目標一致
+                int damage = autoAction(member, team, skillIdx);
+                r.damageDealt[actor] += resolvePartyAction(status, team, enemies, actor, skillIdx, target, damage);
+                Formula::aimAt(-1);
+            }
+            timeline.endTurn(actor);
         }
+        r.won = enemies.wiped();
+        r.survivors = team.aliveCount();
+        return r;
+    }
 
-        // 結算畫面與重玩詢問
-        cout << "\n==================================\n";
-        cout << "是否要重新開始遊戲？\n";
-        cout << "1. 重新開始遊戲 (初始化所有進度)\n";
-        cout << "0. 離開程式\n";
-        cout << "==================================\n";
-        
-        int choice = getValidInput(0, 1);
-        if (choice == 0) appRunning = false;
-        // 否則繼續迴圈重玩
+    // 無頭戰鬥：規則與 battle() 相同 (同一套時間軸與狀態引擎)，全員由電腦操作，不輸出也不延遲
+    BattleResult runBattle(Party& team, EnemyGroup& enemies, const Options& opt) {
+        for (auto* c : team) { c->clearBuff(); c->resetCooldowns(); }
+        Timeline timeline;
+        scheduleCombatants(timeline, team, enemies);
+        StatusEngine status(team, enemies, timeline);
+        return resume(team, enemies, timeline, status, opt);
+    }
+
+    // 批次統計
+    struct Summary {
+        long long battles = 0, wins = 0, rounds = 0, survivors = 0;
+        double winRate() const { return battles ? (double)wins / battles : 0; }
+        double avgRounds() const { return battles ? (double)rounds / battles : 0; }
+        double avgSurvivors() const { return battles ? (double)survivors / battles : 0; }
+        void merge(const Summary& o) { battles += o.battles; wins += o.wins; rounds += o.rounds; survivors += o.survivors; }
+    };
+    // 逐場紀錄：亂數種子、隊伍、敵人、結果
+    typedef function<void(uint64_t, const Party&, const EnemyGroup&, const BattleResult&)> Recorder;
+    // 批次模擬：第 b 場使用亂數流 seed + b (相同種子的批次彼此可直接比較)
+    Summary runBatch(const vector<int>& ids, const vector<int>& levels, long long battles, uint64_t seed,
+                     const function<EnemyGroup(const Party&)>& spawn, const Options& opt, const Recorder& record = nullptr) {
+        Summary sum;
+        for (long long b = 0; b < battles; ++b) {
+            Memory::poll();
+            RngStream rng(seed + b);
+            if (opt.antithetic) rng.flip = ~0ULL;
+            HeadlessScope scope(rng);
+            Memory::Scope tag(Memory::BATTLE); // 隊伍、時間軸、狀態引擎 (角色與怪物各有自己的標記)
+            Party team;
+            buildParty(team, ids, levels);
+            if (opt.tweak) opt.tweak(team);
+            EnemyGroup enemies = [&] { Memory::Scope tag(Memory::MONSTERS); return spawn(team); }();
+            Transcript::say(Transcript::F_SIM_BATTLE, (uint64_t)(seed + b));
+            BattleResult r = runBattle(team, enemies, opt);
+            if (r.won) Transcript::say(Transcript::F_SIM_WIN, r.rounds, r.survivors);
+            else Transcript::say(Transcript::F_SIM_LOSS, r.rounds);
+            if (record) record(seed + b, team, enemies, r);
+            sum.battles++; sum.wins += r.won; sum.rounds += r.rounds; sum.survivors += r.survivors;
+            for (auto* c : team.release()) delete c;
+        }
+        return sum;
+    }
+    // 全隊同一等級
+    Summary runBatch(const vector<int>& ids, int level, long long battles, uint64_t seed,
+                     const function<EnemyGroup(const Party&)>& spawn, const Options& opt, const Recorder& record = nullptr) {
+        return runBatch(ids, vector<int>(ids.size(), level), battles, seed, spawn, opt, record);
+    }
+}
+
+// ==========================================
+// 戰術分析 (What-if Forecast)
+// ==========================================
+
+namespace Forecast {
+    const int ROLLOUTS = 200; // 每個候選行動的推演次數
+    // 候選行動 (skill、item 皆為 -1 表示普通攻擊)
+    struct Choice { string label; int skill; int item; };
+
+    // 在分支中替行動者執行候選行動並結束其回合 (道具無合適對象時回傳 false)
+    bool perform(BattleBranch& br, int actor, const Choice& c) {
+        Party& team = br.party();
+        EnemyGroup& foes = br.foes();
+        Character* member = team[actor];
+        int target = foes.pick(TARGET_LOWEST_HP);
+        int damage = 0;
+        if (c.skill >= 0) {
+            damage = member->performSkill(c.skill, team);
+        } else if (c.item >= 0) {
+            // 復活道具優先給陣亡者，恢復道具給 HP 最低的存活者
+            Item* item = inventory[c.item].item;
+            bool used = false;
+            for (auto* m : team) if (m->getHP() <= 0 && (used = item->apply(m))) break;
+            if (!used && !item->apply(team[team.pick(TARGET_LOWEST_HP)])) return false;
+        } else {
+            int atk = member->getAttack();
+            damage = getRandom((int)(atk * 0.8), (int)(atk * 1.2));
+        }
+        resolvePartyAction(br.getStatus(), team, foes, actor, c.skill, target, damage);
+        br.getTimeline().endTurn(actor);
+        return true;
+    }
+
+    // 從目前局面對每個候選行動推演多次，之後全員交由電腦操作；
+    // 各候選共用同一組亂數種子 (第 k 次推演的未來相同)，差異只來自這一步的選擇
+    void run(const Party& team, const EnemyGroup& enemies, const Timeline& timeline, const StatusEngine& status, const RngStream& rng, int actor) {
+        BattleSnapshot snap;
+        if (!snap.capture(team, enemies, timeline, status, rng)) { printMessage("局面太複雜，無法分析。", "", 20, Color::GRAY); return; }
+        vector<Choice> choices = {{"普通攻擊", -1, -1}};
+        const auto& skills = team[actor]->getSkills();
+        for (size_t i = 0; i < skills.size(); ++i) if (team[actor]->isSkillReady(i)) choices.push_back({"技能: " + skills[i]->getName(), (int)i, -1});
+        // 秘笈會永久改變角色，不列入推演
+        for (size_t i = 0; i < inventory.size(); ++i)
+            if (inventory[i].count > 0 && !dynamic_cast<SkillBookItem*>(inventory[i].item)) choices.push_back({"道具: " + inventory[i].item->getName(), -1, (int)i});
+
+        BattleBranch br(team, enemies);
+        Sim::Options opt;
+        Bus::Mute quiet;
+        Formula::FoeScope focus(br.foes());
+        cout << Color::CYAN << "=== 戰術分析 (每項推演 " << ROLLOUTS << " 次) ===" << Color::RESET << "\n";
+        for (const auto& c : choices) {
+            int runs = 0, wins = 0;
+            long long rounds = 0, survivors = 0;
+            for (int k = 0; k < ROLLOUTS; ++k) {
+                br.restore(snap);
+                br.getRng() = RngStream(snap.rngSeed * 0x9E3779B97F4A7C15ULL + snap.rngCounter * 31 + k);
+                Sim::HeadlessScope scope(br.getRng());
+                if (!perform(br, actor, c)) break;
+                Sim::BattleResult r = Sim::resume(br.party(), br.foes(), br.getTimeline(), br.getStatus(), opt);
+                runs++; wins += r.won;
+                rounds += br.getTimeline().round(); survivors += r.survivors;
+            }
+            if (runs == 0) { cout << c.label << Color::GRAY << " (無適用對象)" << Color::RESET << "\n"; continue; }
+            cout << c.label << " | 勝率 " << 100 * wins / runs << "% | 平均結束回合 " << fixed << setprecision(1)
+                 << (double)rounds / runs << " | 平均存活 " << (double)survivors / runs << "\n";
+            cout.unsetf(ios::fixed);
+            cout << setprecision(6);
+        }
+    }
+}
+
+// ==========================================
+// 欄式結果檔 (Columnar Result Store)
+// ==========================================
+// 檔案配置：
+//   檔頭  "RPGCOL1\n"、欄位數、各欄 (名稱, 型別)
+//   資料  依列組 (row group) 依序存放，每組內各欄獨立編碼成一個區塊
+//   頁尾  列組數、各列組的列數與各欄區塊的 (位移, 長度)
+//   檔尾  頁尾位移 (8 bytes)
+// 編碼：整數欄存相鄰差值 (zigzag + varint)，字串欄用區塊內字典，整數列表欄存長度與各值
+
+namespace Columnar {
+    enum ColumnType { COL_INT, COL_STRING, COL_INT_LIST };
+    struct ColumnSpec { string name; ColumnType type; };
+    const char MAGIC[] = "RPGCOL1\n";
+    const size_t MAGIC_LEN = 8;
+
+    inline void putVarint(string& buf, uint64_t v) {
+        while (v >= 0x80) { buf.push_back((char)(v | 0x80)); v >>= 7; }
+        buf.push_back((char)v);
+    }
+    // 讀取 varint (超出 end 時停在 end，呼叫端以區塊長度保證不越界)
+    inline uint64_t getVarint(const uint8_t*& p, const uint8_t* end) {
+        uint64_t v = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7) {
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+    inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+    inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    // 串流寫入：只緩衝目前的列組，寫滿即編碼落盤 (記憶體用量與列組大小成正比)
+    class Writer {
+        struct Chunk { uint64_t offset, length; };
+        struct Group { uint64_t rows; vector<Chunk> chunks; };
+        ofstream file;
+        vector<ColumnSpec> schema;
+        int groupRows = 0;
+        int rows = 0;
+        uint64_t pos = 0;
+        vector<vector<int64_t>> ints;   // COL_INT 與 COL_INT_LIST 的值
+        vector<vector<int>> listLens;   // COL_INT_LIST 每列長度
+        vector<vector<string>> strs;    // COL_STRING 的值
+        vector<Group> groups;           // 頁尾索引
+        void write(const string& buf) { file.write(buf.data(), buf.size()); pos += buf.size(); }
+        string encode(int col) const;
+        void flushGroup();
+    public:
+        bool open(const string& path, const vector<ColumnSpec>& cols, int rowsPerGroup = 65536);
+        // 逐列寫入：先填完每一欄，再呼叫 endRow
+        void setInt(int col, int64_t v) { ints[col].push_back(v); }
+        void setString(int col, const string& v) { strs[col].push_back(v); }
+        void setList(int col, const vector<int>& v) {
+            listLens[col].push_back(v.size());
+            ints[col].insert(ints[col].end(), v.begin(), v.end());
+        }
+        void endRow() { if (++rows == groupRows) flushGroup(); }
+        bool close();
+        ~Writer() { if (file.is_open()) close(); }
+    };
+    // 開檔並寫入檔頭
+    bool Writer::open(const string& path, const vector<ColumnSpec>& cols, int rowsPerGroup) {
+        file.open(path.c_str(), ios::binary | ios::trunc);
+        if (!file) return false;
+        schema = cols;
+        groupRows = max(1, rowsPerGroup);
+        ints.assign(cols.size(), vector<int64_t>());
+        listLens.assign(cols.size(), vector<int>());
+        strs.assign(cols.size(), vector<string>());
+        string head(MAGIC, MAGIC_LEN);
+        putVarint(head, cols.size());
+        for (const auto& c : cols) {
+            putVarint(head, c.name.size());
+            head += c.name;
+            head.push_back((char)c.type);
+        }
+        write(head);
+        return true;
+    }
+    // 單欄編碼
+    string Writer::encode(int col) const {
+        string buf;
+        switch (schema[col].type) {
+            case COL_INT: {
+                int64_t prev = 0;
+                for (int64_t v : ints[col]) { putVarint(buf, zigzag(v - prev)); prev = v; }
+                break;
+            }
+            case COL_STRING: {
+                unordered_map<string, int> ids;
+                vector<const string*> dict;
+                string idx;
+                for (const auto& v : strs[col]) {
+                    auto it = ids.find(v);
+                    if (it == ids.end()) { it = ids.insert(make_pair(v, (int)dict.size())).first; dict.push_back(&it->first); }
+                    putVarint(idx, it->second);
+                }
+                putVarint(buf, dict.size());
+                for (const string* d : dict) { putVarint(buf, d->size()); buf += *d; }
+                buf += idx;
+                break;
+            }
+            case COL_INT_LIST: {
+                size_t k = 0;
+                for (int len : listLens[col]) {
+                    putVarint(buf, len);
+                    for (int i = 0; i < len; ++i) putVarint(buf, zigzag(ints[col][k++]));
+                }
+                break;
+            }
+        }
+        return buf;
+    }
+    // 寫出目前列組並清空緩衝
+    void Writer::flushGroup() {
+        if (rows == 0) return;
+        Group g;
+        g.rows = rows;
+        for (size_t c = 0; c < schema.size(); ++c) {
+            string buf = encode(c);
+            g.chunks.push_back({pos, buf.size()});
+            write(buf);
+            ints[c].clear(); listLens[c].clear(); strs[c].clear();
+        }
+        groups.push_back(g);
+        rows = 0;
+    }
+    // 寫出剩餘資料、頁尾與檔尾
+    bool Writer::close() {
+        flushGroup();
+        uint64_t footerPos = pos;
+        string foot;
+        putVarint(foot, groups.size());
+        for (const auto& g : groups) {
+            putVarint(foot, g.rows);
+            for (const auto& c : g.chunks) { putVarint(foot, c.offset); putVarint(foot, c.length); }
+        }
+        char tail[8];
+        memcpy(tail, &footerPos, 8);
+        foot.append(tail, 8);
+        write(foot);
+        file.close();
+        return !file.fail();
     }
 
+    // 記憶體映射讀取：只解析檔頭與頁尾，掃描單欄時只會觸及該欄的區塊
+    class Reader {
+        struct Chunk { uint64_t offset, length; };
+        struct Group { uint64_t rows; vector<Chunk> chunks; };
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        vector<uint8_t> buffer; // 不支援 mmap 的平台改為整檔讀入
+        vector<ColumnSpec> schema;
+        vector<Group> groups;
+        bool parse();
+        void unmap();
+    public:
+        bool open(const string& path);
+        ~Reader() { unmap(); }
+        const vector<ColumnSpec>& columns() const { return schema; }
+        int column(const string& name) const {
+            for (size_t i = 0; i < schema.size(); ++i) if (schema[i].name == name) return i;
+            return -1;
+        }
+        long long rows() const { long long n = 0; for (const auto& g : groups) n += g.rows; return n; }
+        template<class F> void scanInts(int col, F f) const;
+        template<class F> void scanStrings(int col, F f) const;
+        template<class F> void scanLists(int col, F f) const;
+    };
+    void Reader::unmap() {
+#ifndef _WIN32
+        if (data && buffer.empty()) munmap((void*)data, size);
+#endif
+        data = nullptr; size = 0; buffer.clear();
+    }
+    bool Reader::open(const string& path) {
+        unmap();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) { data = (const uint8_t*)m; size = st.st_size; }
+        }
+        ::close(fd);
+#else
+        ifstream in(path.c_str(), ios::binary);
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data(); size = buffer.size();
+#endif
+        if (!data || !parse()) { unmap(); return false; }
+        return true;
+    }
+    // 解析檔頭與頁尾，並檢查每個區塊都落在資料區內
+    bool Reader::parse() {
+        if (size < MAGIC_LEN + 8 || memcmp(data, MAGIC, MAGIC_LEN) != 0) return false;
+        uint64_t footerPos;
+        memcpy(&footerPos, data + size - 8, 8);
+        if (footerPos < MAGIC_LEN || footerPos > size - 8) return false;
+        const uint8_t* p = data + MAGIC_LEN;
+        const uint8_t* end = data + footerPos;
+        schema.assign(getVarint(p, end), ColumnSpec());
+        for (auto& c : schema) {
+            uint64_t len = getVarint(p, end);
+            if (len + 1 > (uint64_t)(end - p)) return false;
+            c.name.assign((const char*)p, len);
+            p += len;
+            c.type = (ColumnType)*p++;
+        }
+        p = data + footerPos;
+        end = data + size - 8;
+        groups.assign(getVarint(p, end), Group());
+        for (auto& g : groups) {
+            g.rows = getVarint(p, end);
+            for (size_t c = 0; c < schema.size(); ++c) {
+                Chunk ch = {getVarint(p, end), 0};
+                ch.length = getVarint(p, end);
+                if (ch.offset > footerPos || ch.length > footerPos - ch.offset) return false;
+                g.chunks.push_back(ch);
+            }
+        }
+        return p == end;
+    }
+    // 掃描整數欄：f(int64_t)
+    template<class F> void Reader::scanInts(int col, F f) const {
+        for (const auto& g : groups) {
+            const uint8_t* p = data + g.chunks[col].offset;
+            const uint8_t* end = p + g.chunks[col].length;
+            int64_t v = 0;
+            for (uint64_t r = 0; r < g.rows; ++r) { v += unzigzag(getVarint(p, end)); f(v); }
+        }
+    }
+    // 掃描字串欄：f(const string&)，字典每個區塊解一次
+    template<class F> void Reader::scanStrings(int col, F f) const {
+        vector<string> dict;
+        for (const auto& g : groups) {
+            const uint8_t* p = data + g.chunks[col].offset;
+            const uint8_t* end = p + g.chunks[col].length;
+            dict.assign(getVarint(p, end), string());
+            for (auto& d : dict) {
+                uint64_t len = min<uint64_t>(getVarint(p, end), end - p);
+                d.assign((const char*)p, len);
+                p += len;
+            }
+            for (uint64_t r = 0; r < g.rows; ++r) {
+                uint64_t idx = getVarint(p, end);
+                f(idx < dict.size() ? dict[idx] : string());
+            }
+        }
+    }
+    // 掃描整數列表欄：f(const vector<int64_t>&)
+    template<class F> void Reader::scanLists(int col, F f) const {
+        vector<int64_t> row;
+        for (const auto& g : groups) {
+            const uint8_t* p = data + g.chunks[col].offset;
+            const uint8_t* end = p + g.chunks[col].length;
+            for (uint64_t r = 0; r < g.rows; ++r) {
+                row.assign(min<uint64_t>(getVarint(p, end), end - p), 0);
+                for (auto& v : row) v = unzigzag(getVarint(p, end));
+                f(row);
+            }
+        }
+    }
+
+    // 模擬結果的欄位配置
+    enum SimColumn { SC_SEED, SC_PARTY, SC_LOCATION, SC_MONSTER, SC_WON, SC_ROUNDS, SC_SURVIVORS, SC_DAMAGE };
+    const vector<ColumnSpec> SIM_SCHEMA = {
+        {"seed", COL_INT}, {"party", COL_STRING}, {"location", COL_INT}, {"monster", COL_STRING},
+        {"won", COL_INT}, {"rounds", COL_INT}, {"survivors", COL_INT}, {"damage", COL_INT_LIST}
+    };
+}
+
+// ==========================================
+// 串流統計 (Streaming Quantiles)
+// ==========================================
+
+namespace Stats {
+    // 對數線性直方圖 (HDR 形式)：小於 2^SUB_BITS 的值精確計數，其上每個 2 的冪次區間
+    // 再切 2^(SUB_BITS-1) 格，相對誤差不超過 1/64；合併只需逐格相加，與樣本數無關
+    class Histogram {
+        static const int SUB_BITS = 7;
+        static const int HALF = 1 << (SUB_BITS - 1);
+        vector<uint64_t> counts;
+        uint64_t total = 0, sum = 0;
+        int64_t lo = 0, hi = 0;
+        static int indexOf(uint64_t v) {
+            if (v < (1u << SUB_BITS)) return (int)v;
+            int shift = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+            return shift * HALF + (int)(v >> shift);
+        }
+        // 格子涵蓋範圍 [lowerOf(i), lowerOf(i + 1))
+        static uint64_t lowerOf(int idx) {
+            if (idx < (1 << SUB_BITS)) return idx;
+            int shift = idx / HALF - 1;
+            return (uint64_t)(idx - shift * HALF) << shift;
+        }
+    public:
+        // 只記錄非負整數 (負值視為 0)
+        void add(int64_t value, uint64_t n = 1) {
+            uint64_t v = value < 0 ? 0 : value;
+            int idx = indexOf(v);
+            if (idx >= (int)counts.size()) counts.resize(idx + 1, 0);
+            counts[idx] += n;
+            if (total == 0 || (int64_t)v < lo) lo = v;
+            if (total == 0 || (int64_t)v > hi) hi = v;
+            total += n; sum += v * n;
+        }
+        void merge(const Histogram& o) {
+            if (o.total == 0) return;
+            if (counts.size() < o.counts.size()) counts.resize(o.counts.size(), 0);
+            for (size_t i = 0; i < o.counts.size(); ++i) counts[i] += o.counts[i];
+            lo = total ? std::min(lo, o.lo) : o.lo;
+            hi = total ? std::max(hi, o.hi) : o.hi;
+            total += o.total; sum += o.sum;
+        }
+        uint64_t count() const { return total; }
+        double mean() const { return total ? (double)sum / total : 0; }
+        int64_t min() const { return lo; }
+        int64_t max() const { return hi; }
+        // 分位數：取所在格子的中點 (並限制在實際最小、最大值之間)
+        int64_t quantile(double q) const {
+            if (total == 0) return 0;
+            uint64_t rank = (uint64_t)ceil(q * total);
+            if (rank < 1) rank = 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                seen += counts[i];
+                if (seen < rank) continue;
+                int64_t mid = (int64_t)((lowerOf(i) + lowerOf(i + 1) - 1) / 2);
+                return std::max(lo, std::min(hi, mid));
+            }
+            return hi;
+        }
+        // 序列化：總數、總和、最小、最大，接著只存非零格 (格號差值, 次數)
+        void save(string& buf) const {
+            Columnar::putVarint(buf, total);
+            Columnar::putVarint(buf, sum);
+            Columnar::putVarint(buf, lo);
+            Columnar::putVarint(buf, hi);
+            size_t nonzero = 0;
+            for (uint64_t c : counts) nonzero += c != 0;
+            Columnar::putVarint(buf, nonzero);
+            size_t prev = 0;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                if (!counts[i]) continue;
+                Columnar::putVarint(buf, i - prev);
+                Columnar::putVarint(buf, counts[i]);
+                prev = i;
+            }
+        }
+        bool load(const uint8_t*& p, const uint8_t* end) {
+            total = Columnar::getVarint(p, end);
+            sum = Columnar::getVarint(p, end);
+            lo = Columnar::getVarint(p, end);
+            hi = Columnar::getVarint(p, end);
+            counts.clear();
+            uint64_t nonzero = Columnar::getVarint(p, end), idx = 0, seen = 0;
+            for (uint64_t k = 0; k < nonzero && p < end; ++k) {
+                idx += Columnar::getVarint(p, end);
+                if (idx > (uint64_t)indexOf(~0ULL)) return false;
+                if (idx >= counts.size()) counts.resize(idx + 1, 0);
+                counts[idx] = Columnar::getVarint(p, end);
+                seen += counts[idx];
+            }
+            return seen == total;
+        }
+    };
+    const int Histogram::SUB_BITS;
+    const int Histogram::HALF;
+
+    // 每場戰鬥記錄的指標
+    enum Metric { M_DAMAGE_PER_ROUND, M_ROUNDS_TO_WIN, M_HP_LEFT_PCT, METRIC_COUNT };
+    const char* const METRIC_NAMES[] = {"每回合傷害", "獲勝回合數", "剩餘HP%"};
+
+    // 依 (地點, 怪物類型, 隊伍組成) 分組的指標集合，可跨執行緒與行程合併
+    class Collector {
+        map<string, vector<Histogram>> groups;
+    public:
+        static string keyOf(int location, const string& monster, const string& party) {
+            return to_string(location) + "|" + monster + "|" + party;
+        }
+        Histogram& at(const string& key, Metric m) {
+            vector<Histogram>& h = groups[key];
+            if (h.empty()) h.resize(METRIC_COUNT);
+            return h[m];
+        }
+        // 由一場戰鬥結果更新指標
+        void record(const string& key, const Party& team, const Sim::BattleResult& r) {
+            long long dealt = 0;
+            for (int d : r.damageDealt) dealt += d;
+            at(key, M_DAMAGE_PER_ROUND).add(dealt / max(1, r.rounds));
+            if (r.won) at(key, M_ROUNDS_TO_WIN).add(r.rounds);
+            long long hp = 0, maxHp = 0;
+            for (const auto* c : team) { hp += c->getHP(); maxHp += c->getMaxHP(); }
+            at(key, M_HP_LEFT_PCT).add(maxHp ? hp * 100 / maxHp : 0);
+        }
+        void merge(const Collector& o) {
+            for (const auto& kv : o.groups)
+                for (int m = 0; m < METRIC_COUNT; ++m) at(kv.first, (Metric)m).merge(kv.second[m]);
+        }
+        bool empty() const { return groups.empty(); }
+        // 序列化：分組數、各組 (鍵, 各指標直方圖)
+        void encode(string& buf) const {
+            Columnar::putVarint(buf, groups.size());
+            for (const auto& kv : groups) {
+                Columnar::putVarint(buf, kv.first.size());
+                buf += kv.first;
+                for (const auto& h : kv.second) h.save(buf);
+            }
+        }
+        // 讀入並合併到目前的集合
+        bool decode(const uint8_t*& p, const uint8_t* end) {
+            uint64_t n = Columnar::getVarint(p, end);
+            for (uint64_t i = 0; i < n; ++i) {
+                uint64_t len = Columnar::getVarint(p, end);
+                if (len > (uint64_t)(end - p)) return false;
+                string key((const char*)p, len);
+                p += len;
+                for (int m = 0; m < METRIC_COUNT; ++m) {
+                    Histogram h;
+                    if (!h.load(p, end)) return false;
+                    at(key, (Metric)m).merge(h);
+                }
+            }
+            return true;
+        }
+        // 檔案格式："RPGSTAT1" 接著 encode() 的內容
+        bool save(const string& path) const {
+            string buf = "RPGSTAT1";
+            encode(buf);
+            ofstream file(path.c_str(), ios::binary | ios::trunc);
+            file.write(buf.data(), buf.size());
+            return !file.fail();
+        }
+        bool load(const string& path) {
+            ifstream file(path.c_str(), ios::binary);
+            string buf((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            if (buf.compare(0, 8, "RPGSTAT1") != 0) return false;
+            const uint8_t* p = (const uint8_t*)buf.data() + 8;
+            const uint8_t* end = (const uint8_t*)buf.data() + buf.size();
+            return decode(p, end) && p == end;
+        }
+        void report(ostream& os) const {
+            for (const auto& kv : groups) {
+                os << "[" << kv.first << "]\n";
+                for (int m = 0; m < METRIC_COUNT; ++m) {
+                    const Histogram& h = kv.second[m];
+                    if (!h.count()) continue;
+                    os << "  " << METRIC_NAMES[m] << ": n=" << h.count() << " 平均=" << h.mean()
+                       << " p50=" << h.quantile(0.50) << " p95=" << h.quantile(0.95) << " p99=" << h.quantile(0.99)
+                       << " 最大=" << h.max() << "\n";
+                }
+            }
+        }
+    };
+}
+
+// ==========================================
+// 多行程分片模擬 (Sharded Simulation)
+// ==========================================
+
+// 分片工作：第 shard 個分片執行第 first 場起的 count 場，統計寫入 sum；輸出失敗時回傳 false
+typedef function<bool(int shard, long long first, long long count, Sim::Summary& sum)> ShardWork;
+
+#ifndef _WIN32
+namespace Shard {
+    // 共享記憶體中的分片結果 (子行程寫入後結束，協調者在 waitpid 之後讀取)
+    struct Slot {
+        int done;      // 子行程寫完結果後設為 1
+        int attempts;  // 已執行次數
+        Sim::Summary sum;
+    };
+    const int MAX_ATTEMPTS = 3;
+
+    // 協調者：場次切成 shards 段，最多同時 fork processes 個子行程執行；
+    // 內容表在 fork 前建好，子行程以寫入時複製共用。結果直接寫入共享記憶體，
+    // 異常結束 (被訊號終止、非零結束碼或未寫入結果，包含結果檔寫入失敗) 的分片重新排入，超過次數才放棄
+    bool run(long long battles, int shards, int processes, const ShardWork& work, Sim::Summary& total) {
+        Slot* slots = (Slot*)mmap(nullptr, sizeof(Slot) * shards, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (slots == MAP_FAILED) return false;
+        for (int k = 0; k < shards; ++k) slots[k] = Slot();
+        deque<int> pending;
+        for (int k = 0; k < shards; ++k) pending.push_back(k);
+        map<pid_t, int> running;
+        cout.flush(); cerr.flush(); // 避免子行程重複輸出緩衝區內容
+        bool ok = true;
+        while (!pending.empty() || !running.empty()) {
+            while (!pending.empty() && (int)running.size() < processes) {
+                int k = pending.front(); pending.pop_front();
+                long long first = battles * k / shards, count = battles * (k + 1) / shards - first;
+                slots[k].attempts++;
+                pid_t pid = fork();
+                if (pid == 0) {
+                    if (!work(k, first, count, slots[k].sum)) _exit(1); // 輸出失敗視同異常結束
+                    slots[k].done = 1;
+                    _exit(0);
+                }
+                if (pid < 0) { // 無法 fork 時就地執行
+                    if (work(k, first, count, slots[k].sum)) slots[k].done = 1;
+                    else ok = false;
+                    continue;
+                }
+                running[pid] = k;
+            }
+            if (running.empty()) continue;
+            int status = 0;
+            pid_t pid = waitpid(-1, &status, 0);
+            if (pid < 0) break;
+            auto it = running.find(pid);
+            if (it == running.end()) continue;
+            int k = it->second;
+            running.erase(it);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && slots[k].done) continue;
+            cerr << "分片 " << k << " 的子行程異常結束";
+            if (WIFSIGNALED(status)) cerr << " (訊號 " << WTERMSIG(status) << ")";
+            if (slots[k].attempts < MAX_ATTEMPTS) { cerr << "，重新執行\n"; pending.push_back(k); }
+            else { cerr << "，已放棄\n"; ok = false; }
+        }
+        for (int k = 0; k < shards; ++k) if (slots[k].done) total.merge(slots[k].sum);
+        munmap(slots, sizeof(Slot) * shards);
+        return ok && pending.empty() && running.empty();
+    }
+}
+#else
+namespace Shard {
+    // 此平台沒有 fork：整批在本行程執行
+    bool run(long long battles, int, int, const ShardWork& work, Sim::Summary& total) {
+        Sim::Summary sum;
+        bool ok = work(0, 0, battles, sum);
+        total.merge(sum);
+        return ok;
+    }
+}
+#endif
+
+// ==========================================
+// 檢查點 (Checkpoints)
+// ==========================================
+
+// 長時間模擬的進度保存：每個分片定期寫出「下一場的編號、已完成場數的統計與分位數直方圖」，
+// 重新啟動時由此接續。第 b 場固定使用亂數流 seed + b，接續後的結果與不中斷執行完全相同
+namespace Checkpoint {
+    const char MAGIC[] = "RPGCKPT1";
+    const size_t MAGIC_LEN = 8;
+
+    // 分片進度
+    struct State {
+        string job;             // 工作描述 (參數不同的檢查點不可接續)
+        long long first = 0;    // 分片第一場的編號
+        long long count = 0;    // 分片場數
+        long long done = 0;     // 已完成場數：下一場使用亂數流 seed + first + done
+        Sim::Summary sum;
+        Stats::Collector stats;
+        bool finished() const { return done >= count; }
+    };
+
+    string shardPath(const string& path, int shard) { return path + "." + to_string(shard); }
+
+    string encode(const State& st) {
+        string buf(MAGIC, MAGIC_LEN);
+        Columnar::putVarint(buf, st.job.size());
+        buf += st.job;
+        Columnar::putVarint(buf, st.first); Columnar::putVarint(buf, st.count); Columnar::putVarint(buf, st.done);
+        Columnar::putVarint(buf, st.sum.battles); Columnar::putVarint(buf, st.sum.wins);
+        Columnar::putVarint(buf, st.sum.rounds); Columnar::putVarint(buf, st.sum.survivors);
+        st.stats.encode(buf);
+        return buf;
+    }
+    // 讀取檢查點 (檔案不存在或格式不符時回傳 false)
+    bool load(const string& path, State& st) {
+        ifstream file(path.c_str(), ios::binary);
+        if (!file) return false;
+        string buf((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        if (buf.size() < MAGIC_LEN || buf.compare(0, MAGIC_LEN, MAGIC) != 0) return false;
+        const uint8_t* p = (const uint8_t*)buf.data() + MAGIC_LEN;
+        const uint8_t* end = (const uint8_t*)buf.data() + buf.size();
+        uint64_t len = Columnar::getVarint(p, end);
+        if (len > (uint64_t)(end - p)) return false;
+        st = State();
+        st.job.assign((const char*)p, len);
+        p += len;
+        st.first = Columnar::getVarint(p, end); st.count = Columnar::getVarint(p, end); st.done = Columnar::getVarint(p, end);
+        st.sum.battles = Columnar::getVarint(p, end); st.sum.wins = Columnar::getVarint(p, end);
+        st.sum.rounds = Columnar::getVarint(p, end); st.sum.survivors = Columnar::getVarint(p, end);
+        return st.stats.decode(p, end) && p == end && st.done <= st.count && st.sum.battles == st.done;
+    }
+
+    // 先寫暫存檔並同步到磁碟，再以 rename 取代舊檔：中途被終止時舊檔仍完整
+    bool writeAtomic(const string& path, const string& data) {
+        string tmp = path + ".tmp";
+#ifndef _WIN32
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        size_t off = 0;
+        while (off < data.size()) {
+            ssize_t n = write(fd, data.data() + off, data.size() - off);
+            if (n <= 0) { close(fd); return false; }
+            off += n;
+        }
+        bool ok = fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+#else
+        {
+            ofstream file(tmp.c_str(), ios::binary | ios::trunc);
+            file.write(data.data(), data.size());
+            if (!file) return false;
+        }
+        remove(path.c_str()); // 此平台的 rename 不覆蓋既有檔案
+        return rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+    }
+
+    // 背景寫入：計時到期後設旗標，工作端在批次之間看到旗標才複製一次狀態交出，
+    // 編碼與寫檔 (含 fsync) 都在背景執行緒進行，工作端平時只多一次原子讀取
+    class Writer {
+        string path;
+        chrono::milliseconds interval;
+        thread worker;
+        mutex lock;
+        condition_variable wake;
+        atomic<bool> wanted{false};
+        State pending;
+        bool hasPending = false, stopping = false;
+        void loop() {
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                if (!hasPending && !stopping && !wake.wait_for(guard, interval, [&] { return hasPending || stopping; })) wanted = true;
+                if (hasPending) {
+                    State st;
+                    swap(st, pending);
+                    hasPending = false;
+                    guard.unlock();
+                    if (!writeAtomic(path, encode(st))) cerr << "無法寫入檢查點 " << path << "\n";
+                    guard.lock();
+                    continue;
+                }
+                if (stopping) break;
+            }
+        }
+    public:
+        Writer(const string& p, double seconds) : path(p), interval((long long)(seconds * 1000)) { worker = thread(&Writer::loop, this); }
+        ~Writer() { stop(); }
+        bool due() const { return wanted.load(memory_order_relaxed); }
+        void offer(const State& st) {
+            lock_guard<mutex> guard(lock);
+            pending = st;
+            hasPending = true;
+            wanted = false;
+            wake.notify_one();
+        }
+        // 交出最後狀態並等待寫完
+        void stop() {
+            if (!worker.joinable()) return;
+            { lock_guard<mutex> guard(lock); stopping = true; }
+            wake.notify_one();
+            worker.join();
+        }
+    };
+}
+
+// ==========================================
+// 難度調校 (Difficulty Tuner)
+// ==========================================
+
+namespace Tune {
+    // 調校目標：某地點的一般戰 (或該地點的 BOSS 單挑) 期望的勝率與平均回合數
+    struct Target {
+        int location;
+        bool boss;
+        double winRate;  // 0~1
+        double rounds;
+        int level;       // 模擬隊伍等級
+    };
+    // 調校設定
+    struct Config {
+        vector<int> party = {0, 1, 7, 11};
+        int enemies = 1;           // 一般戰每場敵人數
+        long long battles = 300;   // 每個目標每次評分的場數
+        int generations = 40;
+        int population = 24;       // 每代候選數 (λ)
+        int elites = 6;            // 更新分佈用的菁英數 (μ)
+        int threads = 0;           // 0 表示使用全部核心
+        uint64_t seed = 1;
+    };
+
+    // 參數向量：前段為各地點的 enemyStatMod，後段為各 BOSS 的 HP 倍率
+    const double STAT_MOD_RANGE[2] = {0.3, 6.0};
+    const double BOSS_HP_RANGE[2] = {1.0, 10.0};
+    bool isBossGene(int i) { return i >= (int)LOCATIONS.size(); }
+    double clampGene(int i, double v) {
+        const double* r = isBossGene(i) ? BOSS_HP_RANGE : STAT_MOD_RANGE;
+        return max(r[0], min(r[1], v));
+    }
+    vector<double> currentGenome() {
+        vector<double> g;
+        for (const auto& loc : LOCATIONS) g.push_back(loc.enemyStatMod);
+        for (const auto& b : BOSSES) g.push_back(b.hpMul);
+        return g;
+    }
+    vector<Location> locationsOf(const vector<double>& g) {
+        vector<Location> locs = LOCATIONS;
+        for (size_t i = 0; i < locs.size(); ++i) locs[i].enemyStatMod = g[i];
+        return locs;
+    }
+    vector<BossSpec> bossesOf(const vector<double>& g) {
+        vector<BossSpec> bosses = BOSSES;
+        for (size_t i = 0; i < bosses.size(); ++i) bosses[i].hpMul = g[LOCATIONS.size() + i];
+        return bosses;
+    }
+    // 只有被某個目標用到的參數才參與搜尋，其餘維持原值 (一般戰的首隻也可能是該地點的 BOSS)
+    vector<bool> activeGenes(const vector<Target>& targets) {
+        vector<bool> active(LOCATIONS.size() + BOSSES.size(), false);
+        for (const auto& t : targets) {
+            active[t.location] = true;
+            for (size_t i = 0; i < BOSSES.size(); ++i) if (BOSSES[i].locationId == t.location) active[LOCATIONS.size() + i] = true;
+        }
+        return active;
+    }
+
+    // 以指定參數模擬一個目標 (每個呼叫自建遭遇表，不碰全域狀態，可在任意執行緒執行)
+    Sim::Summary simulate(const vector<double>& g, const Target& t, const Config& cfg, long long battles, uint64_t seed) {
+        vector<Location> locs = locationsOf(g);
+        vector<BossSpec> bosses = bossesOf(g);
+        GameState fresh = freshState();
+        EncounterTable table;
+        table.build(locs[t.location], fresh, bosses);
+        if (t.boss && !table.hasBoss()) return Sim::Summary();
+        return Sim::runBatch(cfg.party, t.level, battles, seed, [&](const Party& team) {
+            EnemyGroup wave;
+            // 一般戰與實際遊戲 (generateWave) 相同：首隻依一般規則 (可能是 BOSS)，其餘為小怪與菁英
+            if (t.boss) wave.add(table.spawnBoss(team.averagePower()));
+            else {
+                wave.add(table.spawn(team.averagePower()));
+                for (int i = 1; i < cfg.enemies; ++i) wave.add(table.spawnMinion(team.averagePower()));
+            }
+            return wave;
+        }, Sim::Options());
+    }
+    // 誤差：勝率每差 5 個百分點、回合數每差 10% 各計 1，取平方和
+    double loss(const Target& t, const Sim::Summary& s) {
+        double w = (s.winRate() - t.winRate) / 0.05;
+        double r = (s.avgRounds() - t.rounds) / (t.rounds * 0.10);
+        return w * w + r * r;
+    }
+
+    int threadCount(const Config& cfg) {
+        int n = cfg.threads > 0 ? cfg.threads : (int)thread::hardware_concurrency();
+        return max(1, n);
+    }
+    // 平行評分：(候選, 目標) 攤平成工作項目，各執行緒以原子計數器領取；
+    // 所有候選使用相同種子 (共同亂數)，分數差異只來自參數本身
+    vector<double> scoreAll(const vector<vector<double>>& pop, const vector<Target>& targets, const Config& cfg) {
+        size_t jobs = pop.size() * targets.size();
+        vector<double> part(jobs, 0);
+        atomic<size_t> nextJob(0);
+        auto worker = [&]() {
+            for (size_t j = nextJob++; j < jobs; j = nextJob++) {
+                const Target& t = targets[j % targets.size()];
+                part[j] = loss(t, simulate(pop[j / targets.size()], t, cfg, cfg.battles, cfg.seed));
+            }
+        };
+        vector<thread> pool;
+        for (int i = 1; i < threadCount(cfg); ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& th : pool) th.join();
+        vector<double> score(pop.size(), 0);
+        for (size_t j = 0; j < jobs; ++j) score[j / targets.size()] += part[j];
+        return score;
+    }
+
+    // 標準常態亂數 (Box-Muller)
+    double gaussian(RngStream& rng) {
+        double u1 = ((rng.next() >> 11) + 1) / 9007199254740992.0; // (0, 1]
+        double u2 = (rng.next() >> 11) / 9007199254740992.0;
+        return sqrt(-2.0 * log(u1)) * cos(2.0 * acos(-1.0) * u2);
+    }
+
+    // 演化搜尋 (對角共變異數的 (μ,λ) 演化策略)：每代以常態分佈取樣候選，
+    // 中心移到前 μ 名的加權平均，各維步長取菁英相對舊中心的離散程度
+    vector<double> optimize(const vector<Target>& targets, const Config& cfg, ostream& progress) {
+        vector<double> mean = currentGenome();
+        vector<bool> active = activeGenes(targets);
+        int dim = mean.size();
+        int mu = max(1, min(cfg.elites, cfg.population));
+        vector<double> sigma(dim, 0);
+        for (int i = 0; i < dim; ++i) if (active[i]) sigma[i] = mean[i] * 0.2;
+        // 重組權重：名次越前權重越大
+        vector<double> weight(mu);
+        double wsum = 0;
+        for (int k = 0; k < mu; ++k) wsum += weight[k] = log(mu + 0.5) - log(k + 1.0);
+        for (auto& w : weight) w /= wsum;
+
+        RngStream rng(cfg.seed * 0x9E3779B97F4A7C15ULL + 1);
+        vector<double> best = mean;
+        double bestScore = scoreAll(vector<vector<double>>(1, mean), targets, cfg)[0];
+        progress << "初始誤差: " << bestScore << "\n";
+        for (int gen = 0; gen < cfg.generations; ++gen) {
+            vector<vector<double>> pop(cfg.population, mean);
+            for (auto& c : pop) for (int i = 0; i < dim; ++i) if (active[i]) c[i] = clampGene(i, mean[i] + sigma[i] * gaussian(rng));
+            vector<double> score = scoreAll(pop, targets, cfg);
+            vector<int> order(pop.size());
+            for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+            sort(order.begin(), order.end(), [&](int a, int b) { return score[a] < score[b]; });
+            if (score[order[0]] < bestScore) { bestScore = score[order[0]]; best = pop[order[0]]; }
+            for (int i = 0; i < dim; ++i) {
+                if (!active[i]) continue;
+                double m = 0, var = 0;
+                for (int k = 0; k < mu; ++k) {
+                    double v = pop[order[k]][i];
+                    m += weight[k] * v;
+                    var += weight[k] * (v - mean[i]) * (v - mean[i]);
+                }
+                // 步長下限避免過早收斂 (模擬本身有雜訊)
+                sigma[i] = max(sqrt(var), 0.01 * m);
+                mean[i] = m;
+            }
+            progress << "第 " << gen + 1 << " 代 | 本代最佳: " << score[order[0]] << " | 歷來最佳: " << bestScore << "\n";
+        }
+        return best;
+    }
+
+    // 擊敗旗標的原始碼名稱
+    const char* flagName(bool GameState::* f) {
+        if (f == &GameState::boss_Kir) return "&GameState::boss_Kir";
+        if (f == &GameState::boss_Vermouth) return "&GameState::boss_Vermouth";
+        if (f == &GameState::boss_Vodka) return "&GameState::boss_Vodka";
+        if (f == &GameState::boss_Gin) return "&GameState::boss_Gin";
+        return "nullptr";
+    }
+    // 輸出可直接貼回原始碼的參數表
+    void printTable(const vector<double>& g, ostream& os) {
+        vector<Location> locs = locationsOf(g);
+        vector<BossSpec> bosses = bossesOf(g);
+        os << fixed << setprecision(2);
+        os << "const vector<Location> LOCATIONS = {\n";
+        for (size_t i = 0; i < locs.size(); ++i) {
+            const Location& l = locs[i];
+            os << "    {" << l.id << ", \"" << l.name << "\", \"" << l.description << "\", " << l.enemyStatMod << ", "
+               << l.moneyDropMod << ", " << l.investigationBonus << ", " << l.requiredChapter << "}" << (i + 1 < locs.size() ? "," : "") << "\n";
+        }
+        os << "};\n";
+        os << "const vector<BossSpec> BOSSES = {\n";
+        for (size_t i = 0; i < bosses.size(); ++i) {
+            const BossSpec& b = bosses[i];
+            os << "    {" << b.locationId << ", \"" << b.name << "\", " << b.spawnRate << ", " << b.hpMul << ", " << b.atkMul << ", "
+               << b.moneyMul << ", " << flagName(b.defeated) << "}" << (i + 1 < bosses.size() ? "," : "") << "\n";
+        }
+        os << "};\n";
+        os.unsetf(ios::fixed);
+        os << setprecision(6);
+    }
+}
+
+// ==========================================
+// 組合探索 (Party Explorer)
+// ==========================================
+
+// 窮舉隊伍組合並以批次模擬評估；以信賴區間提早淘汰明顯落後的組合，結果依內容簽章存入磁碟快取
+namespace Explore {
+    // 戰鬥規則 (無法由資料簽章涵蓋的程式邏輯) 改變時遞增，使所有快取失效
+    const int RULES_VERSION = 2;
+    const char MAGIC[] = "RPGMEMO1";
+    const size_t MAGIC_LEN = 8;
+
+    // 探索設定
+    struct Config {
+        vector<int> pool;             // 可選角色編號
+        int size = 3;                 // 隊伍人數
+        int enemies = 1;              // 每場敵人數
+        long long batch = 100;        // 每輪每個組合追加的場數
+        long long maxBattles = 2000;  // 單一組合的場數上限
+        int top = 10;                 // 保留名次 (0 表示不淘汰)
+        double z = 3.0;               // 信賴區間的 z 值
+        double precision = 0.02;      // 勝率區間半寬低於此值即停止
+        int threads = 0;              // 0 表示使用全部核心
+        uint64_t seed = 1;
+    };
+    // 候選組合
+    struct Candidate {
+        vector<int> ids;
+        uint64_t key = 0;
+        Sim::Summary sum;
+        long long cachedBattles = 0; // 由快取取得的場數
+        bool pruned = false;
+    };
+
+    // FNV-1a 雜湊
+    struct Hasher {
+        uint64_t h = 1469598103934665603ULL;
+        void bytes(const void* data, size_t len) {
+            const uint8_t* p = (const uint8_t*)data;
+            for (size_t i = 0; i < len; ++i) { h ^= p[i]; h *= 1099511628211ULL; }
+        }
+        void num(int64_t v) { bytes(&v, sizeof(v)); }
+        void real(double v) { bytes(&v, sizeof(v)); }
+        void str(const string& s) { num(s.size()); bytes(s.data(), s.size()); }
+    };
+    // 角色簽章：該等級下的屬性與所有技能參數
+    void hashCharacter(Hasher& h, const Character& c) {
+        h.str(c.getName());
+        h.num(c.getHP()); h.num(c.getMaxHP()); h.num(c.getAttack()); h.num(c.getKnowledge());
+        h.num(c.getLuck()); h.num(c.getSpeed()); h.num(c.getLevel());
+        for (auto* s : c.getSkills()) h.str(s->signature());
+    }
+    // 地點簽章：地點修正、該地點的 BOSS 設定、小怪名單，以及此隊伍實際遭遇的怪物屬性
+    void hashLocation(Hasher& h, const Location& loc, EncounterTable& table, int avgStr) {
+        h.str(loc.name); h.real(loc.enemyStatMod); h.real(loc.moneyDropMod);
+        for (const auto& b : BOSSES) {
+            if (b.locationId != loc.id) continue;
+            h.str(b.name); h.num(b.spawnRate); h.real(b.hpMul); h.real(b.atkMul); h.num(b.moneyMul);
+        }
+        for (const auto& n : ELITE_NAMES) h.str(n);
+        for (const auto& n : NORMAL_NAMES) h.str(n);
+        h.num(ELITE_RATE);
+        for (const auto& st : table.statsFor(avgStr)) { h.num(st.hp); h.num(st.atk); h.num(st.speed); }
+    }
+
+    // 磁碟快取：鍵 → 累計統計 (舊鍵保留，平衡調回原值時可直接命中)
+    class Cache {
+        unordered_map<uint64_t, Sim::Summary> entries;
+        string path;
+    public:
+        explicit Cache(const string& p) : path(p) {}
+        bool load() {
+            ifstream in(path, ios::binary);
+            if (!in) return true; // 尚無快取
+            string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            if (data.size() < MAGIC_LEN || data.compare(0, MAGIC_LEN, MAGIC) != 0) return false;
+            const uint8_t* p = (const uint8_t*)data.data() + MAGIC_LEN;
+            const uint8_t* end = (const uint8_t*)data.data() + data.size();
+            while (p < end) {
+                uint64_t key = Columnar::getVarint(p, end);
+                Sim::Summary s;
+                s.battles = Columnar::getVarint(p, end); s.wins = Columnar::getVarint(p, end);
+                s.rounds = Columnar::getVarint(p, end); s.survivors = Columnar::getVarint(p, end);
+                entries[key] = s;
+            }
+            return true;
+        }
+        bool save() const {
+            string buf(MAGIC, MAGIC_LEN);
+            for (const auto& e : entries) {
+                Columnar::putVarint(buf, e.first);
+                Columnar::putVarint(buf, e.second.battles); Columnar::putVarint(buf, e.second.wins);
+                Columnar::putVarint(buf, e.second.rounds); Columnar::putVarint(buf, e.second.survivors);
+            }
+            return Checkpoint::writeAtomic(path, buf); // 寫到一半被終止時保留舊快取
+        }
+        Sim::Summary find(uint64_t key) const { auto it = entries.find(key); return it == entries.end() ? Sim::Summary() : it->second; }
+        void put(uint64_t key, const Sim::Summary& s) { entries[key] = s; }
+        size_t size() const { return entries.size(); }
+    };
+
+    // Wilson 信賴區間 (場數少時比常態近似穩定)
+    void wilson(const Sim::Summary& s, double z, double& lo, double& hi) {
+        if (s.battles == 0) { lo = 0; hi = 1; return; }
+        double n = s.battles, p = s.winRate(), z2 = z * z;
+        double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+        double half = z * sqrt(p * (1 - p) / n + z2 / (4 * n * n)) / (1 + z2 / n);
+        lo = max(0.0, center - half); hi = min(1.0, center + half);
+    }
+    bool finished(const Candidate& c, const Config& cfg) {
+        if (c.sum.battles >= cfg.maxBattles) return true;
+        double lo, hi;
+        wilson(c.sum, cfg.z, lo, hi);
+        return c.sum.battles > 0 && (hi - lo) / 2 < cfg.precision;
+    }
+    // 排名：勝率高者優先，同勝率回合少者優先
+    bool better(const Candidate& a, const Candidate& b) {
+        if (a.sum.winRate() != b.sum.winRate()) return a.sum.winRate() > b.sum.winRate();
+        return a.sum.avgRounds() < b.sum.avgRounds();
+    }
+
+    // 從 pool 中取 k 人的所有組合 (編號遞增)
+    vector<vector<int>> combinations(const vector<int>& pool, int k) {
+        vector<vector<int>> all;
+        int n = pool.size();
+        if (k < 1 || k > n) return all;
+        vector<int> idx(k);
+        for (int i = 0; i < k; ++i) idx[i] = i;
+        while (true) {
+            vector<int> ids(k);
+            for (int i = 0; i < k; ++i) ids[i] = pool[idx[i]];
+            all.push_back(ids);
+            int i = k - 1;
+            while (i >= 0 && idx[i] == n - k + i) --i;
+            if (i < 0) break;
+            ++idx[i];
+            for (int j = i + 1; j < k; ++j) idx[j] = idx[j - 1] + 1;
+        }
+        return all;
+    }
+
+    // 追加一批模擬：第 k 場固定使用亂數流 seed + k，快取的累計結果可直接接續
+    Sim::Summary extend(const Candidate& c, const Location& loc, int level, const Config& cfg, long long battles) {
+        GameState fresh = freshState();
+        EncounterTable table;
+        table.build(loc, fresh);
+        return Sim::runBatch(c.ids, level, battles, cfg.seed + c.sum.battles, [&](const Party& team) {
+            // 與實際遊戲 (generateWave) 相同：首隻依一般規則 (可能是 BOSS，因此 BOSS 設定也在快取鍵內)，其餘為小怪與菁英
+            EnemyGroup wave;
+            wave.add(table.spawn(team.averagePower()));
+            for (int i = 1; i < cfg.enemies; ++i) wave.add(table.spawnMinion(team.averagePower()));
+            return wave;
+        }, Sim::Options());
+    }
+
+    // 建立一個 (地點, 等級) 的候選清單並由快取填入已知結果
+    vector<Candidate> prepare(const Location& loc, int level, const Config& cfg, const Cache& cache) {
+        GameState fresh = freshState();
+        EncounterTable table;
+        table.build(loc, fresh);
+        vector<Candidate> cands;
+        for (const auto& ids : combinations(cfg.pool, cfg.size)) {
+            Candidate c;
+            c.ids = ids;
+            Hasher h;
+            h.num(RULES_VERSION); h.num(cfg.enemies); h.num((int64_t)cfg.seed); h.num(Sim::Options().maxRounds);
+            Party team;
+            Sim::buildParty(team, ids, level);
+            for (auto* m : team) hashCharacter(h, *m);
+            hashLocation(h, loc, table, team.averagePower());
+            for (auto* m : team.release()) delete m;
+            c.key = h.h;
+            c.sum = cache.find(c.key);
+            c.cachedBattles = c.sum.battles;
+            cands.push_back(c);
+        }
+        return cands;
+    }
+
+    // 逐輪評估：淘汰上界低於第 K 名下界的組合，其餘尚未收斂者各追加一批 (平行)
+    void evaluate(vector<Candidate>& cands, const Location& loc, int level, const Config& cfg, ostream& progress) {
+        int threads = max(1, cfg.threads > 0 ? cfg.threads : (int)thread::hardware_concurrency());
+        for (int round = 1; ; ++round) {
+            if (cfg.top > 0 && (int)cands.size() > cfg.top) {
+                vector<double> lows;
+                for (const auto& c : cands) { double lo, hi; wilson(c.sum, cfg.z, lo, hi); lows.push_back(lo); }
+                nth_element(lows.begin(), lows.begin() + cfg.top - 1, lows.end(), greater<double>());
+                double bar = lows[cfg.top - 1];
+                for (auto& c : cands) {
+                    double lo, hi;
+                    wilson(c.sum, cfg.z, lo, hi);
+                    if (hi < bar) c.pruned = true;
+                }
+            }
+            vector<Candidate*> active;
+            for (auto& c : cands) if (!c.pruned && !finished(c, cfg)) active.push_back(&c);
+            if (active.empty()) break;
+            progress << "  第 " << round << " 輪 | 評估中: " << active.size() << "\n";
+            vector<Sim::Summary> part(active.size());
+            atomic<size_t> nextJob(0);
+            auto worker = [&]() {
+                for (size_t j = nextJob++; j < active.size(); j = nextJob++) {
+                    long long n = min(cfg.batch, cfg.maxBattles - active[j]->sum.battles);
+                    part[j] = extend(*active[j], loc, level, cfg, n);
+                }
+            };
+            vector<thread> pool;
+            for (int i = 1; i < threads; ++i) pool.emplace_back(worker);
+            worker();
+            for (auto& th : pool) th.join();
+            for (size_t j = 0; j < active.size(); ++j) active[j]->sum.merge(part[j]);
+        }
+    }
+}
+
+// ==========================================
+// 串流評估 (Scenario Stream)
+// ==========================================
+
+// 由標準輸入逐行讀取情境，多執行緒評估後逐行寫到標準輸出；
+// 同時處理中的情境數有上限 (讀取端在額滿時等待)，輸入再長記憶體用量也固定
+// 情境格式 (以空白分隔的 key=value，# 開頭為註解)：
+//   id=a1 party=0,1,7 level=5 levels=5,5,3 location=1 monsters=spawn,minion*2,300/40/10 seed=1 reps=1000
+namespace Stream {
+    // 怪物規格：依地點遭遇規則生成、只抽隨從、該地點 BOSS，或直接指定 HP/攻擊/速度
+    enum MonsterKind { M_SPAWN, M_MINION, M_BOSS, M_CUSTOM };
+    struct MonsterSpec { MonsterKind kind; int hp, atk, speed; };
+
+    struct Scenario {
+        string id;
+        vector<int> ids, levels;
+        int location = 1;
+        vector<MonsterSpec> monsters;
+        uint64_t seed = 1;
+        long long reps = 1000;
+        string error; // 解析或評估失敗的原因 (照樣依序輸出)
+    };
+
+    // 怪物規格清單：項目以逗號分隔，可加 *N 重複
+    bool parseMonsters(const string& text, vector<MonsterSpec>& out, string& error) {
+        for (const auto& item : splitList(text, ',')) {
+            string name = item;
+            int repeat = 1;
+            size_t star = item.find('*');
+            if (star != string::npos) { name = item.substr(0, star); repeat = atoi(item.c_str() + star + 1); }
+            MonsterSpec m = {M_SPAWN, 0, 0, 0};
+            if (name == "minion") m.kind = M_MINION;
+            else if (name == "boss") m.kind = M_BOSS;
+            else if (name != "spawn") {
+                vector<string> f = splitList(name, '/');
+                m.kind = M_CUSTOM;
+                if (f.size() != 3 || (m.hp = atoi(f[0].c_str())) <= 0 || (m.atk = atoi(f[1].c_str())) < 0) { error = "無法解析怪物: " + item; return false; }
+                m.speed = atoi(f[2].c_str());
+            }
+            if (repeat < 1 || repeat > 16) { error = "怪物數量須為 1~16: " + item; return false; }
+            out.insert(out.end(), repeat, m);
+        }
+        if (out.empty()) out.push_back({M_SPAWN, 0, 0, 0});
+        return true;
+    }
+
+    // 解析一行情境 (未給 id 時以行號代替)
+    Scenario parse(const string& line, long long lineNo) {
+        Scenario s;
+        s.id = to_string(lineNo);
+        istringstream in(line);
+        string field;
+        int level = 5;
+        while (in >> field) {
+            size_t eq = field.find('=');
+            string key = field.substr(0, eq), value = eq == string::npos ? "" : field.substr(eq + 1);
+            if (key == "id") s.id = value;
+            else if (key == "party") s.ids = parseIntList(value);
+            else if (key == "level") level = atoi(value.c_str());
+            else if (key == "levels") s.levels = parseIntList(value);
+            else if (key == "location") s.location = atoi(value.c_str());
+            else if (key == "seed") s.seed = strtoull(value.c_str(), nullptr, 10);
+            else if (key == "reps") s.reps = atoll(value.c_str());
+            else if (key == "monsters") { if (!parseMonsters(value, s.monsters, s.error)) return s; }
+            else { s.error = "未知欄位: " + key; return s; }
+        }
+        if (s.ids.empty()) s.ids = {0, 1, 7, 11};
+        if (s.levels.empty()) s.levels.assign(s.ids.size(), level);
+        if (s.monsters.empty()) s.monsters.push_back({M_SPAWN, 0, 0, 0});
+        for (int id : s.ids) if (id < 0 || id >= CHARACTER_COUNT) s.error = "角色編號錯誤: " + to_string(id);
+        for (int lv : s.levels) if (lv < 1) s.error = "等級錯誤: " + to_string(lv);
+        if (s.levels.size() != s.ids.size()) s.error = "levels 與 party 人數不同";
+        if (s.location < 0 || s.location >= (int)LOCATIONS.size()) s.error = "地點編號錯誤: " + to_string(s.location);
+        if (s.reps < 1) s.error = "reps 須為正數";
+        return s;
+    }
+
+    // 評估一個情境；tables 為呼叫端執行緒自己的遭遇表 (依地點索引，初始章節、BOSS 未擊敗)
+    string evaluate(Scenario& s, vector<EncounterTable>& tables, const Sim::Options& opt) {
+        if (s.error.empty()) {
+            EncounterTable& table = tables[s.location];
+            if (!table.built) {
+                GameState fresh = freshState();
+                table.build(LOCATIONS[s.location], fresh);
+            }
+            for (const auto& m : s.monsters) if (m.kind == M_BOSS && !table.hasBoss()) s.error = "此地點沒有 BOSS";
+        }
+        if (!s.error.empty()) return "id=" + s.id + " error=" + s.error;
+        EncounterTable& table = tables[s.location];
+        Sim::Summary sum = Sim::runBatch(s.ids, s.levels, s.reps, s.seed, [&](const Party& team) {
+            EnemyGroup wave;
+            for (const auto& m : s.monsters) {
+                if (m.kind == M_SPAWN) wave.add(table.spawn(team.averagePower()));
+                else if (m.kind == M_MINION) wave.add(table.spawnMinion(team.averagePower()));
+                else if (m.kind == M_BOSS) wave.add(table.spawnBoss(team.averagePower()));
+                else wave.add(Monster("自訂怪物", m.hp, m.atk, NORMAL, 0, m.speed));
+            }
+            return wave;
+        }, opt);
+        // id 長度不限，以字串串流組出整行 (固定緩衝區會截斷長 id)
+        ostringstream os;
+        os << "id=" << s.id << " battles=" << sum.battles << " wins=" << sum.wins << fixed
+           << setprecision(4) << " win_rate=" << sum.winRate() << setprecision(3)
+           << " avg_rounds=" << sum.avgRounds() << " avg_survivors=" << sum.avgSurvivors();
+        return os.str();
+    }
+
+    struct Config {
+        int threads = 0;     // 0 表示使用全部核心
+        int inflight = 0;    // 同時處理中的情境上限 (0 表示執行緒數的兩倍)
+        bool ordered = false; // 依輸入順序輸出 (否則完成即輸出)
+    };
+
+    // 讀取端把情境放進有界佇列，工作執行緒取出評估；
+    // 依序輸出時，先完成的結果暫存到前面的情境輸出為止 (暫存數同樣受處理中上限限制)
+    class Pipeline {
+        const Config cfg;
+        istream& in;
+        ostream& os;
+        mutex lock;
+        condition_variable room, work;
+        deque<pair<long long, Scenario>> queue;
+        map<long long, string> pending;
+        long long nextOut = 0;
+        int inflight = 0;
+        bool closed = false;
+    public:
+        long long records = 0, errors = 0;
+        Pipeline(const Config& c, istream& i, ostream& o) : cfg(c), in(i), os(o) {}
+
+        // 在持有鎖時輸出結果並釋出處理中名額
+        void emit(long long seq, const string& text) {
+            if (!cfg.ordered) { os << text << '\n'; inflight--; }
+            else {
+                pending[seq] = text;
+                for (auto it = pending.begin(); it != pending.end() && it->first == nextOut; it = pending.erase(it), nextOut++, inflight--)
+                    os << it->second << '\n';
+            }
+            os.flush();
+            room.notify_one();
+        }
+        void worker() {
+            vector<EncounterTable> tables(LOCATIONS.size());
+            Sim::Options opt;
+            unique_lock<mutex> guard(lock);
+            while (true) {
+                work.wait(guard, [&] { return closed || !queue.empty(); });
+                if (queue.empty()) return;
+                pair<long long, Scenario> job = move(queue.front());
+                queue.pop_front();
+                guard.unlock();
+                bool failed = !job.second.error.empty();
+                string text = evaluate(job.second, tables, opt);
+                failed = failed || !job.second.error.empty();
+                guard.lock();
+                errors += failed;
+                emit(job.first, text);
+            }
+        }
+        void run() {
+            int threads = max(1, cfg.threads > 0 ? cfg.threads : (int)thread::hardware_concurrency());
+            int limit = cfg.inflight > 0 ? cfg.inflight : threads * 2;
+            vector<thread> pool;
+            for (int i = 0; i < threads; ++i) pool.emplace_back([this] { worker(); });
+            string line;
+            long long lineNo = 0;
+            while (getline(in, line)) {
+                lineNo++;
+                size_t start = line.find_first_not_of(" \t\r");
+                if (start == string::npos || line[start] == '#') continue;
+                Scenario s = parse(line, lineNo);
+                unique_lock<mutex> guard(lock);
+                room.wait(guard, [&] { return inflight < limit; });
+                inflight++;
+                queue.emplace_back(records++, move(s));
+                work.notify_one();
+            }
+            { lock_guard<mutex> guard(lock); closed = true; }
+            work.notify_all();
+            for (auto& th : pool) th.join();
+        }
+    };
+}
+
+// ==========================================
+// 平衡比較 (Variance-Reduced Comparison)
+// ==========================================
+
+// 比較兩個平衡變體 (A = 現行數值，B = 調整後) 的勝率、回合數與存活人數差異。
+// 第 k 對戰鬥的兩個變體使用同一條亂數流 (共同亂數)，且每個行動從固定位置取亂數，前面的差異不會錯開後續；
+// 對偶：每對再以 1-u 的亂數流各打一場取平均；控制變量：以暴擊與閃避的「實際傷害 − 解析期望」(期望為 0) 回歸扣除運氣成分。
+// 各方法的變異數都換算成「每場 A + 每場 B」的成本，與獨立抽樣相比即為可省下的場數倍率。
+namespace Compare {
+    enum Metric { Y_WIN, Y_ROUNDS, Y_SURVIVORS, METRICS };
+    const char* const METRIC_NAMES[] = {"勝率", "平均回合", "平均存活"};
+    const int CONTROLS = 4; // A 造成、A 承受、B 造成、B 承受
+
+    struct Config {
+        vector<int> party = {0, 1, 7, 11};
+        int level = 5;
+        int location = 6;
+        int enemies = 3;
+        string skill;              // 調整倍率的攻擊技能名稱 ("all" 為全部攻擊技能)
+        double multiplier = 1.0;   // 技能倍率的調整比例
+        double enemyMod = 1.0;     // 地點怪物強度的調整比例
+        long long battles = 20000; // 每個變體的場數 (對偶時含對偶場)
+        bool antithetic = false;
+        bool align = true;
+        int threads = 0;
+        uint64_t seed = 1;
+    };
+
+    // 單場觀測值：各指標與控制變量
+    struct Obs { double y[METRICS]; double luck[2]; };
+
+    // 多變量動差 (平均與共變異數)，可合併
+    template <int K> struct Moments {
+        long long n = 0;
+        double sum[K] = {}, cross[K][K] = {};
+        void add(const double* v) {
+            n++;
+            for (int i = 0; i < K; ++i) { sum[i] += v[i]; for (int j = 0; j < K; ++j) cross[i][j] += v[i] * v[j]; }
+        }
+        void merge(const Moments& o) {
+            n += o.n;
+            for (int i = 0; i < K; ++i) { sum[i] += o.sum[i]; for (int j = 0; j < K; ++j) cross[i][j] += o.cross[i][j]; }
+        }
+        double mean(int i) const { return n ? sum[i] / n : 0; }
+        double cov(int i, int j) const { return n > 1 ? (cross[i][j] - sum[i] * sum[j] / n) / (n - 1) : 0; }
+    };
+
+    // 各指標的累計：單場 (獨立抽樣與共同亂數的基準) 與每對樣本 (差值 + 控制變量)
+    struct Tally {
+        Moments<2> single[METRICS];            // (Y_A, Y_B)
+        Moments<1> paired[METRICS];            // 共同亂數差值 D = Y_A - Y_B
+        Moments<1 + CONTROLS> sample[METRICS]; // 對偶平均後的差值與控制變量
+        void merge(const Tally& o) {
+            for (int m = 0; m < METRICS; ++m) { single[m].merge(o.single[m]); paired[m].merge(o.paired[m]); sample[m].merge(o.sample[m]); }
+        }
+    };
+
+    // 控制變量回歸：解 Σxx β = σxy (共線或全為 0 的控制變量係數取 0)，回傳殘差變異數與調整後平均
+    void regress(const Moments<1 + CONTROLS>& mo, double& variance, double& estimate) {
+        const int K = CONTROLS;
+        double a[K][K + 1];
+        for (int i = 0; i < K; ++i) { for (int j = 0; j < K; ++j) a[i][j] = mo.cov(i + 1, j + 1); a[i][K] = mo.cov(i + 1, 0); }
+        double beta[K] = {};
+        bool used[K] = {};
+        for (int c = 0; c < K; ++c) {
+            int p = -1;
+            for (int r = 0; r < K; ++r) if (!used[r] && (p < 0 || fabs(a[r][c]) > fabs(a[p][c]))) p = r;
+            if (p < 0 || fabs(a[p][c]) < 1e-9 * (1 + fabs(mo.cov(c + 1, c + 1)))) continue;
+            used[p] = true;
+            for (int r = 0; r < K; ++r) {
+                if (r == p) continue;
+                double f = a[r][c] / a[p][c];
+                for (int j = c; j <= K; ++j) a[r][j] -= f * a[p][j];
+            }
+        }
+        for (int r = 0; r < K; ++r) {
+            int c = 0;
+            while (c < K && fabs(a[r][c]) < 1e-12) ++c;
+            if (used[r] && c < K) beta[c] = a[r][K] / a[r][c];
+        }
+        variance = mo.cov(0, 0);
+        estimate = mo.mean(0);
+        for (int i = 0; i < K; ++i) {
+            variance -= beta[i] * mo.cov(i + 1, 0);
+            estimate -= beta[i] * mo.mean(i + 1); // 控制變量的期望值為 0
+        }
+        variance = max(0.0, variance);
+    }
+
+    // 一個變體的遭遇表與開戰前的隊伍調整
+    struct Variant {
+        EncounterTable table;
+        Sim::Options opt;
+        Variant(const Config& cfg, bool changed) {
+            Location loc = LOCATIONS[cfg.location];
+            if (changed) loc.enemyStatMod *= cfg.enemyMod;
+            GameState fresh = freshState();
+            table.build(loc, fresh);
+            opt.alignTurns = cfg.align;
+            if (!changed || cfg.skill.empty()) return;
+            string skill = cfg.skill;
+            double f = cfg.multiplier;
+            opt.tweak = [skill, f](Party& team) {
+                for (auto* c : team) for (auto* s : c->getSkills()) {
+                    AttackSkill* a = dynamic_cast<AttackSkill*>(s);
+                    if (a && (skill == "all" || s->getName() == skill)) a->scaleMultiplier(f);
+                }
+            };
+        }
+        // 以 seed 起連續 n 場，逐場寫入觀測值
+        void run(const Config& cfg, uint64_t seed, long long n, bool mirror, Obs* out) {
+            DamageLuck luck;
+            DamageLuck* prev = damageLuck;
+            damageLuck = &luck;
+            opt.antithetic = mirror;
+            long long k = 0;
+            Sim::runBatch(cfg.party, cfg.level, n, seed, [&](const Party& team) {
+                EnemyGroup wave;
+                wave.add(table.spawn(team.averagePower()));
+                for (int i = 1; i < cfg.enemies; ++i) wave.add(table.spawnMinion(team.averagePower()));
+                return wave;
+            }, opt, [&](uint64_t, const Party&, const EnemyGroup&, const Sim::BattleResult& r) {
+                Obs& o = out[k++];
+                o.y[Y_WIN] = r.won; o.y[Y_ROUNDS] = r.rounds; o.y[Y_SURVIVORS] = r.survivors;
+                o.luck[0] = luck.dealt; o.luck[1] = luck.taken;
+                luck = DamageLuck();
+            });
+            damageLuck = prev;
+        }
+    };
+
+    // 第 first 對起的 n 對樣本：兩個變體 (對偶時各加一場對偶戰鬥) 併入 tally
+    void runPairs(const Config& cfg, Variant& a, Variant& b, uint64_t first, long long n, Tally& tally) {
+        int mirrors = cfg.antithetic ? 2 : 1;
+        vector<Obs> obs[2][2];
+        for (int m = 0; m < mirrors; ++m) {
+            obs[0][m].resize(n); obs[1][m].resize(n);
+            a.run(cfg, cfg.seed + first, n, m == 1, obs[0][m].data());
+            b.run(cfg, cfg.seed + first, n, m == 1, obs[1][m].data());
+        }
+        for (long long k = 0; k < n; ++k) {
+            for (int y = 0; y < METRICS; ++y) {
+                double v[1 + CONTROLS] = {};
+                for (int m = 0; m < mirrors; ++m) {
+                    const Obs& oa = obs[0][m][k];
+                    const Obs& ob = obs[1][m][k];
+                    double pair[2] = {oa.y[y], ob.y[y]};
+                    double d = oa.y[y] - ob.y[y];
+                    tally.single[y].add(pair);
+                    tally.paired[y].add(&d);
+                    v[0] += d / mirrors;
+                    v[1] += oa.luck[0] / mirrors; v[2] += oa.luck[1] / mirrors;
+                    v[3] += ob.luck[0] / mirrors; v[4] += ob.luck[1] / mirrors;
+                }
+                tally.sample[y].add(v);
+            }
+        }
+    }
+
+    // 平行執行：每批 1024 對，各執行緒累計後合併 (記憶體與總場數無關)
+    Tally run(const Config& cfg) {
+        const long long CHUNK = 1024;
+        long long pairs = cfg.battles / (cfg.antithetic ? 2 : 1);
+        long long chunks = (pairs + CHUNK - 1) / CHUNK;
+        int threads = max(1, cfg.threads > 0 ? cfg.threads : (int)thread::hardware_concurrency());
+        vector<Tally> part(threads);
+        atomic<long long> nextChunk(0);
+        auto worker = [&](int t) {
+            Variant a(cfg, false), b(cfg, true);
+            for (long long c = nextChunk++; c < chunks; c = nextChunk++)
+                runPairs(cfg, a, b, c * CHUNK, min(CHUNK, pairs - c * CHUNK), part[t]);
+        };
+        vector<thread> pool;
+        for (int i = 1; i < threads; ++i) pool.emplace_back(worker, i);
+        worker(0);
+        for (auto& th : pool) th.join();
+        Tally total;
+        for (const auto& p : part) total.merge(p);
+        return total;
+    }
+
+    // 報表：每種方法的差值估計、標準誤與相對獨立抽樣的變異數縮減倍率 (同樣總場數下)
+    void report(const Tally& t, const Config& cfg, ostream& os) {
+        int mirrors = cfg.antithetic ? 2 : 1;
+        os << fixed << setprecision(4);
+        for (int y = 0; y < METRICS; ++y) {
+            const Moments<2>& s = t.single[y];
+            long long n = s.n; // 每個變體的場數
+            double scale = y == Y_WIN ? 100 : 1;
+            double independent = s.cov(0, 0) + s.cov(1, 1);          // 每「一場 A + 一場 B」的差值變異數
+            double common = t.paired[y].cov(0, 0);
+            double anti = t.sample[y].cov(0, 0) * mirrors;           // 一個樣本花費 mirrors 場
+            double cvVar, cvEst;
+            regress(t.sample[y], cvVar, cvEst);
+            cvVar *= mirrors;
+            os << "[" << METRIC_NAMES[y] << "] A = " << s.mean(0) * scale << " | B = " << s.mean(1) * scale
+               << " (方法逐列疊加；± 為 95% 區間半寬)\n";
+            struct Row { const char* name; double est, var; bool on; };
+            Row rows[] = {
+                {"獨立抽樣", s.mean(0) - s.mean(1), independent, true},
+                {"共同亂數", t.paired[y].mean(0), common, true},
+                {"加上對偶", t.sample[y].mean(0), anti, cfg.antithetic},
+                {"控制變量", cvEst, cvVar, true},
+            };
+            for (const auto& r : rows) {
+                if (!r.on) continue;
+                double se = n > 0 ? sqrt(r.var / n) : 0;
+                os << "  " << r.name << " A-B = " << setw(9) << r.est * scale
+                   << " ± " << setw(7) << 1.96 * se * scale << "  變異數縮減 ";
+                if (r.var > 0) os << setprecision(1) << setw(7) << independent / r.var << "x" << setprecision(4);
+                else os << "      -";
+                os << "\n";
+            }
+        }
+        os.unsetf(ios::fixed);
+        os << setprecision(6);
+    }
+}
+
+// ==========================================
+// 自動遊玩 (Autopilot)
+// ==========================================
+
+// 以可替換的策略接管主迴圈的所有決策，從序章一路玩到第八章 (無輸出、無延遲)
+namespace Autopilot {
+    const int CHAPTERS = 9; // 序章 ~ 第八章
+
+    // 隨機策略：每個決策點均勻亂選 (作為比較基準，主選單不主動退出)
+    class RandomPilot : public Pilot {
+    public:
+        int decide(Decision d, const DecisionContext&, int min, int max) override {
+            if (d == D_MAIN) return getRandom(1, max);
+            if (d == D_RESTART) return 0;
+            return getRandom(min, max);
+        }
+    };
+
+    // 劇情導向策略：缺線索就搜查、往 BOSS 地點推進；先補血、補貨、換上較強的成員，等級不足時先在前一區練功
+    class GreedyPilot : public Pilot {
+        static const int LEVEL_PER_CHAPTER = 2; // 挑戰第 n 章 BOSS 前的平均等級門檻 = n * 2
+        int itemSlot = -1, itemTarget = -1;     // 預定使用的背包欄位與對象
+        int swapOut = -1, swapIn = -1;          // 預定替換的出戰與待命編號
+        const Party* team = nullptr;            // 主選單時記下的隊伍 (移動與商店的決策點不帶隊伍)
+        static int strength(const Character* c) { return c->getHP() <= 0 ? -1 : c->getAttack() + c->getMaxHP() / 10; }
+        static int averageLevel(const Party& team) {
+            int total = 0;
+            for (auto* c : team) total += c->getLevel();
+            return total / max(1, (int)team.size());
+        }
+        // 找出值得使用的道具：優先復活，其次為 HP 低於門檻的成員選擇不浪費的回復量
+        bool planItem(const Party& team, int hpPct) {
+            itemSlot = itemTarget = -1;
+            for (size_t t = 0; t < team.size() && itemSlot < 0; ++t) {
+                if (team[t]->getHP() > 0) continue;
+                for (size_t i = 0; i < inventory.size(); ++i)
+                    if (inventory[i].item->revives()) { itemSlot = i; itemTarget = t; break; }
+            }
+            if (itemSlot >= 0) return true;
+            for (size_t t = 0; t < team.size(); ++t) {
+                const Character* c = team[t];
+                if (c->getHP() <= 0 || c->getHP() * 100 >= c->getMaxHP() * hpPct) continue;
+                int missing = c->getMaxHP() - c->getHP(), best = -1, bestAmount = 0;
+                for (size_t i = 0; i < inventory.size(); ++i) {
+                    int a = inventory[i].item->getAmount();
+                    if (!a) continue;
+                    // 不超過缺口時取最大量，否則取最小量
+                    bool better = best < 0 || (a <= missing ? (bestAmount > missing || a > bestAmount) : (bestAmount > missing && a < bestAmount));
+                    if (better) { best = i; bestAmount = a; }
+                }
+                if (best >= 0) { itemSlot = best; itemTarget = t; return true; }
+            }
+            return false;
+        }
+        // 待命區有比出戰中最弱隊員更強的成員時換上 (隊長不可替換)
+        bool planSwap(const Party& team, const vector<Character*>& reserve) {
+            swapOut = swapIn = -1;
+            for (size_t i = 0; i < team.size(); ++i)
+                if (!team[i]->getIsPlayer() && (swapOut < 0 || strength(team[i]) < strength(team[swapOut]))) swapOut = i;
+            for (size_t i = 0; i < reserve.size(); ++i)
+                if (swapIn < 0 || strength(reserve[i]) > strength(reserve[swapIn])) swapIn = i;
+            return swapOut >= 0 && swapIn >= 0 && strength(reserve[swapIn]) > strength(team[swapOut]);
+        }
+        // 補貨：陣亡人數多於急救箱時買急救箱，背包回復量不足以補滿全隊時買每円回復量最高的道具
+        int shopPick(const Party& team) const {
+            int dead = 0, missing = 0, revives = 0, stocked = 0;
+            for (auto* c : team) { if (c->getHP() <= 0) dead++; else missing += c->getMaxHP() - c->getHP(); }
+            for (const auto& slot : inventory) {
+                if (slot.item->revives()) revives += slot.count;
+                else stocked += slot.item->getAmount() * slot.count;
+            }
+            int best = -1;
+            for (size_t i = 0; i < shopItems.size(); ++i) {
+                Item* it = shopItems[i];
+                if (it->getPrice() > gState.playerMoney) continue;
+                if (it->revives()) { if (dead > revives) return i + 1; continue; }
+                int a = it->getAmount();
+                if (a && missing > stocked && (best < 0 || a * shopItems[best]->getPrice() > shopItems[best]->getAmount() * it->getPrice())) best = i;
+            }
+            return best + 1;
+        }
+        // 本章要前往的地點 (序章~第二章搜查線索，之後挑戰該章 BOSS；等級不足時退回前一區練功)
+        int targetLocation(const Party& team) const {
+            int ch = gState.chapter;
+            if (ch <= 1) return 1;
+            if (ch == 2) return 2;
+            int boss = min(ch, 6);
+            return averageLevel(team) < ch * LEVEL_PER_CHAPTER ? boss - 1 : boss;
+        }
+        int mainAction(const Party& team, const vector<Character*>& reserve) {
+            if (planItem(team, 60) || planSwap(team, reserve)) return 4;
+            if (shopPick(team) > 0) return 3;
+            int loc = targetLocation(team);
+            if (currentLocation.id != loc) return 2;
+            int ch = gState.chapter;
+            if (ch <= 2) return 5;
+            // BOSS 地點先搜集 5 條線索 (削弱 BOSS)，練功區直接戰鬥
+            if (loc == min(ch, 6) && gState.playerClues < 5) return 5;
+            return 1;
+        }
+        int battleAction(const DecisionContext& ctx, int itemOpt) {
+            if (planItem(*ctx.team, 30)) return itemOpt;
+            const auto& skills = ctx.actor->getSkills();
+            int pick = -1;
+            for (size_t i = 0; i < skills.size(); ++i) {
+                if (!ctx.actor->isSkillReady(i)) continue;
+                // 全隊有人危急時優先輔助技能，否則取冷卻最長 (最強) 的攻擊技能
+                bool support = !skills[i]->targetsEnemy();
+                if (support && ctx.team->lowHPCount() == 0) continue;
+                if (pick < 0 || (support && skills[pick]->targetsEnemy()) || (support == !skills[pick]->targetsEnemy() && skills[i]->getMaxCD() > skills[pick]->getMaxCD())) pick = i;
+            }
+            return pick < 0 ? 1 : pick + 2;
+        }
+        // 選單依序列出存活敵人，取 HP 最低者的選單編號
+        static int weakestOption(const EnemyGroup& enemies) {
+            int option = 0, best = 1, bestHP = 0;
+            for (size_t i = 0; i < enemies.size(); ++i) {
+                if (enemies[i].getHP() <= 0) continue;
+                option++;
+                if (option == 1 || enemies[i].getHP() < bestHP) { best = option; bestHP = enemies[i].getHP(); }
+            }
+            return best;
+        }
+    public:
+        int decide(Decision d, const DecisionContext& ctx, int min, int max) override {
+            switch (d) {
+                case D_MAIN: team = ctx.team; return mainAction(*ctx.team, *ctx.reserve);
+                case D_LOCATION: return targetLocation(*team) + 1;
+                case D_SHOP: return shopPick(*team);
+                case D_TEAM_MENU: return planItem(*ctx.team, 60) ? 1 : (planSwap(*ctx.team, *ctx.reserve) ? 2 : 0);
+                case D_SWAP_OUT: return swapOut + 1;
+                case D_SWAP_IN: return swapIn + 1;
+                case D_ITEM: return itemSlot + 1;
+                case D_ITEM_TARGET: return itemTarget + 1;
+                case D_BATTLE_ACTION: return battleAction(ctx, max);
+                case D_TARGET: return weakestOption(*ctx.enemies);
+                case D_RESTART: return 0;
+            }
+            return min;
+        }
+    };
+    const int GreedyPilot::LEVEL_PER_CHAPTER;
+
+    // 建立策略 (未知名稱回傳 nullptr)
+    Pilot* makePilot(const string& name) {
+        if (name == "greedy") return new GreedyPilot();
+        if (name == "random") return new RandomPilot();
+        return nullptr;
+    }
+
+    // 單場遊戲紀錄
+    struct Campaign {
+        bool finished = false;
+        int turns = 0;
+        int chapterTurns[CHAPTERS] = {0}; // 各章花費的主選單回合
+        int chapterMoney[CHAPTERS];       // 進入各章時的金錢 (-1 表示未到達)
+        int wipeChapter = -1, wipeLocation = -1;
+        Campaign() { fill(chapterMoney, chapterMoney + CHAPTERS, -1); }
+    };
+
+    // 以指定亂數流玩一整場：直到第八章、全滅或回合上限
+    Campaign play(Pilot& strategy, uint64_t seed, int maxTurns) {
+        RngStream rng(seed);
+        Sim::HeadlessScope scope(rng);
+        Pilot* prev = pilot;
+        pilot = &strategy;
+        Party team;
+        vector<Character*> reserve;
+        resetGame(team, reserve);
+        Campaign c;
+        c.chapterMoney[0] = gState.playerMoney;
+        while (c.turns < maxTurns && gState.chapter < CHAPTERS - 1) {
+            int ch = gState.chapter;
+            c.turns++; c.chapterTurns[ch]++;
+            bool going = playTurn(team, reserve);
+            // 一次行動可能連跳數章 (擊敗琴酒直接進入終章)
+            for (int k = ch + 1; k <= gState.chapter && k < CHAPTERS; ++k) if (c.chapterMoney[k] < 0) c.chapterMoney[k] = gState.playerMoney;
+            if (!going) {
+                if (team.wiped()) { c.wipeChapter = gState.chapter; c.wipeLocation = currentLocation.id; }
+                break;
+            }
+        }
+        c.finished = gState.chapter >= CHAPTERS - 1;
+        for (auto* m : team.release()) delete m;
+        for (auto* m : reserve) delete m;
+        pilot = prev;
+        return c;
+    }
+
+    // 彙總多場紀錄
+    struct Report {
+        long long campaigns = 0, finished = 0, wiped = 0, turns = 0;
+        long long reached[CHAPTERS] = {0};
+        long long chapterTurns[CHAPTERS] = {0};
+        long long chapterMoney[CHAPTERS] = {0};
+        map<pair<int, int>, long long> wipes; // (章節, 地點) → 全滅次數
+        void add(const Campaign& c) {
+            campaigns++; turns += c.turns;
+            if (c.finished) finished++;
+            for (int k = 0; k < CHAPTERS; ++k) {
+                if (c.chapterMoney[k] < 0) continue;
+                reached[k]++; chapterTurns[k] += c.chapterTurns[k]; chapterMoney[k] += c.chapterMoney[k];
+            }
+            if (c.wipeChapter >= 0) { wiped++; wipes[make_pair(c.wipeChapter, c.wipeLocation)]++; }
+        }
+        // 合併另一個執行緒的彙總 (全為加總，與合併順序無關)
+        void merge(const Report& o) {
+            campaigns += o.campaigns; finished += o.finished; wiped += o.wiped; turns += o.turns;
+            for (int k = 0; k < CHAPTERS; ++k) {
+                reached[k] += o.reached[k]; chapterTurns[k] += o.chapterTurns[k]; chapterMoney[k] += o.chapterMoney[k];
+            }
+            for (const auto& w : o.wipes) wipes[w.first] += w.second;
+        }
+        void print(ostream& os, double seconds, int threads) const {
+            double n = max(1LL, campaigns);
+            os << fixed << setprecision(1);
+            os << "場數: " << campaigns << " | 通關: " << 100 * finished / n << "% | 全滅: " << 100 * wiped / n
+               << "% | 回合上限: " << 100 * (campaigns - finished - wiped) / n << "% | 平均回合: " << turns / n << "\n";
+            os << "章節\t到達率\t平均回合\t進入時金錢\n";
+            for (int k = 0; k < CHAPTERS; ++k) {
+                if (!reached[k]) continue;
+                // 終章只記錄到達，不再進行回合
+                os << k << "\t" << 100 * reached[k] / n << "%\t";
+                if (k < CHAPTERS - 1) os << (double)chapterTurns[k] / reached[k]; else os << "-";
+                os << "\t" << chapterMoney[k] / reached[k] << "\n";
+            }
+            if (!wipes.empty()) {
+                os << "全滅地點:\n";
+                for (const auto& w : wipes)
+                    os << "  第 " << w.first.first << " 章 " << LOCATIONS[w.first.second].name << "\t" << w.second << " (" << 100 * w.second / n << "%)\n";
+            }
+            double rate = campaigns / max(1e-9, seconds);
+            os << "耗時: " << setprecision(2) << seconds << " 秒 (" << setprecision(0) << rate << " 場/秒";
+            if (threads > 1) os << "，" << threads << " 執行緒，每執行緒 " << rate / threads << " 場/秒";
+            os << ")\n";
+            os.unsetf(ios::floatfield);
+            os << setprecision(6);
+        }
+    };
+}
+
+// ==========================================
+// 事件輸出端 (Event Sinks)
+// ==========================================
+
+namespace Bus {
+    // 空輸出端：只接收不處理 (量測匯流排本身的成本)
+    class NullSink : public Sink {
+    public:
+        void consume(const Event&) override {}
+    };
+
+    // 統計輸出端：各類事件的次數與數值總和，收尾時印出
+    class MetricsSink : public Sink {
+        uint64_t count[KIND_COUNT] = {};
+        long long total[KIND_COUNT] = {};
+        long long taken = 0; // 我方承受的傷害
+        int maxHit = 0, lastChapter = -1;
+    public:
+        void consume(const Event& e) override {
+            count[e.kind]++;
+            if (e.kind == DAMAGE && e.side == ENEMY) { taken += e.amount; return; }
+            total[e.kind] += e.amount;
+            if (e.kind == DAMAGE) maxHit = std::max(maxHit, (int)e.amount);
+            if (e.kind == CHAPTER) lastChapter = std::max(lastChapter, (int)e.value);
+        }
+        void finish(ostream& os) override {
+            os << "=== 事件統計 ===\n";
+            for (int k = 0; k < KIND_COUNT; ++k) {
+                os << left << setw(10) << KIND_NAMES[k] << right << " 次數: " << count[k];
+                if (k == DAMAGE) os << " | 造成: " << total[k] << " | 承受: " << taken << " | 最大單擊: " << maxHit;
+                if (k == HEAL || k == ITEM_USED) os << " | 總量: " << total[k];
+                if (k == CHAPTER && lastChapter >= 0) os << " | 最遠章節: " << lastChapter;
+                os << "\n";
+            }
+        }
+    };
+
+    // 終端機輸出端：每個事件一行文字 (一律同步分派，在遊戲執行緒上寫入)
+    class TerminalSink : public Sink {
+        ostream os;
+        vector<string> names; // charId -> 角色名稱 (建立時先查好，分派執行緒不碰遊戲狀態)
+        string who(int id) const { return (id >= 0 && id < (int)names.size()) ? names[id] : "?"; }
+    public:
+        explicit TerminalSink(streambuf* buf) : os(buf) {
+            for (int id = 0; id < CHARACTER_COUNT; ++id) {
+                Character* c = createCharacter(id, 1);
+                names.push_back(c ? c->getName() : "?");
+                delete c;
+            }
+        }
+        void consume(const Event& e) override {
+            switch (e.kind) {
+                case DAMAGE:
+                    if (e.side == ENEMY) os << "[傷害] 敵人 -> " << who(e.target) << " " << e.amount << "\n";
+                    else os << "[傷害] " << who(e.source) << " -> " << (e.target == NOBODY ? string("全體敵人") : "敵人#" + to_string(e.target)) << " " << e.amount << "\n";
+                    break;
+                case HEAL:
+                    os << "[治療] " << (e.source == NOBODY ? string("道具") : who(e.source)) << " -> "
+                       << (e.target == NOBODY ? "全體(" + to_string(e.value) + ")" : who(e.target)) << " +" << e.amount << "\n";
+                    break;
+                case LEVEL_UP: os << "[升級] " << who(e.source) << " Lv." << e.value << "\n"; break;
+                case ITEM_USED: os << "[道具] " << who(e.target) << (e.value ? " 復活 HP " : " 恢復 ") << e.amount << "\n"; break;
+                case CHAPTER: os << "[章節] 進入第 " << e.value << " 章\n"; break;
+            }
+        }
+        void finish(ostream&) override { os.flush(); }
+        bool console() const override { return true; }
+    };
+
+    // 二進位日誌輸出端：8 位元組檔頭後依序寫入 16 位元組事件
+    class BinaryLogSink : public Sink {
+        ofstream file;
+    public:
+        static constexpr char MAGIC[9] = "RPGEVT01";
+        bool open(const string& path) {
+            file.open(path, ios::binary | ios::trunc);
+            if (file) file.write(MAGIC, 8);
+            return (bool)file;
+        }
+        void consume(const Event& e) override { file.write((const char*)&e, sizeof(e)); }
+        void finish(ostream&) override { file.flush(); }
+    };
+    constexpr char BinaryLogSink::MAGIC[9];
+
+    // 依輸出端名稱啟動匯流排：metrics、terminal、null、log:路徑 (沒有名稱時不啟動)
+    // 互動模式或有輸出端要寫終端機時同步分派，否則交給分派執行緒
+    class Session {
+        vector<Sink*> sinks;
+        Dispatcher* dispatcher = nullptr;
+        ostream* console = nullptr;
+    public:
+        bool open(const vector<string>& names, ostream& out, bool interactive) {
+            console = &out;
+            for (const auto& name : names) {
+                if (name == "metrics") sinks.push_back(new MetricsSink());
+                else if (name == "terminal") sinks.push_back(new TerminalSink(out.rdbuf()));
+                else if (name == "null") sinks.push_back(new NullSink());
+                else if (name.compare(0, 4, "log:") == 0) {
+                    BinaryLogSink* sink = new BinaryLogSink();
+                    sinks.push_back(sink);
+                    if (!sink->open(name.substr(4))) { cerr << "無法寫入 " << name.substr(4) << "\n"; return false; }
+                }
+                else { cerr << "未知的事件輸出端: " << name << "\n"; return false; }
+            }
+            if (sinks.empty()) return true;
+            bool async = !interactive;
+            for (auto* s : sinks) if (s->console()) async = false;
+            dispatcher = new Dispatcher(sinks, async);
+            current = dispatcher;
+            return true;
+        }
+        // 在啟動匯流排的執行緒上、遊戲邏輯結束後呼叫 (解構時也會呼叫)
+        void close() {
+            if (dispatcher) {
+                current = nullptr;
+                dispatcher->stop(*console);
+                if (dispatcher->getDropped()) cerr << "事件佇列已滿，丟棄 " << dispatcher->getDropped() << " 筆 (已送出 " << dispatcher->getDelivered() << " 筆)\n";
+                delete dispatcher;
+                dispatcher = nullptr;
+            }
+            for (auto* s : sinks) delete s;
+            sinks.clear();
+        }
+        ~Session() { close(); }
+    };
+}
+
+// ==========================================
+// 取樣分析 (Sampling Profiler)
+// ==========================================
+
+// SIGPROF 計時器定期中斷，處理函式把呼叫堆疊寫進預先配置的無鎖緩衝區 (原子遞增保留位置，不配置記憶體)；
+// 結束後以執行檔自己的 ELF 符號表還原函式名稱，輸出 flamegraph 工具可讀的 folded 格式 ("a;b;c 次數")
+#ifdef __linux__
+namespace Profiler {
+    const int MAX_DEPTH = 64;
+    vector<uintptr_t> pool;            // 樣本：[深度][位址 ...]，由根到葉反向儲存
+    atomic<size_t> reserved(0);        // 已保留的 pool 位置
+    atomic<long long> begun(0), committed(0), dropped(0);
+    atomic<bool> running(false);
+
+    // 訊號處理：回溯堆疊並從被中斷的位址開始記錄 (略過處理函式本身的框架)
+    void onSample(int, siginfo_t*, void* context) {
+        if (!running.load(memory_order_relaxed)) return;
+        int savedErrno = errno;
+        begun.fetch_add(1, memory_order_relaxed);
+        void* frames[MAX_DEPTH + 8];
+        int n = backtrace(frames, MAX_DEPTH + 8);
+        // 找不到被中斷的位址 (不支援的架構或回溯不完整) 時捨棄，避免把處理函式自己的框架記進去
+        int first = -1;
+#if defined(__x86_64__) || defined(__aarch64__)
+#if defined(__x86_64__)
+        uintptr_t pc = ((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+#else
+        uintptr_t pc = ((ucontext_t*)context)->uc_mcontext.pc;
+#endif
+        for (int i = 0; i < n; ++i) if ((uintptr_t)frames[i] == pc) { first = i; break; }
+#else
+        (void)context;
+#endif
+        int depth = first < 0 ? 0 : min(n - first, MAX_DEPTH);
+        // 只有真的要寫入時才保留位置：保留了卻沒寫的格子深度為 0，彙整時會在那裡中斷
+        size_t at = depth > 0 ? reserved.fetch_add(depth + 1, memory_order_relaxed) : 0;
+        if (depth <= 0 || at + depth + 1 > pool.size()) dropped.fetch_add(1, memory_order_relaxed);
+        else {
+            pool[at] = depth;
+            for (int i = 0; i < depth; ++i) pool[at + 1 + i] = (uintptr_t)frames[first + i];
+        }
+        committed.fetch_add(1, memory_order_release);
+        errno = savedErrno;
+    }
+
+    bool start(int hz, size_t words) {
+        pool.assign(words, 0);
+        void* warm[4];
+        // backtrace 第一次呼叫會載入 libgcc 並配置記憶體，先在訊號處理之外呼叫一次；
+        // 之後仍不保證訊號安全 (展開器可能取鎖)，見 README
+        backtrace(warm, 4);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = onSample;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, nullptr) != 0) return false;
+        running = true;
+        struct itimerval timer;
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = max(1, 1000000 / max(1, hz));
+        timer.it_value = timer.it_interval;
+        return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+    }
+    // 停止計時器並等待進行中的處理函式寫完
+    void stop() {
+        struct itimerval off;
+        memset(&off, 0, sizeof(off));
+        setitimer(ITIMER_PROF, &off, nullptr);
+        running = false;
+        while (committed.load(memory_order_acquire) < begun.load(memory_order_relaxed)) this_thread::yield();
+        signal(SIGPROF, SIG_IGN);
+    }
+
+    // 執行檔符號表：位址 → 函式名稱
+    class Symbols {
+        struct Sym { uintptr_t addr, size; string name; };
+        vector<Sym> syms;
+        uintptr_t base = 0;                       // 執行檔載入位址 (PIE 時不為 0)
+        struct Object { uintptr_t lo, hi; string name; };
+        vector<Object> objects;                   // 已載入的共享函式庫 (只標出所屬檔名)
+        static int collect(struct dl_phdr_info* info, size_t, void* data) {
+            Symbols* self = (Symbols*)data;
+            bool exe = self->objects.empty() && info->dlpi_name[0] == '\0';
+            if (exe) self->base = info->dlpi_addr;
+            uintptr_t lo = ~(uintptr_t)0, hi = 0;
+            for (int i = 0; i < info->dlpi_phnum; ++i) {
+                if (info->dlpi_phdr[i].p_type != PT_LOAD) continue;
+                uintptr_t a = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+                lo = min(lo, a); hi = max(hi, a + (uintptr_t)info->dlpi_phdr[i].p_memsz);
+            }
+            string name = exe ? "" : info->dlpi_name;
+            size_t slash = name.rfind('/');
+            if (slash != string::npos) name = name.substr(slash + 1);
+            self->objects.push_back({lo, hi, name.empty() ? (exe ? "" : "[vdso]") : "[" + name + "]"});
+            return 0;
+        }
+        // 讀 ELF 的 .symtab (被 strip 時改用 .dynsym)
+        void loadElf(const string& path) {
+            ifstream file(path.c_str(), ios::binary);
+            string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            if (data.size() < sizeof(Elf64_Ehdr) || data.compare(0, 4, ELFMAG) != 0 || data[EI_CLASS] != ELFCLASS64) return;
+            const Elf64_Ehdr* eh = (const Elf64_Ehdr*)data.data();
+            if (eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > data.size()) return;
+            const Elf64_Shdr* sh = (const Elf64_Shdr*)(data.data() + eh->e_shoff);
+            for (uint32_t want : {(uint32_t)SHT_SYMTAB, (uint32_t)SHT_DYNSYM}) {
+                for (int i = 0; i < eh->e_shnum && syms.empty(); ++i) {
+                    if (sh[i].sh_type != want || sh[i].sh_link >= eh->e_shnum) continue;
+                    const Elf64_Shdr& strs = sh[sh[i].sh_link];
+                    if (sh[i].sh_offset + sh[i].sh_size > data.size() || strs.sh_offset + strs.sh_size > data.size()) continue;
+                    const Elf64_Sym* s = (const Elf64_Sym*)(data.data() + sh[i].sh_offset);
+                    for (size_t k = 0; k < sh[i].sh_size / sizeof(Elf64_Sym); ++k) {
+                        if (ELF64_ST_TYPE(s[k].st_info) != STT_FUNC || !s[k].st_value || s[k].st_name >= strs.sh_size) continue;
+                        syms.push_back({(uintptr_t)s[k].st_value, (uintptr_t)s[k].st_size, data.data() + strs.sh_offset + s[k].st_name});
+                    }
+                }
+            }
+            sort(syms.begin(), syms.end(), [](const Sym& a, const Sym& b) { return a.addr < b.addr; });
+        }
+    public:
+        Symbols() {
+            dl_iterate_phdr(collect, this);
+            loadElf("/proc/self/exe");
+        }
+        // 去掉參數列與樣板參數，火焰圖上較易閱讀
+        static string shorten(const string& mangled) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+            string full = (status == 0 && demangled) ? demangled : mangled;
+            free(demangled);
+            string out;
+            int paren = 0, angle = 0;
+            for (size_t i = 0; i < full.size(); ++i) {
+                char c = full[i];
+                if (full.compare(i, 8, "operator") == 0 && paren == 0 && angle == 0) {
+                    // 運算子名稱本身含有括號或角括號，整段保留
+                    size_t j = i + 8;
+                    while (j < full.size() && full[j] != '(' ) ++j;
+                    if (full.compare(j, 2, "()") == 0 && j + 2 < full.size() && full[j + 2] == '(') j += 2;
+                    out += full.substr(i, j - i);
+                    i = j - 1;
+                    continue;
+                }
+                if (c == '(') { paren++; continue; }
+                if (c == ')') { paren = max(0, paren - 1); continue; }
+                if (paren) continue;
+                if (c == '<') { if (!angle++) out += "<>"; continue; }
+                if (c == '>') { angle = max(0, angle - 1); continue; }
+                if (angle) continue;
+                out += (c == ';') ? ':' : c;
+            }
+            size_t clone = out.find(" [clone");
+            return clone == string::npos ? out : out.substr(0, clone);
+        }
+        string name(uintptr_t pc) {
+            auto it = cache.find(pc);
+            if (it != cache.end()) return it->second;
+            string result;
+            uintptr_t rel = pc - base;
+            auto s = upper_bound(syms.begin(), syms.end(), rel, [](uintptr_t a, const Sym& b) { return a < b.addr; });
+            if (s != syms.begin() && !objects.empty() && pc >= objects[0].lo && pc < objects[0].hi) {
+                --s;
+                if (rel < s->addr + max<uintptr_t>(s->size, 1)) result = shorten(s->name);
+            }
+            if (result.empty()) {
+                for (size_t i = 1; i < objects.size() && result.empty(); ++i)
+                    if (pc >= objects[i].lo && pc < objects[i].hi) result = objects[i].name;
+                if (result.empty()) result = "[unknown]";
+            }
+            return cache[pc] = result;
+        }
+    private:
+        unordered_map<uintptr_t, string> cache;
+    };
+
+    // 彙整樣本並寫出 folded 堆疊 (根在前)；回傳樣本數
+    long long write(const string& path, ostream& report) {
+        Symbols symbols;
+        map<string, long long> folded;
+        size_t end = min(reserved.load(), pool.size());
+        long long samples = 0;
+        for (size_t at = 0; at < end; ) {
+            size_t depth = pool[at];
+            if (depth == 0 || at + 1 + depth > end) break;
+            string stack;
+            for (size_t i = depth; i-- > 0; ) {
+                uintptr_t pc = pool[at + 1 + i];
+                if (i > 0) pc -= 1; // 返回位址指向呼叫的下一道指令
+                if (!stack.empty()) stack += ';';
+                stack += symbols.name(pc);
+            }
+            folded[stack]++;
+            samples++;
+            at += depth + 1;
+        }
+        ofstream out(path.c_str(), ios::trunc);
+        for (const auto& kv : folded) out << kv.first << " " << kv.second << "\n";
+        report << "取樣: " << samples << " 筆 (捨棄 " << dropped.load() << ")，不同堆疊 " << folded.size() << " 種 → " << path << "\n";
+        return out ? samples : -1;
+    }
+}
+#endif
+
+// ==========================================
+// 命令列模式 (Command Line)
+// ==========================================
+
+// 命令列參數：第一個參數為模式，其餘為 --key value
+struct CliArgs {
+    string mode;
+    map<string, string> opts;
+    CliArgs(int argc, char** argv) {
+        if (argc > 1) mode = argv[1];
+        for (int i = 2; i < argc; ++i) {
+            string key = argv[i];
+            if (key.compare(0, 2, "--") != 0) continue;
+            key = key.substr(2);
+            if (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0) opts[key] = argv[++i];
+            else opts[key] = "1";
+        }
+    }
+    bool has(const string& key) const { return opts.count(key) > 0; }
+    string get(const string& key, const string& def) const { auto it = opts.find(key); return it == opts.end() ? def : it->second; }
+    long long getInt(const string& key, long long def) const { auto it = opts.find(key); return it == opts.end() ? def : atoll(it->second.c_str()); }
+};
+
+// --sim：批次執行無頭戰鬥並輸出統計
+int runSimCommand(const CliArgs& args) {
+    vector<int> ids = parseIntList(args.get("party", "0,1,7,11"));
+    int level = args.getInt("level", 5);
+    int loc = args.getInt("location", 1);
+    int waveSize = args.getInt("enemies", 1);
+    long long battles = args.getInt("battles", 1000);
+    uint64_t seed = args.getInt("seed", 1);
+    int processes = args.getInt("processes", 1);
+    int shards = args.getInt("shards", processes);
+    if (ids.empty() || loc < 0 || loc >= (int)LOCATIONS.size() || waveSize < 1 || processes < 1 || shards < 1) { cerr << "參數錯誤\n"; return 1; }
+    // 事件匯流排只收本行程的事件，子行程的事件不會回傳
+    if (args.has("events") && processes > 1) { cerr << "--events 不支援多行程\n"; return 1; }
+    if (args.has("transcript") && processes > 1) { cerr << "--transcript 不支援多行程\n"; return 1; }
+    Bus::Session events;
+    if (!events.open(splitList(args.get("events", ""), ','), cout, false)) return 1;
+    string transcriptPath = args.get("transcript", "");
+    if (!transcriptPath.empty() && !Transcript::start(transcriptPath, args.has("transcript-text"))) { cerr << "無法寫入 " << transcriptPath << "\n"; return 1; }
+
+    gState = freshState(200);
+    currentLocation = LOCATIONS[loc];
+    // 逐場結果寫入欄式檔 (多行程時每個分片各寫一個 .partN 檔)
+    string outPath = args.get("out", "");
+    string partyKey;
+    for (int id : ids) partyKey += (partyKey.empty() ? "" : ",") + to_string(id);
+    // 分位數統計 (多行程時各分片先寫 .partN，協調者再合併)
+    string statsPath = args.get("stats", "");
+    Stats::Collector stats;
+    // 檢查點 (每個分片一個檔案 path.N；欄式結果檔無法從中途接續，不可同時使用)
+    string ckptPath = args.get("checkpoint", "");
+    double ckptEvery = atof(args.get("checkpoint-every", "10").c_str());
+    long long chunk = args.getInt("chunk", 1000);
+    if (!ckptPath.empty() && (!outPath.empty() || ckptEvery <= 0 || chunk < 1)) { cerr << "--checkpoint 不支援 --out，且間隔與 --chunk 須為正數\n"; return 1; }
+    int shardCount = processes == 1 ? 1 : shards;
+    string job = "sim|" + partyKey + "|" + to_string(level) + "|" + to_string(loc) + "|" + to_string(waveSize) + "|" + to_string(battles)
+        + "|" + to_string(seed) + "|" + to_string(shardCount) + "|" + (statsPath.empty() ? "0" : "1");
+    ShardWork work = [&](int shard, long long first, long long count, Sim::Summary& result) {
+        Columnar::Writer writer;
+        bool writing = false;
+        string path = processes == 1 ? outPath : outPath + ".part" + to_string(shard);
+        if (!outPath.empty()) {
+            writing = writer.open(path, Columnar::SIM_SCHEMA);
+            if (!writing) cerr << "無法寫入 " << path << "\n";
+        }
+        Checkpoint::State st;
+        st.job = job; st.first = first; st.count = count;
+        string ckptFile = ckptPath.empty() ? "" : Checkpoint::shardPath(ckptPath, shard);
+        Checkpoint::State saved;
+        if (!ckptFile.empty() && Checkpoint::load(ckptFile, saved)) {
+            if (saved.job == job && saved.first == first && saved.count == count) {
+                st = saved;
+                cerr << "分片 " << shard << " 由檢查點接續：已完成 " << st.done << " / " << count << " 場\n";
+            } else cerr << "檢查點 " << ckptFile << " 的參數不符，重新開始\n";
+        }
+        Stats::Collector& local = st.stats;
+        Sim::Recorder record = [&](uint64_t s, const Party& team, const EnemyGroup& enemies, const Sim::BattleResult& r) {
+            const char* monster = MONSTER_TYPE_NAMES[enemies[0].type];
+            if (!statsPath.empty()) local.record(Stats::Collector::keyOf(loc, monster, partyKey), team, r);
+            if (writing) {
+                writer.setInt(Columnar::SC_SEED, s);
+                writer.setString(Columnar::SC_PARTY, partyKey);
+                writer.setInt(Columnar::SC_LOCATION, loc);
+                writer.setString(Columnar::SC_MONSTER, monster);
+                writer.setInt(Columnar::SC_WON, r.won);
+                writer.setInt(Columnar::SC_ROUNDS, r.rounds);
+                writer.setInt(Columnar::SC_SURVIVORS, r.survivors);
+                writer.setList(Columnar::SC_DAMAGE, r.damageDealt);
+                writer.endRow();
+            }
+        };
+        // 開啟檢查點時分批執行，批次之間才可能交出狀態
+        unique_ptr<Checkpoint::Writer> saver(ckptFile.empty() ? nullptr : new Checkpoint::Writer(ckptFile, ckptEvery));
+        while (!st.finished()) {
+            long long n = saver ? min(chunk, count - st.done) : count - st.done;
+            st.sum.merge(Sim::runBatch(ids, level, n, seed + first + st.done,
+                [&](const Party& team) { return generateWave(team, waveSize); }, Sim::Options(), record));
+            st.done += n;
+            if (saver && saver->due()) saver->offer(st);
+        }
+        if (saver) { saver->offer(st); saver->stop(); }
+        result = st.sum;
+        bool ok = outPath.empty() || writing;
+        // 明確關閉才能得知頁尾與最後一組是否寫入成功 (磁碟已滿等)，解構子會吞掉結果
+        if (writing && !writer.close()) { cerr << "寫入 " << path << " 失敗，結果檔不完整\n"; ok = false; }
+        if (processes == 1) stats.merge(local);
+        else if (!statsPath.empty() && !local.save(statsPath + ".part" + to_string(shard))) ok = false;
+        return ok;
+    };
+    Sim::Summary sum;
+    bool ok = true;
+    if (processes == 1) ok = work(0, 0, battles, sum);
+    else {
+        encounters.tableFor(currentLocation); // 先建表，子行程共用
+        ok = Shard::run(battles, shards, processes, work, sum);
+        if (!ok) cerr << "部分分片失敗，以下統計不完整\n";
+        for (int k = 0; k < shards && !statsPath.empty(); ++k) {
+            string part = statsPath + ".part" + to_string(k);
+            if (!stats.load(part)) { cerr << "無法讀取 " << part << "\n"; ok = false; }
+            remove(part.c_str());
+        }
+    }
+    events.close(); // 送完事件再輸出報表，避免與分派執行緒同時寫入
+    Transcript::stop(cerr);
+    // 全部完成才刪除檢查點 (有分片放棄時保留，下次執行可接續)
+    if (!ckptPath.empty() && sum.battles == battles)
+        for (int k = 0; k < shardCount; ++k) remove(Checkpoint::shardPath(ckptPath, k).c_str());
+    if (!statsPath.empty()) {
+        if (!stats.save(statsPath)) { cerr << "無法寫入 " << statsPath << "\n"; ok = false; }
+        stats.report(cout);
+    }
+    cout << "地點: " << LOCATIONS[loc].name << " | 場數: " << sum.battles << "\n";
+    cout << "勝率: " << 100.0 * sum.winRate() << "%"
+         << " | 平均回合: " << sum.avgRounds()
+         << " | 平均存活: " << sum.avgSurvivors() << "\n";
+    return ok ? 0 : 1; // 任何輸出失敗都以非零結束碼回報
+}
+
+// --scan：以記憶體映射讀取欄式結果檔，只掃描指定欄位
+int runScanCommand(const CliArgs& args) {
+    vector<string> files = splitList(args.get("in", ""), ',');
+    string name = args.get("column", "");
+    if (files.empty()) { cerr << "參數錯誤\n"; return 1; }
+    long long rows = 0, count = 0;
+    int64_t lo = numeric_limits<int64_t>::max(), hi = numeric_limits<int64_t>::min();
+    double total = 0;
+    map<string, long long> freq;
+    for (const auto& path : files) {
+        Columnar::Reader reader;
+        if (!reader.open(path)) { cerr << "無法讀取 " << path << "\n"; return 1; }
+        rows += reader.rows();
+        if (name.empty()) {
+            cout << path << ": " << reader.rows() << " 列 |";
+            for (const auto& c : reader.columns()) cout << " " << c.name;
+            cout << "\n";
+            continue;
+        }
+        int col = reader.column(name);
+        if (col < 0) { cerr << "找不到欄位: " << name << "\n"; return 1; }
+        auto addValue = [&](int64_t v) { count++; total += v; lo = min(lo, v); hi = max(hi, v); };
+        switch (reader.columns()[col].type) {
+            case Columnar::COL_INT: reader.scanInts(col, addValue); break;
+            case Columnar::COL_STRING: reader.scanStrings(col, [&](const string& v) { freq[v]++; }); break;
+            case Columnar::COL_INT_LIST: reader.scanLists(col, [&](const vector<int64_t>& row) { for (int64_t v : row) addValue(v); }); break;
+        }
+    }
+    if (name.empty()) { cout << "總列數: " << rows << "\n"; return 0; }
+    cout << "欄位: " << name << " | 列數: " << rows << "\n";
+    for (const auto& kv : freq) cout << kv.first << "\t" << kv.second << "\n";
+    if (count > 0) cout << "值數: " << count << " | 最小: " << lo << " | 最大: " << hi << " | 平均: " << total / count << "\n";
+    return 0;
+}
+
+// --stats：合併多個統計檔並輸出分位數 (可另存合併結果)
+int runStatsCommand(const CliArgs& args) {
+    vector<string> files = splitList(args.get("in", ""), ',');
+    if (files.empty()) { cerr << "參數錯誤\n"; return 1; }
+    Stats::Collector stats;
+    for (const auto& path : files) if (!stats.load(path)) { cerr << "無法讀取 " << path << "\n"; return 1; }
+    string outPath = args.get("out", "");
+    if (!outPath.empty() && !stats.save(outPath)) { cerr << "無法寫入 " << outPath << "\n"; return 1; }
+    stats.report(cout);
+    return 0;
+}
+
+// 解析調校目標：以逗號分隔，每項為 地點:勝率%:回合數[:等級]
+bool parseTargets(const string& text, bool boss, int defLevel, vector<Tune::Target>& targets) {
+    for (const auto& item : splitList(text, ',')) {
+        vector<string> f = splitList(item, ':');
+        if (f.size() < 3) return false;
+        Tune::Target t = {atoi(f[0].c_str()), boss, atof(f[1].c_str()) / 100.0, atof(f[2].c_str()), f.size() > 3 ? atoi(f[3].c_str()) : defLevel};
+        if (t.location < 0 || t.location >= (int)LOCATIONS.size() || t.rounds <= 0 || t.level < 1) return false;
+        targets.push_back(t);
+    }
+    return true;
+}
+
+// --tune：以演化搜尋調整地點難度與 BOSS HP 倍率，輸出新的參數表
+int runTuneCommand(const CliArgs& args) {
+    Tune::Config cfg;
+    cfg.party = parseIntList(args.get("party", "0,1,7,11"));
+    cfg.enemies = args.getInt("enemies", 1);
+    cfg.battles = args.getInt("battles", cfg.battles);
+    cfg.generations = args.getInt("generations", cfg.generations);
+    cfg.population = args.getInt("population", cfg.population);
+    cfg.elites = args.getInt("elites", cfg.elites);
+    cfg.threads = args.getInt("threads", 0);
+    cfg.seed = args.getInt("seed", 1);
+    int level = args.getInt("level", 5);
+    // 預設目標：越後面的地點越難，BOSS 戰更久
+    string normal = args.get("targets", "0:99:2,1:98:2,2:96:3,3:94:3,4:92:4,5:90:4,6:88:5,7:85:5");
+    string boss = args.get("boss-targets", "3:85:6,4:80:7,5:75:8,6:65:10");
+    vector<Tune::Target> targets;
+    if (cfg.party.empty() || cfg.enemies < 1 || cfg.battles < 1 || cfg.population < 1
+        || !parseTargets(normal, false, level, targets) || !parseTargets(boss, true, level, targets)
+        || targets.empty()) { cerr << "參數錯誤\n"; return 1; }
+
+    cerr << "目標數: " << targets.size() << " | 執行緒: " << Tune::threadCount(cfg) << "\n";
+    vector<double> best = Tune::optimize(targets, cfg, cerr);
+    // 以另一組種子與較多場數驗證，避免只對評分用的亂數過度擬合
+    long long checkBattles = cfg.battles * 4;
+    uint64_t checkSeed = cfg.seed + 1000003;
+    vector<double> before = Tune::currentGenome();
+    cout << "目標\t期望勝率\t期望回合\t調整前\t調整後\n";
+    for (const auto& t : targets) {
+        Sim::Summary a = Tune::simulate(before, t, cfg, checkBattles, checkSeed);
+        Sim::Summary b = Tune::simulate(best, t, cfg, checkBattles, checkSeed);
+        cout << LOCATIONS[t.location].name << (t.boss ? " (BOSS)" : "") << "\t" << 100 * t.winRate << "%\t" << t.rounds
+             << "\t" << 100 * a.winRate() << "% / " << a.avgRounds() << "\t" << 100 * b.winRate() << "% / " << b.avgRounds() << "\n";
+    }
+    cout << "\n";
+    Tune::printTable(best, cout);
+    return 0;
+}
+
+// --explore：窮舉隊伍組合，依地點與等級排出勝率最高的組合 (結果快取於磁碟，重跑只計算有變動的組合)
+int runExploreCommand(const CliArgs& args) {
+    Explore::Config cfg;
+    string poolText = args.get("pool", "");
+    if (poolText.empty()) for (int id = 0; id <= NPC_COUNT; ++id) cfg.pool.push_back(id);
+    else cfg.pool = parseIntList(poolText);
+    sort(cfg.pool.begin(), cfg.pool.end());
+    cfg.pool.erase(unique(cfg.pool.begin(), cfg.pool.end()), cfg.pool.end());
+    cfg.size = args.getInt("size", cfg.size);
+    cfg.enemies = args.getInt("enemies", cfg.enemies);
+    cfg.batch = args.getInt("batch", cfg.batch);
+    cfg.maxBattles = args.getInt("max-battles", cfg.maxBattles);
+    cfg.top = args.getInt("top", cfg.top);
+    cfg.z = atof(args.get("z", "3").c_str());
+    cfg.precision = atof(args.get("precision", "0.02").c_str());
+    cfg.threads = args.getInt("threads", 0);
+    cfg.seed = args.getInt("seed", 1);
+    vector<int> locs = parseIntList(args.get("locations", "1"));
+    vector<int> levels = parseIntList(args.get("levels", "5"));
+    int show = args.getInt("show", 10);
+    bool valid = cfg.size >= 1 && cfg.size <= (int)cfg.pool.size() && cfg.size <= MAX_TEAM_SIZE && cfg.enemies >= 1
+        && cfg.batch >= 1 && cfg.maxBattles >= 1 && cfg.top >= 0 && cfg.z > 0 && !locs.empty() && !levels.empty();
+    for (int id : cfg.pool) valid = valid && id >= 0 && id <= NPC_COUNT;
+    for (int l : locs) valid = valid && l >= 0 && l < (int)LOCATIONS.size();
+    for (int lv : levels) valid = valid && lv >= 1;
+    if (!valid) { cerr << "參數錯誤\n"; return 1; }
+
+    // 快取路徑 (--no-cache 停用)
+    string cachePath = args.has("no-cache") ? "" : args.get("cache", "rpg_explore.cache");
+    Explore::Cache cache(cachePath);
+    if (!cachePath.empty() && !cache.load()) { cerr << "快取檔格式錯誤: " << cachePath << "\n"; return 1; }
+    vector<string> names(NPC_COUNT + 1);
+    for (int id : cfg.pool) { Character* c = createCharacter(id, 1); names[id] = c->getName(); delete c; }
+
+    auto start = chrono::steady_clock::now();
+    long long simulated = 0;
+    for (int loc : locs) {
+        for (int level : levels) {
+            const Location& where = LOCATIONS[loc];
+            cerr << where.name << " Lv." << level << "\n";
+            vector<Explore::Candidate> cands = Explore::prepare(where, level, cfg, cache);
+            Explore::evaluate(cands, where, level, cfg, cerr);
+            int pruned = 0, hits = 0;
+            for (const auto& c : cands) {
+                pruned += c.pruned;
+                hits += c.cachedBattles > 0 && c.cachedBattles == c.sum.battles;
+                simulated += c.sum.battles - c.cachedBattles;
+                if (!cachePath.empty()) cache.put(c.key, c.sum);
+            }
+            // 每組 (地點, 等級) 完成即寫回，中斷時已完成的部分不會遺失
+            if (!cachePath.empty() && !cache.save()) cerr << "無法寫入快取 " << cachePath << "\n";
+            sort(cands.begin(), cands.end(), Explore::better);
+            cout << "== " << where.name << " Lv." << level << " | 組合: " << cands.size() << " | 淘汰: " << pruned
+                 << " | 快取命中: " << hits << " ==\n";
+            cout << "名次\t隊伍\t勝率\t±\t回合\t場數\n";
+            cout << fixed << setprecision(1);
+            for (int i = 0; i < (int)cands.size() && i < show; ++i) {
+                const Explore::Candidate& c = cands[i];
+                double lo, hi;
+                Explore::wilson(c.sum, cfg.z, lo, hi);
+                string party;
+                for (int id : c.ids) party += (party.empty() ? "" : "、") + names[id];
+                cout << i + 1 << "\t" << party << "\t" << 100 * c.sum.winRate() << "%\t" << 50 * (hi - lo) << "\t"
+                     << c.sum.avgRounds() << "\t" << c.sum.battles << (c.pruned ? " (淘汰)" : "") << "\n";
+            }
+            cout.unsetf(ios::fixed);
+            cout << setprecision(6) << "\n";
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "本次模擬: " << simulated << " 場 | 耗時: " << seconds << " 秒";
+    if (!cachePath.empty()) cout << " | 快取項目: " << cache.size();
+    cout << "\n";
+    return 0;
+}
+
+// --autopilot：以指定策略自動玩完多場遊戲，統計章節進度、金錢與全滅地點
+int runAutopilotCommand(const CliArgs& args) {
+    long long campaigns = args.getInt("campaigns", 1000);
+    string strategy = args.get("strategy", "greedy");
+    uint64_t seed = args.getInt("seed", 1);
+    int maxTurns = args.getInt("max-turns", 3000);
+    // 事件匯流排與觀戰廣播都只接收主執行緒，指定時預設單執行緒
+    bool single = args.has("events") || args.has("broadcast");
+    int threads = args.getInt("threads", single ? 1 : 0);
+    Pilot* probe = Autopilot::makePilot(strategy);
+    if (!probe || campaigns < 1 || maxTurns < 1) { delete probe; cerr << "參數錯誤 (--strategy greedy|random)\n"; return 1; }
+    delete probe;
+    if (threads <= 0) threads = max(1, (int)thread::hardware_concurrency()); // 0 表示使用全部核心 (與其他指令相同)
+    threads = (int)min<long long>(threads, campaigns);
+    if (single && threads > 1) { cerr << "--events 與 --broadcast 不支援多執行緒\n"; return 1; }
+
+    Spectate::Ring ring;
+    if (args.has("broadcast")) {
+        long long slots = args.getInt("slots", 4096);
+        if (slots < 1 || slots > Spectate::MAX_SLOTS) { cerr << "--slots 須介於 1 與 " << Spectate::MAX_SLOTS << " 之間\n"; return 1; }
+        if (!ring.create(args.get("broadcast", ""), (uint32_t)slots)) { cerr << "無法建立廣播檔\n"; return 1; }
+        Spectate::ring = &ring;
+    }
+    Bus::Session events;
+    if (!events.open(splitList(args.get("events", ""), ','), cout, false)) return 1;
+    string transcriptPath = args.get("transcript", "");
+    if (!transcriptPath.empty() && !Transcript::start(transcriptPath, args.has("transcript-text"))) { cerr << "無法寫入 " << transcriptPath << "\n"; return 1; }
+    // 各執行緒以原子計數器領取場次 (第 i 場固定使用 seed + i，結果與執行緒數無關)，各自彙總後合併
+    vector<Autopilot::Report> part(threads);
+    atomic<long long> nextCampaign(0);
+    auto worker = [&](int t) {
+        for (long long i = nextCampaign++; i < campaigns; i = nextCampaign++) {
+            if (t == 0) Memory::poll();
+            Pilot* p = Autopilot::makePilot(strategy); // 每場重新建立，策略狀態不跨場
+            part[t].add(Autopilot::play(*p, seed + i, maxTurns));
+            delete p;
+        }
+        // 遊戲進度是執行緒各自的，商店道具由本執行緒釋放
+        inventory.clear();
+        for (auto* i : shopItems) delete i;
+        shopItems.clear();
+    };
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (int i = 1; i < threads; ++i) pool.emplace_back(worker, i);
+    worker(0);
+    for (auto& th : pool) th.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    events.close();
+    Transcript::stop(cerr);
+    Spectate::ring = nullptr;
+    Autopilot::Report report;
+    for (const auto& p : part) report.merge(p);
+    cout << "策略: " << strategy << "\n";
+    report.print(cout, seconds, threads);
+    return 0;
+}
+
+// --coop：本機多人合作戰鬥 (主持端建立 Unix socket 等候其他玩家，--join 加入)；每位玩家操作輪流分配的隊員
+int runCoopCommand(const CliArgs& args) {
+#ifdef _WIN32
+    cerr << "合作模式需要 Unix domain socket\n";
+    return 1;
+#else
+    string path = args.get("socket", "/tmp/rpg_coop.sock");
+    bool host = !args.has("join");
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) { cerr << "socket 路徑過長\n"; return 1; }
+    strcpy(addr.sun_path, path.c_str());
+    Pilot* strategy = nullptr; // 指定策略時由電腦代打 (不輸出)
+    if (args.has("strategy") && !(strategy = Autopilot::makePilot(args.get("strategy", "greedy")))) { cerr << "參數錯誤 (--strategy greedy|random)\n"; return 1; }
+
+    Coop::Setup setup;
+    memset(&setup, 0, sizeof(setup));
+    vector<int> fds;
+    // 開局設定的檢查：主持端檢查參數，加入端檢查收到的封包 (欄位直接用來索引陣列)
+    auto validSetup = [](const Coop::Setup& s) {
+        bool valid = s.players >= 2 && s.partySize >= s.players && s.partySize <= MAX_TEAM_SIZE
+                  && s.player >= 0 && s.player < s.players
+                  && s.enemies >= 1 && s.enemies <= RAID_MAX_WAVE && s.location >= 0 && s.location < (int)LOCATIONS.size();
+        for (int i = 0; i < s.partySize && valid; ++i) valid = s.party[i] >= 0 && s.party[i] <= NPC_COUNT;
+        return valid;
+    };
+    if (host) {
+        vector<int> ids = parseIntList(args.get("party", "0,1,7,11"));
+        setup.magic = Coop::SETUP_MAGIC;
+        setup.players = args.getInt("players", 2);
+        setup.seed = args.getInt("seed", chrono::steady_clock::now().time_since_epoch().count());
+        setup.level = args.getInt("level", 5);
+        setup.location = args.getInt("location", 1);
+        setup.enemies = args.getInt("enemies", 2);
+        setup.partySize = ids.size();
+        for (size_t i = 0; i < ids.size() && i < (size_t)MAX_TEAM_SIZE; ++i) setup.party[i] = ids[i];
+        if (!validSetup(setup)) { delete strategy; cerr << "參數錯誤\n"; return 1; }
+        int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (lfd < 0 || bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, setup.players) != 0) { perror("socket"); delete strategy; return 1; }
+        cout << "等候 " << setup.players - 1 << " 名玩家加入: " << path << endl;
+        for (int player = 1; player < setup.players; ++player) {
+            int fd = accept(lfd, nullptr, nullptr);
+            setup.player = player;
+            if (fd < 0 || !Coop::sendAll(fd, &setup, sizeof(setup))) { perror("accept"); close(lfd); delete strategy; return 1; }
+            fds.push_back(fd);
+            cout << "玩家 " << player << " 已加入" << endl;
+        }
+        close(lfd);
+        unlink(path.c_str());
+        setup.player = 0;
+    } else {
+        // 主持端可能稍晚啟動，連線失敗時重試幾秒
+        int fd = -1;
+        for (int attempt = 0; attempt < 50 && fd < 0; ++attempt) {
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) break;
+            close(fd); fd = -1;
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        if (fd < 0 || !Coop::recvAll(fd, &setup, sizeof(setup)) || setup.magic != Coop::SETUP_MAGIC) { cerr << "無法加入: " << path << "\n"; if (fd >= 0) close(fd); delete strategy; return 1; }
+        if (!validSetup(setup)) { cerr << "主持端送來的開局設定無效: " << path << "\n"; close(fd); delete strategy; return 1; }
+        fds.push_back(fd);
+    }
+
+    // 各玩家以相同種子建立同一場戰鬥
+    RngStream rng(setup.seed);
+    RngScope rngScope(rng);
+    gState = freshState();
+    currentLocation = LOCATIONS[setup.location];
+    Party team;
+    for (int i = 0; i < setup.partySize; ++i) team.add(createCharacter(setup.party[i], setup.level));
+    EnemyGroup enemies = generateWave(team, setup.enemies);
+    Coop::Session session(host, setup.player, setup.players, fds);
+    cout << "你是玩家 " << setup.player << "，負責:";
+    for (size_t i = 0; i < team.size(); ++i) if (session.controls(i)) cout << " " << team[i]->getName();
+    cout << endl;
+    if (strategy) headless = true;
+    else Input::start();
+#ifndef MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN); // 無法逐次關閉 SIGPIPE 的平台：對方斷線時由 sendAll 回報錯誤
+#endif
+    Coop::session = &session;
+    pilot = strategy;
+    battle(team, enemies);
+    pilot = nullptr;
+    Coop::session = nullptr;
+    headless = false;
+
+    int rc = 0;
+    if (!session.lastError().empty()) { cerr << Color::RED << session.lastError() << Color::RESET << "\n"; rc = 2; }
+    else cout << (team.wiped() ? "戰鬥失敗" : "戰鬥勝利") << " | 核對回合: " << session.verifiedRounds() << "\n";
+    for (int fd : fds) close(fd);
+    for (auto* c : team.release()) delete c;
+    delete strategy;
+    return rc;
+#endif
+}
+
+// --watch：附加到廣播檔觀看進行中的戰鬥 (唯讀，可隨時加入或離開，不影響遊戲)
+int runWatchCommand(const CliArgs& args) {
+    string path = args.get("in", "");
+    Spectate::Reader reader;
+    if (path.empty() || !reader.attach(path)) { cerr << "無法讀取廣播檔 " << path << "\n"; return 1; }
+    vector<Spectate::Event> units;            // 目前畫面的單位 (收到回合或結束標記時顯示)
+    vector<string> partyNames, enemyNames;     // 最近一次畫面的名稱 (行動訊息用)
+    uint64_t reported = 0;
+    Spectate::Event e;
+    while (!reader.closed()) {
+        Memory::poll();
+        if (!reader.poll(e)) { this_thread::sleep_for(chrono::milliseconds(5)); continue; }
+        if (reader.dropped > reported) {
+            cout << Color::GRAY << "(進度落後，略過 " << reader.dropped - reported << " 筆事件)" << Color::RESET << "\n";
+            reported = reader.dropped;
+        }
+        switch (e.kind) {
+            case Spectate::EV_START:
+                units.clear();
+                cout << Color::RED << "\n=== 戰鬥開始：" << e.name << " ===" << Color::RESET << endl;
+                break;
+            case Spectate::EV_UNIT:
+                units.push_back(e);
+                break;
+            case Spectate::EV_ROUND:
+            case Spectate::EV_END:
+                partyNames.clear(); enemyNames.clear();
+                for (const auto& u : units) (u.side == 0 ? partyNames : enemyNames).push_back(u.name);
+                Spectate::render(units);
+                units.clear();
+                if (e.kind == Spectate::EV_ROUND) cout << Color::BLUE << "--- Round " << e.round << " ---" << Color::RESET << endl;
+                else cout << (e.value ? Color::GREEN + "=== 勝利 ===" : Color::RED + "=== 全滅 ===") << Color::RESET << endl;
+                break;
+            case Spectate::EV_ACTION: {
+                const vector<string>& actors = e.side == 0 ? partyNames : enemyNames;
+                const vector<string>& targets = e.side == 0 ? enemyNames : partyNames;
+                string who = e.index < actors.size() ? actors[e.index] : "?";
+                string whom = (e.target >= 0 && e.target < (int)targets.size()) ? targets[e.target] : "全體";
+                if (e.value < 0) cout << who << " → " << whom << "：被閃避\n";
+                else cout << who << (e.skill >= 0 ? " (技能)" : "") << " → " << whom << "：" << e.value << " 傷害\n";
+                break;
+            }
+        }
+    }
+    cout << "廣播結束\n";
+    return 0;
+}
+
+// --formula：編譯技能算式並顯示位元組碼，再與手寫的 AttackSkill::use 比較每次評估的耗時
+// (預設算式含條件分支，走特化的直接計算；另外一律量測強制直譯的耗時，直接計算的形式也看得到直譯成本)
+int runFormulaCommand(const CliArgs& args) {
+    string expr = args.get("expr", "user.atk * (target.hpr < 0.3 ? 3.2 : 2.3)");
+    long long iterations = args.getInt("iterations", 20000000);
+    int charId = args.getInt("char", 1);
+    int level = args.getInt("level", 10);
+    Formula::Program prog;
+    string err;
+    if (!Formula::Compiler(expr).compile(prog, err)) { cerr << "編譯失敗: " << err << "\n"; return 1; }
+    Character* user = createCharacter(charId, level);
+    if (!user || iterations < 1) { delete user; cerr << "參數錯誤\n"; return 1; }
+    cout << "算式: " << expr << "\n";
+    prog.disassemble(cout);
+
+    Party team;
+    team.add(user);
+    EnemyGroup foes;
+    foes.add(Monster("測試目標", 400, 30, NORMAL, 0, 20));
+    RngStream rng(args.getInt("seed", 1));
+    Sim::HeadlessScope scope(rng);
+    Formula::FoeScope focus(foes);
+    Formula::aimAt(0); // 與戰鬥迴圈相同：施放前先鎖定目標
+    // 基準為 ATK × 2.2 的手寫技能；前兩者都經由虛擬呼叫 Skill::use，第三者直接進直譯迴圈
+    AttackSkill handWritten("基準", "", ATK, 2.2, 0, 0);
+    FormulaSkill compiled("公式", "", FORMULA_DAMAGE, expr, 0);
+    Skill* skills[2] = {&handWritten, &compiled};
+    const Formula::Program* volatile interpreted = &prog;
+    Formula::Context ctx = {user, &team};
+    double nanos[3] = {1e18, 1e18, 1e18};
+    long long checksum[3] = {0, 0, 0};
+    // 交替量測多輪，各取最快的一輪 (排除其他行程干擾)
+    const int ROUNDS = 10;
+    long long perRound = std::max(1LL, iterations / ROUNDS);
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int k = 0; k < 3; ++k) {
+            Skill* volatile skill = skills[k % 2]; // 避免編譯器把虛擬呼叫特化掉
+            long long sum = 0;
+            auto start = chrono::steady_clock::now();
+            if (k < 2) for (long long i = 0; i < perRound; ++i) sum += skill->use(user, team);
+            else for (long long i = 0; i < perRound; ++i) sum += std::max(0, (int)interpreted->execute(ctx));
+            nanos[k] = std::min(nanos[k], chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / perRound);
+            checksum[k] += sum;
+        }
+    }
+    cout << fixed << setprecision(2);
+    cout << "結果: " << compiled.use(user, team) << " (AttackSkill: " << handWritten.use(user, team) << ")\n";
+    cout << "AttackSkill::use  " << nanos[0] << " ns/次\n";
+    cout << "FormulaSkill::use " << nanos[1] << " ns/次 (" << nanos[1] / nanos[0] << "x"
+         << (prog.isDirect() ? "，直接計算" : "，直譯") << ")\n";
+    cout << "Program::execute  " << nanos[2] << " ns/次 (" << nanos[2] / nanos[0] << "x，強制直譯)\n";
+    if (checksum[0] == 0 && checksum[1] == 0 && checksum[2] == 0) cout << "(結果皆為 0)\n";
+    for (auto* c : team.release()) delete c;
+    return 0;
+}
+
+// --transcript：把 --transcript 寫出的二進位戰鬥記錄轉成文字
+int runTranscriptCommand(const CliArgs& args) {
+    string path = args.get("in", "");
+    if (path.empty()) { cerr << "需要 --in 記錄檔\n"; return 1; }
+    if (!Transcript::decodeFile(path, cout, args.getInt("thread", -1))) { cerr << "無法解碼 " << path << "\n"; return 1; }
+    return 0;
+}
+
+// --memcheck：跑一批模擬後檢查各子系統沒有殘留配置，並可限制峰值 (失敗時結束碼為 1，可當測試斷言)
+int runMemcheckCommand(const CliArgs& args) {
+    vector<int> ids = parseIntList(args.get("party", "0,1,7,11"));
+    int level = args.getInt("level", 5);
+    int loc = args.getInt("location", 3);
+    int waveSize = args.getInt("enemies", 3);
+    long long battles = args.getInt("battles", 2000);
+    long long maxPeak = args.getInt("max-peak-kb", 0) * 1024;
+    if (ids.empty() || loc < 0 || loc >= (int)LOCATIONS.size() || waveSize < 1 || battles < 1 || maxPeak < 0) { cerr << "參數錯誤\n"; return 1; }
+    GameState fresh = freshState();
+    auto run = [&](long long n) {
+        EncounterTable table;
+        table.build(LOCATIONS[loc], fresh);
+        return Sim::runBatch(ids, level, n, 1, [&](const Party& team) {
+            EnemyGroup wave;
+            for (int i = 0; i < waveSize; ++i) wave.add(table.spawnMinion(team.averagePower()));
+            return wave;
+        }, Sim::Options());
+    };
+    run(1); // 暖機：公式編譯快取等一次性配置不算殘留
+    Memory::Usage before[Memory::TAG_COUNT + 1];
+    for (int t = 0; t <= Memory::TOTAL; ++t) before[t] = Memory::usage(t);
+    Memory::resetPeaks();
+    Sim::Summary sum = run(battles);
+    Memory::report(cout);
+    bool ok = true;
+    for (int t = 0; t <= Memory::TOTAL; ++t) {
+        Memory::Usage after = Memory::usage(t);
+        if (after.live == before[t].live) continue;
+        cout << "殘留: " << (t < Memory::TOTAL ? Memory::TAG_NAMES[t] : "總計") << " " << after.live - before[t].live << " 位元組\n";
+        ok = false;
+    }
+    long long peak = Memory::usage(Memory::TOTAL).peak - before[Memory::TOTAL].live;
+    cout << "場數: " << sum.battles << " | 模擬期間峰值增量: " << peak << " 位元組\n";
+    if (maxPeak > 0 && peak > maxPeak) { cout << "峰值超過上限 " << maxPeak << " 位元組\n"; ok = false; }
+    cout << (ok ? "PASS" : "FAIL") << "\n";
+    return ok ? 0 : 1;
+}
+
+// --stream：由標準輸入逐行讀取情境並行評估，結果逐行寫到標準輸出
+int runStreamCommand(const CliArgs& args) {
+    Stream::Config cfg;
+    cfg.threads = args.getInt("threads", 0);
+    cfg.inflight = args.getInt("inflight", 0);
+    cfg.ordered = args.has("ordered");
+    if (cfg.threads < 0 || cfg.inflight < 0) { cerr << "參數錯誤\n"; return 1; }
+    Stream::Pipeline pipeline(cfg, cin, cout);
+    pipeline.run();
+    cerr << "串流: " << pipeline.records << " 筆情境，錯誤 " << pipeline.errors << " 筆\n";
+    return pipeline.errors ? 2 : 0;
+}
+
+// --compare：以共同亂數、對偶與控制變量比較兩個平衡變體，並回報各方法的變異數縮減
+int runCompareCommand(const CliArgs& args) {
+    Compare::Config cfg;
+    string partyText = args.get("party", "");
+    if (!partyText.empty()) cfg.party = parseIntList(partyText);
+    cfg.level = args.getInt("level", cfg.level);
+    cfg.location = args.getInt("location", cfg.location);
+    cfg.enemies = args.getInt("enemies", cfg.enemies);
+    cfg.skill = args.get("skill", "");
+    cfg.multiplier = atof(args.get("multiplier", "1").c_str());
+    cfg.enemyMod = atof(args.get("enemy-mod", "1").c_str());
+    cfg.battles = args.getInt("battles", cfg.battles);
+    cfg.antithetic = args.has("antithetic");
+    cfg.align = !args.has("no-align");
+    cfg.threads = args.getInt("threads", 0);
+    cfg.seed = args.getInt("seed", 1);
+    bool badParty = cfg.party.empty();
+    for (int id : cfg.party) badParty = badParty || id < 0 || id >= CHARACTER_COUNT;
+    if (badParty || cfg.level < 1 || cfg.location < 0 || cfg.location >= (int)LOCATIONS.size() || cfg.enemies < 1
+        || cfg.battles < 2 || cfg.multiplier <= 0 || cfg.enemyMod <= 0) { cerr << "參數錯誤\n"; return 1; }
+    if (cfg.skill.empty() && cfg.multiplier != 1) { cerr << "--multiplier 需搭配 --skill\n"; return 1; }
+    if (!cfg.skill.empty() && cfg.skill != "all") {
+        Party team;
+        Sim::buildParty(team, cfg.party, cfg.level);
+        bool found = false;
+        for (auto* c : team) for (auto* s : c->getSkills()) found = found || (dynamic_cast<AttackSkill*>(s) && s->getName() == cfg.skill);
+        for (auto* c : team.release()) delete c;
+        if (!found) { cerr << "隊伍中沒有攻擊技能: " << cfg.skill << "\n"; return 1; }
+    }
+    cout << "變體 B: " << (cfg.skill.empty() ? "" : cfg.skill + " 倍率 ×" + args.get("multiplier", "1") + " ")
+         << (cfg.enemyMod != 1 ? "怪物強度 ×" + args.get("enemy-mod", "1") : "") << "\n";
+    cout << "地點: " << LOCATIONS[cfg.location].name << " | 每個變體 " << cfg.battles << " 場"
+         << (cfg.antithetic ? " (含對偶)" : "") << (cfg.align ? "" : " | 不對齊行動亂數") << "\n";
+    Compare::report(Compare::run(cfg), cfg, cout);
+    return 0;
+}
+
+// 命令列模式分派
+int runCommand(const CliArgs& args) {
+    if (args.mode == "--sim") return runSimCommand(args);
+    if (args.mode == "--tune") return runTuneCommand(args);
+    if (args.mode == "--scan") return runScanCommand(args);
+    if (args.mode == "--stats") return runStatsCommand(args);
+    if (args.mode == "--autopilot") return runAutopilotCommand(args);
+    if (args.mode == "--coop") return runCoopCommand(args);
+    if (args.mode == "--watch") return runWatchCommand(args);
+    if (args.mode == "--formula") return runFormulaCommand(args);
+    if (args.mode == "--explore") return runExploreCommand(args);
+    if (args.mode == "--transcript") return runTranscriptCommand(args);
+    if (args.mode == "--memcheck") return runMemcheckCommand(args);
+    if (args.mode == "--stream") return runStreamCommand(args);
+    if (args.mode == "--compare") return runCompareCommand(args);
+    cerr << "未知的模式: " << args.mode << "\n";
+    return 1;
+}
+
+// --profile PATH：在整個命令期間取樣，結束時寫出 folded 堆疊
+int runProfiledCommand(const CliArgs& args) {
+#ifdef __linux__
+    // 子行程不繼承 ITIMER_PROF，多行程時報表只會有協調者的樣本
+    if (args.getInt("processes", 1) > 1) { cerr << "--profile 不支援多行程，請改用 --processes 1\n"; return 1; }
+    string path = args.get("profile", "rpg_profile.folded");
+    int hz = (int)max(1LL, args.getInt("profile-hz", 1000));
+    size_t words = (size_t)max(1LL, args.getInt("profile-mb", 64)) * 1024 * 1024 / sizeof(uintptr_t);
+    if (!Profiler::start(hz, words)) { cerr << "無法啟動取樣計時器\n"; return runCommand(args); }
+    int code = runCommand(args);
+    Profiler::stop();
+    if (Profiler::write(path, cerr) < 0) { cerr << "無法寫入: " << path << "\n"; return 1; }
+    return code;
+#else
+    cerr << "此平台不支援 --profile\n";
+    return runCommand(args);
+#endif
+}
+
+// ==========================================
+// 主程式 (Main Loop)
+// ==========================================
+
+int main(int argc, char** argv) {
+    setupConsole(); // 設定編碼為 UTF-8 (Windows)
+    CliArgs args(argc, argv);
+#ifndef _WIN32
+    signal(SIGUSR1, Memory::onSignal); // 執行中隨時查詢記憶體用量
+#endif
+    if (args.has("memory")) atexit(Memory::reportAtExit);
+    if (argc > 1 && args.mode != "--play") return args.has("profile") ? runProfiledCommand(args) : runCommand(args); // 無頭工具模式
+    // --play --broadcast 路徑：一般遊戲，並把戰鬥廣播給觀戰端
+    Spectate::Ring ring;
+    if (args.has("broadcast")) {
+        long long slots = args.getInt("slots", 4096);
+        if (slots < 1 || slots > Spectate::MAX_SLOTS) { cerr << "--slots 須介於 1 與 " << Spectate::MAX_SLOTS << " 之間\n"; return 1; }
+        if (!ring.create(args.get("broadcast", ""), (uint32_t)slots)) { cerr << "無法建立廣播檔\n"; return 1; }
+        Spectate::ring = &ring;
+    }
+    // --play --events：互動模式同步分派，輸出端與遊戲文字依序出現
+    Bus::Session events;
+    if (!events.open(splitList(args.get("events", ""), ','), cout, true)) return 1;
+    Input::start(); // 終端機逐鍵輸入 (非終端機時沿用逐行輸入)
+    
+    // 隊伍與待命成員
+    Party team;
+    vector<Character*> reserve;
+
+    // 遊戲主迴圈
+    bool appRunning = true;
+    while(appRunning) {
+        // 初始化遊戲
+        resetGame(team, reserve);
+
+        // 遊戲內迴圈
+        while (playTurn(team, reserve)) Memory::poll();
+
+        // 結算畫面與重玩詢問
+        cout << "\n==================================\n";
+        cout << "是否要重新開始遊戲？\n";
+        cout << "1. 重新開始遊戲 (初始化所有進度)\n";
+        cout << "0. 離開程式\n";
+        cout << "==================================\n";
+        
+        int choice = askChoice(D_RESTART, 0, 1);
+        if (choice == 0) appRunning = false;
+        // 否則繼續迴圈重玩
+    }
+
+    events.close();
+
     // 清理記憶體
-    for(auto* c : team) delete c;
+    for(auto* c : team.release()) delete c;
     for(auto* c : reserve) delete c;
     for(auto* i : shopItems) delete i; 
 